@@ -0,0 +1,1531 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "tokenset.h"
+
+/* Small LCG so runs are repeatable across platforms */
+static unsigned long bench_seed = 12345;
+
+static unsigned long
+bench_rand24(void)
+{
+   bench_seed = bench_seed * 1103515245UL + 12345UL;
+   return (bench_seed >> 8) & 0xffffffUL;
+}
+
+static unsigned long
+bench_rand(void)
+{
+   unsigned long hi = bench_rand24() & 0x7fUL;
+
+   return (hi << 24) | bench_rand24();
+}
+
+/* Uniform in [0, 1) */
+static double
+bench_unit(void)
+{
+   return (double) bench_rand24() / 16777216.0;
+}
+
+/* Monotonic wall clock in nanoseconds */
+static double
+bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return 1e9 * (double) ts.tv_sec + (double) ts.tv_nsec;
+}
+
+static double
+bench_ns(double t0, double t1, unsigned long ops)
+{
+   return (t1 - t0) / (double) (ops ? ops : 1);
+}
+
+/* Peak resident set size of this process, in kilobytes */
+static long
+bench_peak_rss(void)
+{
+   struct rusage ru;
+
+   getrusage(RUSAGE_SELF, &ru);
+
+   return ru.ru_maxrss;
+}
+
+/* Write a short key for i into buff; returns its length. Cheap and unordered. */
+static size_t
+bench_key(char *buff, unsigned long i)
+{
+   static const char digits[] = "0123456789abcdefghijklmnopqrstuv";
+   unsigned long x = (i + 1) * 2654435761UL;
+   size_t      n = 0;
+
+   buff[n++] = 'k';
+   do {
+      buff[n++] = digits[x & 31];
+      x >>= 5;
+   } while (x);
+   buff[n] = '\0';
+
+   return n;
+}
+
+static struct tokenset *
+bench_fill(unsigned long n, unsigned flags)
+{
+   struct tokenset *p = tokenset_new_with_flags(flags);
+   char        buff[32];
+   unsigned long i;
+
+   for (i = 0; i < n; i++) {
+      sprintf(buff, "tok%lu", i);
+      tokenset_add(p, buff);
+   }
+
+   return p;
+}
+
+/* Cost of tokenset_get_by_id() as the vocabulary grows */
+static void
+bench_byid(unsigned long max)
+{
+   unsigned long n;
+   unsigned long lookups = 2000000;
+
+   printf("%-12s %-12s %s\n", "tokens", "lookups", "ns/lookup");
+
+   for (n = 1000; n <= max; n *= 10) {
+      struct tokenset *p = bench_fill(n, 0);
+      unsigned long i;
+      unsigned long hits = 0;
+      double      t0, t1;
+
+      t0 = bench_now();
+      for (i = 0; i < lookups; i++)
+         if (NULL != tokenset_get_by_id(p, (unsigned) (bench_rand() % n)))
+            hits += 1;
+      t1 = bench_now();
+
+      printf("%-12lu %-12lu %.2f\n", n, hits, bench_ns(t0, t1, lookups));
+      tokenset_free(&p);
+   }
+}
+
+/* Cost of building and tearing down a tokenset, per allocation mode */
+static void
+bench_alloc(unsigned long max)
+{
+   unsigned    modes[2];
+   const char *names[2];
+   int         m;
+
+   modes[0] = 0;
+   names[0] = "malloc";
+   modes[1] = TOKENSET_ARENA;
+   names[1] = "arena";
+
+   printf("%-8s %-12s %-12s %s\n", "mode", "tokens", "ns/add", "ns/token free");
+
+   for (m = 0; m < 2; m++) {
+      unsigned long n;
+
+      for (n = 1000; n <= max; n *= 10) {
+         struct tokenset *p;
+         double      t0, t1, t2;
+
+         t0 = bench_now();
+         p = bench_fill(n, modes[m]);
+         t1 = bench_now();
+         tokenset_free(&p);
+         t2 = bench_now();
+
+         printf("%-8s %-12lu %-12.2f %.2f\n", names[m], n, bench_ns(t0, t1, n),
+                bench_ns(t1, t2, n));
+      }
+   }
+}
+
+/* Insert and lookup throughput of the uthash and flat engines */
+static void
+bench_engines(unsigned long max)
+{
+   unsigned long sizes[3];
+   unsigned    modes[2];
+   const char *names[2];
+   int         m, k;
+
+   sizes[0] = 10000;
+   sizes[1] = 1000000;
+   sizes[2] = 50000000;
+   modes[0] = TOKENSET_ARENA;
+   names[0] = "uthash";
+   modes[1] = TOKENSET_ARENA | TOKENSET_FLAT;
+   names[1] = "flat";
+
+   printf("%-8s %-12s %-12s %-12s %s\n", "engine", "tokens", "ns/insert", "ns/hit",
+          "ns/miss");
+
+   for (k = 0; k < 3 && sizes[k] <= max; k++) {
+      for (m = 0; m < 2; m++) {
+         struct tokenset *p = tokenset_new_with_flags(modes[m]);
+         unsigned long n = sizes[k];
+         unsigned long lookups = n < 2000000 ? 2000000 : n;
+         unsigned long i;
+         unsigned long found = 0;
+         char        buff[32];
+         size_t      len;
+         double      t0, t1, t2, t3;
+
+         t0 = bench_now();
+         for (i = 0; i < n; i++) {
+            len = bench_key(buff, i);
+            tokenset_add_n(p, buff, len);
+         }
+         t1 = bench_now();
+         for (i = 0; i < lookups; i++) {
+            len = bench_key(buff, bench_rand() % n);
+            found += tokenset_exists_n(p, buff, len);
+         }
+         t2 = bench_now();
+         for (i = 0; i < lookups; i++) {
+            len = bench_key(buff, n + bench_rand() % n);
+            found += tokenset_exists_n(p, buff, len);
+         }
+         t3 = bench_now();
+
+         printf("%-8s %-12lu %-12.2f %-12.2f %.2f\n", names[m], n, bench_ns(t0, t1, n),
+                bench_ns(t1, t2, lookups), bench_ns(t2, t3, lookups));
+         if (found != lookups)
+            fprintf(stderr, "warning: %lu hits, expected %lu\n", found, lookups);
+         tokenset_free(&p);
+      }
+   }
+}
+
+/* tokenset_add_n() one key at a time against tokenset_add_batch() */
+static void
+bench_batch(unsigned long max)
+{
+   unsigned    modes[2];
+   const char *names[2];
+   unsigned long stream = 4000000;
+   size_t      batch = 1024;
+   char       *blob = (char *) malloc(batch * 16);
+   const char **keys = (const char **) malloc(batch * sizeof(char *));
+   size_t     *lens = (size_t *) malloc(batch * sizeof(size_t));
+   int        *ids = (int *) malloc(batch * sizeof(int));
+   int         m;
+
+   modes[0] = TOKENSET_ARENA;
+   names[0] = "uthash";
+   modes[1] = TOKENSET_ARENA | TOKENSET_FLAT;
+   names[1] = "flat";
+
+   printf("%-8s %-12s %-12s %s\n", "engine", "vocabulary", "ns/add", "ns/add (batch)");
+
+   for (m = 0; m < 2; m++) {
+      unsigned long n;
+
+      for (n = 10000; n <= max; n *= 10) {
+         struct tokenset *p = tokenset_new_with_flags(modes[m]);
+         struct tokenset *q = tokenset_new_with_flags(modes[m]);
+         unsigned long i;
+         size_t      j;
+         double      t0, t1, t2;
+         double      single = 0, batched = 0;
+
+         for (i = 0; i < stream; i += batch) {
+            for (j = 0; j < batch; j++) {
+               keys[j] = blob + 16 * j;
+               lens[j] = bench_key(blob + 16 * j, bench_rand() % n);
+            }
+            t0 = bench_now();
+            for (j = 0; j < batch; j++)
+               ids[j] = tokenset_add_n(p, keys[j], lens[j]);
+            t1 = bench_now();
+            tokenset_add_batch(q, keys, lens, batch, ids);
+            t2 = bench_now();
+            single += t1 - t0;
+            batched += t2 - t1;
+         }
+
+         printf("%-8s %-12lu %-12.2f %.2f\n", names[m], n, single / stream,
+                batched / stream);
+         tokenset_free(&p);
+         tokenset_free(&q);
+      }
+   }
+
+   free(blob);
+   free(keys);
+   free(lens);
+   free(ids);
+}
+
+/* Fresh lookup keys "tok<k>" for a vocabulary of n; one in four misses */
+static void
+bench_lookup_keys(char *blob, const char **keys, size_t *lens, size_t batch,
+                  unsigned long n)
+{
+   size_t      j;
+
+   for (j = 0; j < batch; j++) {
+      unsigned long k = bench_rand() % n;
+      keys[j] = blob + 16 * j;
+      lens[j] = sprintf(blob + 16 * j, "tok%lu", j % 4 ? k : k + n);
+   }
+}
+
+/* tokenset_id_n() one key at a time against tokenset_id_batch() */
+static void
+bench_lookup(unsigned long max)
+{
+   unsigned    modes[2];
+   const char *names[2];
+   unsigned long stream = 4000000;
+   size_t      batch = 1024;
+   char       *blob = (char *) malloc(batch * 16);
+   const char **keys = (const char **) malloc(batch * sizeof(char *));
+   size_t     *lens = (size_t *) malloc(batch * sizeof(size_t));
+   int        *ids = (int *) malloc(batch * sizeof(int));
+   int         m;
+
+   modes[0] = TOKENSET_ARENA;
+   names[0] = "uthash";
+   modes[1] = TOKENSET_ARENA | TOKENSET_FLAT;
+   names[1] = "flat";
+
+   printf("%-8s %-12s %-12s %s\n", "engine", "vocabulary", "ns/id", "ns/id (batch)");
+
+   for (m = 0; m < 2; m++) {
+      unsigned long n;
+
+      for (n = 10000; n <= max; n *= 10) {
+         struct tokenset *p = bench_fill(n, modes[m]);
+         unsigned long i;
+         size_t      j;
+         double      t0, t1, t2, t3;
+         double      single = 0, batched = 0;
+
+         for (i = 0; i < stream; i += batch) {
+            bench_lookup_keys(blob, keys, lens, batch, n);
+            t0 = bench_now();
+            for (j = 0; j < batch; j++)
+               ids[j] = tokenset_id_n(p, keys[j], lens[j]);
+            t1 = bench_now();
+            bench_lookup_keys(blob, keys, lens, batch, n);
+            t2 = bench_now();
+            tokenset_id_batch(p, keys, lens, batch, ids);
+            t3 = bench_now();
+            single += t1 - t0;
+            batched += t3 - t2;
+         }
+
+         printf("%-8s %-12lu %-12.2f %.2f\n", names[m], n, single / stream,
+                batched / stream);
+         tokenset_free(&p);
+      }
+   }
+
+   free(blob);
+   free(keys);
+   free(lens);
+   free(ids);
+}
+
+/* Hash speed and resulting table shape for each hash, on 20-60 byte tokens */
+static void
+bench_hash(unsigned long max)
+{
+   unsigned    hashes[3];
+   const char *names[3];
+   char       *blob = (char *) malloc(max * 64);
+   size_t     *lens = (size_t *) malloc(max * sizeof(size_t));
+   size_t      bytes = 0;
+   unsigned long i;
+   int         h, e;
+
+   hashes[0] = TOKENSET_HASH_JEN;
+   names[0] = "jen";
+   hashes[1] = TOKENSET_HASH_XXH32;
+   names[1] = "xxh32";
+   hashes[2] = TOKENSET_HASH_WY;
+   names[2] = "wy";
+
+   for (i = 0; i < max; i++) {
+      size_t      j;
+
+      lens[i] = 20 + bench_rand() % 41;
+      for (j = 0; j < lens[i]; j++)
+         blob[64 * i + j] = (char) ('a' + bench_rand24() % 26);
+      bytes += lens[i];
+   }
+
+   printf("%-6s %-7s %-10s %-10s %-10s %-9s %s\n", "hash", "engine", "GB/s", "ns/add",
+          "ns/id", "max_chain", "chains (0 1 2 ...)");
+
+   for (h = 0; h < 3; h++) {
+      unsigned    sink = 0;
+      double      t0, t1, t2, t3, t4;
+      int         rep;
+
+      t0 = bench_now();
+      for (rep = 0; rep < 10; rep++)
+         for (i = 0; i < max; i++)
+            sink += tokenset_hash_with(hashes[h], blob + 64 * i, lens[i]);
+      t1 = bench_now();
+
+      for (e = 0; e < 2; e++) {
+         struct tokenset *p = tokenset_new_with_flags(hashes[h] | TOKENSET_ARENA
+                                                      | (e ? TOKENSET_FLAT : 0));
+         struct tokenset_stats st;
+         int         k;
+
+         t2 = bench_now();
+         for (i = 0; i < max; i++)
+            tokenset_add_n(p, blob + 64 * i, lens[i]);
+         t3 = bench_now();
+         for (i = 0; i < max; i++)
+            sink += tokenset_id_n(p, blob + 64 * i, lens[i]);
+         t4 = bench_now();
+         tokenset_stats(p, &st);
+
+         printf("%-6s %-7s %-10.2f %-10.2f %-10.2f %-9lu", names[h], st.engine,
+                10.0 * bytes / (t1 - t0), bench_ns(t2, t3, max), bench_ns(t3, t4, max),
+                (unsigned long) st.max_chain);
+         for (k = 0; k <= (int) st.max_chain && k < TOKENSET_STATS_CHAINS; k++)
+            printf(" %lu", (unsigned long) st.chains[k]);
+         printf("\n");
+         tokenset_free(&p);
+      }
+
+      if (sink == 42)
+         fprintf(stderr, " ");
+   }
+
+   free(blob);
+   free(lens);
+}
+
+/* One token checked against three sets: hashed by each set, or once and passed along */
+static void
+bench_hashed(unsigned long max)
+{
+   struct tokenset *sets[3];
+   char       *blob = (char *) malloc(max * 32);
+   size_t     *lens = (size_t *) malloc(max * sizeof(size_t));
+   unsigned long i, found = 0;
+   double      t0, t1, t2;
+   int         k;
+
+   for (i = 0; i < max; i++)
+      lens[i] = bench_key(blob + 32 * i, i);
+
+   /* A vocabulary of every key, and two small sets of every 100th and 1000th */
+   sets[0] = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   sets[1] = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   sets[2] = tokenset_new_with_flags(TOKENSET_ARENA);
+   for (i = 0; i < max; i++) {
+      tokenset_add_n(sets[0], blob + 32 * i, lens[i]);
+      if (0 == i % 100)
+         tokenset_add_n(sets[1], blob + 32 * i, lens[i]);
+      if (0 == i % 1000)
+         tokenset_add_n(sets[2], blob + 32 * i, lens[i]);
+   }
+
+   t0 = bench_now();
+   for (i = 0; i < max; i++)
+      for (k = 0; k < 3; k++)
+         found += tokenset_exists_n(sets[k], blob + 32 * i, lens[i]);
+   t1 = bench_now();
+   for (i = 0; i < max; i++) {
+      unsigned    hv = tokenset_hash(blob + 32 * i, lens[i]);
+
+      for (k = 0; k < 3; k++)
+         found += tokenset_exists_hashed(sets[k], blob + 32 * i, lens[i], hv);
+   }
+   t2 = bench_now();
+
+   printf("%-10s %-10s %s\n", "method", "tokens", "ns/token (3 sets)");
+   printf("%-10s %-10lu %.2f\n", "exists_n", max, bench_ns(t0, t1, max));
+   printf("%-10s %-10lu %.2f\n", "hashed", max, bench_ns(t1, t2, max));
+   if (found == 42)
+      fprintf(stderr, " ");
+
+   for (k = 0; k < 3; k++)
+      tokenset_free(&sets[k]);
+   free(blob);
+   free(lens);
+}
+
+/* tokenset_exists_n() with and without TOKENSET_BLOOM as more of the lookups miss */
+static void
+bench_bloom(unsigned long max)
+{
+   static const int misses[] = { 0, 50, 90, 99, 100 };
+   char       *blob = (char *) malloc(max * 32);
+   size_t     *lens = (size_t *) malloc(max * sizeof(size_t));
+   unsigned long i, found = 0;
+   double      t0, t1;
+   int         e, b, r;
+
+   printf("%-7s %-6s %-8s %-10s %s\n", "engine", "bloom", "miss %", "tokens", "ns/lookup");
+   for (e = 0; e < 2; e++)
+      for (b = 0; b < 2; b++) {
+         struct tokenset *p = tokenset_new_with_flags(TOKENSET_ARENA
+                                                      | (e ? TOKENSET_FLAT : 0)
+                                                      | (b ? TOKENSET_BLOOM : 0));
+
+         for (i = 0; i < max; i++)
+            tokenset_add_n(p, blob, bench_key(blob, i));
+
+         for (r = 0; r < (int) (sizeof(misses) / sizeof(misses[0])); r++) {
+            /* Absent keys come from past the end of the vocabulary */
+            for (i = 0; i < max; i++)
+               lens[i] = bench_key(blob + 32 * i, (int) (bench_rand() % 100) < misses[r]
+                                   ? max + i : bench_rand() % max);
+
+            t0 = bench_now();
+            for (i = 0; i < max; i++)
+               found += tokenset_exists_n(p, blob + 32 * i, lens[i]);
+            t1 = bench_now();
+
+            printf("%-7s %-6s %-8d %-10lu %.2f\n", e ? "flat" : "uthash", b ? "yes" : "no",
+                   misses[r], max, bench_ns(t0, t1, max));
+         }
+         tokenset_free(&p);
+      }
+
+   if (found == 42)
+      fprintf(stderr, " ");
+   free(blob);
+   free(lens);
+}
+
+/* Frozen against live lookups, and what each costs in memory */
+static void
+bench_freeze(unsigned long max)
+{
+   unsigned long lookups = 2000000;
+   unsigned long n, i;
+
+   printf("%-10s %-8s %-10s %-10s %-10s %s\n", "tokens", "set", "B/token", "ns/freeze",
+          "ns/hit", "ns/miss");
+
+   for (n = 10000; n <= max; n *= 10) {
+      long        rss0 = bench_peak_rss();
+      struct tokenset *p = tokenset_new();
+      struct tokenset_frozen *f;
+      unsigned long found = 0;
+      char        buff[32];
+      size_t      len;
+      double      t0, t1, t2, t3, t4, t5;
+      long        rss1;
+
+      for (i = 0; i < n; i++) {
+         len = bench_key(buff, i);
+         tokenset_add_n(p, buff, len);
+      }
+      rss1 = bench_peak_rss();
+
+      t0 = bench_now();
+      f = tokenset_freeze(p);
+      t1 = bench_now();
+      if (NULL == f) {
+         fprintf(stderr, "tokenset_freeze failed\n");
+         exit(1);
+      }
+
+      for (i = 0; i < lookups; i++) {
+         len = bench_key(buff, bench_rand() % n);
+         found += tokenset_exists_n(p, buff, len);
+      }
+      t2 = bench_now();
+      for (i = 0; i < lookups; i++) {
+         len = bench_key(buff, n + bench_rand() % n);
+         found += tokenset_exists_n(p, buff, len);
+      }
+      t3 = bench_now();
+      for (i = 0; i < lookups; i++) {
+         len = bench_key(buff, bench_rand() % n);
+         found += tokenset_frozen_exists_n(f, buff, len);
+      }
+      t4 = bench_now();
+      for (i = 0; i < lookups; i++) {
+         len = bench_key(buff, n + bench_rand() % n);
+         found += tokenset_frozen_exists_n(f, buff, len);
+      }
+      t5 = bench_now();
+
+      /* Live bytes from peak RSS, so only meaningful once it dwarfs the baseline */
+      printf("%-10lu %-8s %-10.1f %-10s %-10.2f %.2f\n", n, "live",
+             1024.0 * (rss1 - rss0) / n, "-", bench_ns(t1, t2, lookups),
+             bench_ns(t2, t3, lookups));
+      printf("%-10lu %-8s %-10.1f %-10.2f %-10.2f %.2f\n", n, "frozen",
+             (double) tokenset_frozen_bytes(f) / n, bench_ns(t0, t1, n),
+             bench_ns(t3, t4, lookups), bench_ns(t4, t5, lookups));
+      if (found != 2 * lookups)
+         fprintf(stderr, "warning: %lu hits, expected %lu\n", found, 2 * lookups);
+
+      tokenset_frozen_free(&f);
+      tokenset_free(&p);
+   }
+}
+
+/* Bytes per token besides the token itself, and speed, of tokensets against packed ones */
+static void
+bench_packed(unsigned long max)
+{
+   static const char *names[] = { "uthash", "flat", "packed" };
+   unsigned long lookups = 2000000;
+   unsigned long n, i;
+   int         e;
+
+   printf("%-10s %-8s %-10s %-10s %-10s %s\n", "tokens", "set", "B/token", "ns/add",
+          "ns/hit", "ns/miss");
+
+   for (n = 10000; n <= max; n *= 10)
+      for (e = 0; e < 3; e++) {
+         struct tokenset *p = NULL;
+         struct tokenset_packed *k = NULL;
+         struct tokenset_stats st;
+         unsigned long found = 0;
+         size_t      len, text = 0, bytes;
+         char        buff[32];
+         double      t0, t1, t2, t3;
+
+         if (2 == e)
+            k = tokenset_packed_new(0);
+         else
+            p = tokenset_new_with_flags(e ? TOKENSET_FLAT | TOKENSET_ARENA : 0);
+
+         t0 = bench_now();
+         for (i = 0; i < n; i++) {
+            len = bench_key(buff, i);
+            text += len;
+            if (2 == e)
+               tokenset_packed_add_n(k, buff, len);
+            else
+               tokenset_add_n(p, buff, len);
+         }
+         if (2 == e)
+            tokenset_packed_shrink(k);
+         t1 = bench_now();
+         for (i = 0; i < lookups; i++) {
+            len = bench_key(buff, bench_rand() % n);
+            found += 2 == e ? tokenset_packed_exists_n(k, buff, len)
+               : tokenset_exists_n(p, buff, len);
+         }
+         t2 = bench_now();
+         for (i = 0; i < lookups; i++) {
+            len = bench_key(buff, n + bench_rand() % n);
+            found += 2 == e ? tokenset_packed_exists_n(k, buff, len)
+               : tokenset_exists_n(p, buff, len);
+         }
+         t3 = bench_now();
+
+         if (2 == e)
+            bytes = tokenset_packed_bytes(k);
+         else {
+            tokenset_stats(p, &st);
+            bytes = st.total_bytes;
+         }
+         printf("%-10lu %-8s %-10.1f %-10.2f %-10.2f %.2f\n", n, names[e],
+                (double) (bytes - text) / n, bench_ns(t0, t1, n),
+                bench_ns(t1, t2, lookups), bench_ns(t2, t3, lookups));
+         if (found != lookups)
+            fprintf(stderr, "warning: %lu hits, expected %lu\n", found, lookups);
+
+         tokenset_packed_free(&k);
+         tokenset_free(&p);
+      }
+}
+
+/* Startup: rebuilding a vocabulary with tokenset_add() against mapping a saved one */
+static void
+bench_load(unsigned long max)
+{
+   const char *path = "t/bench.tks";
+   unsigned long lookups = 2000000;
+   unsigned long n, i;
+
+   printf("%-10s %-12s %-12s %-12s %s\n", "tokens", "ms/rebuild", "ms/save", "ms/open",
+          "ns/hit (mapped)");
+
+   for (n = 10000; n <= max; n *= 10) {
+      struct tokenset *p = tokenset_new();
+      struct tokenset_frozen *f;
+      unsigned long found = 0;
+      char        buff[32];
+      size_t      len;
+      double      t0, t1, t2, t3, t4;
+
+      t0 = bench_now();
+      for (i = 0; i < n; i++) {
+         len = bench_key(buff, i);
+         tokenset_add_n(p, buff, len);
+      }
+      t1 = bench_now();
+      if (0 != tokenset_save(p, path)) {
+         fprintf(stderr, "tokenset_save failed\n");
+         exit(1);
+      }
+      t2 = bench_now();
+      f = tokenset_open_mmap(path);
+      t3 = bench_now();
+      if (NULL == f) {
+         fprintf(stderr, "tokenset_open_mmap failed\n");
+         exit(1);
+      }
+
+      for (i = 0; i < lookups; i++) {
+         len = bench_key(buff, bench_rand() % n);
+         found += tokenset_frozen_exists_n(f, buff, len);
+      }
+      t4 = bench_now();
+
+      printf("%-10lu %-12.3f %-12.3f %-12.3f %.2f\n", n, (t1 - t0) / 1e6, (t2 - t1) / 1e6,
+             (t3 - t2) / 1e6, bench_ns(t3, t4, lookups));
+      if (found != lookups)
+         fprintf(stderr, "warning: %lu hits, expected %lu\n", found, lookups);
+
+      tokenset_frozen_free(&f);
+      tokenset_free(&p);
+      remove(path);
+   }
+}
+
+/* Keeping an ordered index against re-sorting, for a stream of adds mixed with range scans */
+static void
+bench_ordered(unsigned long max)
+{
+   unsigned long scans = 2000;
+   unsigned    modes[2];
+   const char *names[2];
+   int         m;
+
+   modes[0] = TOKENSET_FLAT | TOKENSET_ARENA;
+   names[0] = "sort";
+   modes[1] = TOKENSET_FLAT | TOKENSET_ARENA | TOKENSET_ORDERED;
+   names[1] = "ordered";
+
+   printf("%-8s %-10s %-10s %-14s %s\n", "index", "tokens", "ns/add", "us/add+scan",
+          "ns/iterated");
+
+   for (m = 0; m < 2; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+      struct tokenset_iter it;
+      unsigned long i, seen = 0;
+      char        buff[32];
+      size_t      len;
+      double      t0, t1, t2, t3;
+
+      t0 = bench_now();
+      for (i = 0; i < max; i++) {
+         len = bench_key(buff, i);
+         tokenset_add_n(p, buff, len);
+      }
+      t1 = bench_now();
+
+      /* Each scan sees the add before it, so without the index every scan re-sorts */
+      for (i = 0; i < scans; i++) {
+         int         k;
+
+         len = bench_key(buff, max + i);
+         tokenset_add_n(p, buff, len);
+         len = bench_key(buff, bench_rand() % max);
+         tokenset_lower_bound(p, &it, buff, len);
+         for (k = 0; k < 100 && tokenset_iter_next(&it, NULL, NULL, NULL); k++)
+            seen += 1;
+      }
+      t2 = bench_now();
+
+      tokenset_iter_init(p, &it, TOKENSET_ITER_SORTED);
+      while (tokenset_iter_next(&it, NULL, NULL, NULL))
+         seen += 1;
+      t3 = bench_now();
+
+      printf("%-8s %-10lu %-10.2f %-14.2f %.2f\n", names[m], max, bench_ns(t0, t1, max),
+             bench_ns(t1, t2, scans) / 1e3, bench_ns(t2, t3, max + scans));
+      tokenset_free(&p);
+   }
+}
+
+/* Sorting each engine's tokens on one thread and on several */
+static void
+bench_sort(unsigned long max, unsigned nthreads)
+{
+   unsigned    modes[2];
+   const char *names[2];
+   int         m;
+
+   modes[0] = TOKENSET_ARENA;
+   names[0] = "uthash";
+   modes[1] = TOKENSET_ARENA | TOKENSET_FLAT;
+   names[1] = "flat";
+
+   printf("%-8s %-10s %-8s %-10s %s\n", "engine", "tokens", "threads", "ms", "ns/token");
+
+   for (m = 0; m < 2; m++) {
+      unsigned    t;
+
+      for (t = 1; t <= nthreads; t *= 2) {
+         struct tokenset *p = tokenset_new_with_flags(modes[m]);
+         char        buff[32];
+         unsigned long i;
+         double      t0, t1;
+
+         bench_seed = 12345;
+         for (i = 0; i < max; i++) {
+            size_t      len = bench_key(buff, bench_rand());
+
+            tokenset_add_n(p, buff, len);
+         }
+
+         t0 = bench_now();
+         tokenset_sort_parallel(p, t);
+         t1 = bench_now();
+         printf("%-8s %-10d %-8u %-10.1f %.2f\n", names[m], tokenset_count(p), t,
+                (t1 - t0) / 1e6, bench_ns(t0, t1, tokenset_count(p)));
+         tokenset_free(&p);
+      }
+   }
+}
+
+/*
+ * The suite: a synthetic corpus, then every operation timed in turn
+ * against each engine configuration, reported as JSON. Each
+ * configuration runs in its own child process so peak RSS is its own.
+ */
+
+struct bench_corpus {
+   unsigned long vocab;                          /* distinct tokens in the stream */
+   unsigned long n;                              /* stream length */
+   int         zipf;                             /* Zipfian if nonzero, else uniform */
+   double      s;                                /* Zipf exponent */
+   unsigned    minlen;
+   unsigned    maxlen;
+   char       *blob;                             /* 2 * vocab tokens; the second half never occur */
+   const char **key;
+   size_t     *len;
+   unsigned long *stream;                        /* n indices into key[] */
+};
+
+static int
+bench_corpus_make(struct bench_corpus *c)
+{
+   struct tokenset *seen = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   unsigned long total = 2 * c->vocab;
+   unsigned long i;
+   double     *cdf = NULL;
+   char       *cp;
+
+   c->blob = (char *) malloc(total * (c->maxlen + 8));
+   c->key = (const char **) malloc(total * sizeof(char *));
+   c->len = (size_t *) malloc(total * sizeof(size_t));
+   c->stream = (unsigned long *) malloc(c->n * sizeof(unsigned long));
+   if (NULL == c->blob || NULL == c->key || NULL == c->len || NULL == c->stream)
+      return 1;
+
+   /* Random lowercase tokens, lengths uniform in [minlen, maxlen], all distinct */
+   cp = c->blob;
+   for (i = 0; i < total; i++) {
+      size_t      len = c->minlen + bench_rand() % (c->maxlen - c->minlen + 1);
+      unsigned    tries = 0;
+      size_t      j;
+
+      do {
+         if (++tries > 64 && len < c->maxlen + 7)
+            len += 1;                            /* short lengths ran out */
+         for (j = 0; j < len; j++)
+            cp[j] = (char) ('a' + bench_rand24() % 26);
+      } while (tokenset_exists_n(seen, cp, len));
+
+      tokenset_add_n(seen, cp, len);
+      cp[len] = '\0';
+      c->key[i] = cp;
+      c->len[i] = len;
+      cp += len + 1;
+   }
+   tokenset_free(&seen);
+
+   if (c->zipf) {
+      double      sum = 0;
+
+      cdf = (double *) malloc(c->vocab * sizeof(double));
+      if (NULL == cdf)
+         return 1;
+      for (i = 0; i < c->vocab; i++)
+         cdf[i] = (sum += 1.0 / pow((double) (i + 1), c->s));
+      for (i = 0; i < c->vocab; i++)
+         cdf[i] /= sum;
+   }
+
+   for (i = 0; i < c->n; i++) {
+      if (c->zipf) {
+         double      u = bench_unit();
+         unsigned long lo = 0, hi = c->vocab - 1;
+
+         while (lo < hi) {
+            unsigned long mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u)
+               lo = mid + 1;
+            else
+               hi = mid;
+         }
+         c->stream[i] = lo;
+      }
+      else
+         c->stream[i] = bench_rand() % c->vocab;
+   }
+
+   free(cdf);
+
+   return 0;
+}
+
+static void
+bench_corpus_free(struct bench_corpus *c)
+{
+   free(c->blob);
+   free(c->key);
+   free(c->len);
+   free(c->stream);
+}
+
+static void
+bench_record(FILE *out, int *first, const char *config, const char *op, unsigned long ops,
+             double t0, double t1)
+{
+   fprintf(out, "%s    {\"config\": \"%s\", \"op\": \"%s\", \"ops\": %lu, "
+           "\"ns_per_op\": %.2f, \"peak_rss_kb\": %ld}", *first ? "" : ",\n", config, op,
+           ops, bench_ns(t0, t1, ops), bench_peak_rss());
+   *first = 0;
+}
+
+static void
+bench_suite_run(FILE *out, int first, struct bench_corpus *c, const char *config,
+                unsigned flags)
+{
+   struct tokenset *p = tokenset_new_with_flags(flags);
+   unsigned long v = c->vocab;
+   unsigned long i;
+   unsigned long sink = 0;
+   char      **list;
+   double      t0, t1;
+
+   /* Every vocabulary token once: all misses */
+   t0 = bench_now();
+   for (i = 0; i < v; i++)
+      tokenset_add_n(p, c->key[i], c->len[i]);
+   t1 = bench_now();
+   bench_record(out, &first, config, "add_miss", v, t0, t1);
+
+   /* The stream again: all hits */
+   t0 = bench_now();
+   for (i = 0; i < c->n; i++)
+      sink += tokenset_add_n(p, c->key[c->stream[i]], c->len[c->stream[i]]);
+   t1 = bench_now();
+   bench_record(out, &first, config, "add_hit", c->n, t0, t1);
+
+   t0 = bench_now();
+   for (i = 0; i < c->n; i++)
+      sink += tokenset_id_n(p, c->key[c->stream[i]], c->len[c->stream[i]]);
+   t1 = bench_now();
+   bench_record(out, &first, config, "id", c->n, t0, t1);
+
+   /* Alternate members and non-members */
+   t0 = bench_now();
+   for (i = 0; i < c->n; i++) {
+      unsigned long k = c->stream[i] + (i & 1 ? v : 0);
+      sink += tokenset_exists_n(p, c->key[k], c->len[k]);
+   }
+   t1 = bench_now();
+   bench_record(out, &first, config, "exists", c->n, t0, t1);
+
+   t0 = bench_now();
+   for (i = 0; i < c->n; i++)
+      sink += (unsigned long) tokenset_get_by_id(p, (unsigned) c->stream[i]);
+   t1 = bench_now();
+   bench_record(out, &first, config, "get_by_id", c->n, t0, t1);
+
+   t0 = bench_now();
+   tokenset_sort(p);
+   t1 = bench_now();
+   bench_record(out, &first, config, "sort", v, t0, t1);
+
+   t0 = bench_now();
+   list = tokenset_get(p);
+   for (i = 0; NULL != list[i]; i++)
+      free(list[i]);
+   free(list);
+   t1 = bench_now();
+   bench_record(out, &first, config, "get", v, t0, t1);
+
+   t0 = bench_now();
+   for (i = 0; i < v; i++)
+      tokenset_remove_n(p, c->key[i], c->len[i]);
+   t1 = bench_now();
+   bench_record(out, &first, config, "remove", v, t0, t1);
+
+   for (i = 0; i < v; i++)
+      tokenset_add_n(p, c->key[i], c->len[i]);
+   t0 = bench_now();
+   tokenset_reset(p);
+   t1 = bench_now();
+   bench_record(out, &first, config, "reset", v, t0, t1);
+
+   tokenset_free(&p);
+
+   if (sink == 42)                               /* keep the loops honest */
+      fprintf(stderr, " ");
+}
+
+static int
+bench_suite(int argc, char *argv[])
+{
+   struct bench_corpus c;
+   const char *names[4];
+   unsigned    flags[4];
+   const char *path = NULL;
+   FILE       *out = stdout;
+   unsigned long seed;
+   int         k, opt;
+
+   names[0] = "uthash";
+   flags[0] = 0;
+   names[1] = "uthash+arena";
+   flags[1] = TOKENSET_ARENA;
+   names[2] = "flat";
+   flags[2] = TOKENSET_FLAT;
+   names[3] = "flat+arena";
+   flags[3] = TOKENSET_FLAT | TOKENSET_ARENA;
+
+   memset(&c, 0, sizeof(c));
+   c.vocab = 100000;
+   c.n = 1000000;
+   c.zipf = 1;
+   c.s = 1.0;
+   c.minlen = 3;
+   c.maxlen = 12;
+
+   while (-1 != (opt = getopt(argc, argv, "v:n:d:s:l:r:o:h"))) {
+      switch (opt) {
+         case 'v':
+            c.vocab = strtoul(optarg, NULL, 10);
+            break;
+         case 'n':
+            c.n = strtoul(optarg, NULL, 10);
+            break;
+         case 'd':
+            c.zipf = 0 == strcmp(optarg, "zipf");
+            break;
+         case 's':
+            c.s = atof(optarg);
+            break;
+         case 'l':
+            if (2 != sscanf(optarg, "%u:%u", &c.minlen, &c.maxlen))
+               c.maxlen = c.minlen = (unsigned) atoi(optarg);
+            break;
+         case 'r':
+            bench_seed = strtoul(optarg, NULL, 10);
+            break;
+         case 'o':
+            path = optarg;
+            break;
+         default:
+            fprintf(stderr, "usage: %s [-v vocabulary] [-n stream] [-d zipf|uniform] "
+                    "[-s exponent] [-l minlen:maxlen] [-r seed] [-o out.json]\n"
+                    "       %s byid|alloc|engines|batch|lookup|hash|hashed|bloom|packed|freeze|load|ingest|match|merge|ordered|sort|threads [max_tokens]\n",
+                    argv[0], argv[0]);
+            return 1;
+      }
+   }
+
+   if (0 == c.vocab || c.minlen < 1 || c.maxlen < c.minlen) {
+      fprintf(stderr, "%s: bad corpus parameters\n", argv[0]);
+      return 1;
+   }
+
+   seed = bench_seed;
+   if (bench_corpus_make(&c)) {
+      fprintf(stderr, "%s: out of memory building the corpus\n", argv[0]);
+      return 1;
+   }
+
+   if (NULL != path && NULL == (out = fopen(path, "w"))) {
+      perror(path);
+      return 1;
+   }
+
+   fprintf(out, "{\n  \"version\": \"%s\",\n", tokenset_version());
+   fprintf(out, "  \"corpus\": {\"distribution\": \"%s\", \"exponent\": %.2f, "
+           "\"vocabulary\": %lu, \"stream\": %lu, \"minlen\": %u, \"maxlen\": %u, "
+           "\"seed\": %lu},\n", c.zipf ? "zipf" : "uniform", c.s, c.vocab, c.n, c.minlen,
+           c.maxlen, seed);
+   fprintf(out, "  \"results\": [\n");
+
+   for (k = 0; k < 4; k++) {
+      pid_t       pid;
+
+      fflush(out);
+      pid = fork();
+      if (0 == pid) {
+         bench_suite_run(out, 0 == k, &c, names[k], flags[k]);
+         fflush(out);
+         _exit(0);
+      }
+      if (pid < 0)
+         bench_suite_run(out, 0 == k, &c, names[k], flags[k]);
+      else
+         waitpid(pid, NULL, 0);
+   }
+
+   fprintf(out, "\n  ]\n}\n");
+
+   if (stdout != out)
+      fclose(out);
+   bench_corpus_free(&c);
+
+   return 0;
+}
+
+/* Text ingestion throughput: the usual split-copy-add loop against the ingest calls */
+static void
+bench_ingest(unsigned long max)
+{
+   struct bench_corpus c;
+   const char *path = "t/bench.txt";
+   const char *names[3];
+   char       *text, *cp;
+   size_t      bytes;
+   unsigned long i;
+   int         m;
+
+   names[0] = "copy+add";
+   names[1] = "buffer";
+   names[2] = "fd";
+
+   memset(&c, 0, sizeof(c));
+   c.vocab = 100000;
+   c.n = max;
+   c.zipf = 1;
+   c.s = 1.0;
+   c.minlen = 3;
+   c.maxlen = 12;
+   text = NULL;
+   if (bench_corpus_make(&c) || NULL == (text = (char *) malloc(c.n * (c.maxlen + 9)))) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   /* Words, with now and then punctuation and a line break */
+   for (cp = text, i = 0; i < c.n; i++) {
+      memcpy(cp, c.key[c.stream[i]], c.len[c.stream[i]]);
+      cp += c.len[c.stream[i]];
+      if (0 == bench_rand() % 8)
+         *cp++ = ',';
+      *cp++ = 0 == i % 12 ? '\n' : ' ';
+   }
+   bytes = cp - text;
+
+   printf("%-10s %-12s %-12s %s\n", "method", "tokens", "MB/s", "ns/token");
+
+   for (m = 0; m < 3; m++) {
+      struct tokenset *p = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+      double      t0, t1;
+
+      if (2 == m) {
+         FILE       *out = fopen(path, "wb");
+
+         if (NULL == out || bytes != fwrite(text, 1, bytes, out)) {
+            fprintf(stderr, "cannot write %s\n", path);
+            exit(1);
+         }
+         fclose(out);
+      }
+
+      t0 = bench_now();
+      if (0 == m) {
+         char        word[64];
+         size_t      j, k = 0;
+
+         for (j = 0; j < bytes; j++) {
+            if (NULL == strchr(TOKENSET_DELIMS_PUNCT, text[j]) && k < sizeof(word) - 1)
+               word[k++] = text[j];
+            else if (k > 0) {
+               word[k] = '\0';
+               tokenset_add(p, word);
+               k = 0;
+            }
+         }
+      }
+      else if (1 == m)
+         tokenset_ingest_buffer(p, text, bytes, TOKENSET_DELIMS_PUNCT, NULL);
+      else {
+         int         fd = open(path, O_RDONLY);
+
+         tokenset_ingest_fd(p, fd, TOKENSET_DELIMS_PUNCT, NULL, NULL);
+         close(fd);
+      }
+      t1 = bench_now();
+
+      printf("%-10s %-12lu %-12.1f %.2f\n", names[m], (unsigned long) tokenset_count(p),
+             1e3 * bytes / (t1 - t0), bench_ns(t0, t1, c.n));
+      tokenset_free(&p);
+   }
+
+   remove(path);
+   free(text);
+   bench_corpus_free(&c);
+}
+
+/* Dictionary matching in unsegmented text: a lookup per candidate substring against the matcher */
+static void
+bench_match(unsigned long max)
+{
+   struct bench_corpus c;
+   struct tokenset *p = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   struct tokenset_matcher *m;
+   char       *text, *cp;
+   size_t      bytes, naive_bytes, found;
+   unsigned long i;
+   double      t0, t1, t2;
+
+   memset(&c, 0, sizeof(c));
+   c.vocab = 100000;
+   c.n = max;
+   c.zipf = 1;
+   c.s = 1.0;
+   c.minlen = 3;
+   c.maxlen = 12;
+   text = NULL;
+   if (bench_corpus_make(&c) || NULL == (text = (char *) malloc(c.n * c.maxlen + 1))) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   /* Words run together; the dictionary is a tenth of the vocabulary */
+   for (cp = text, i = 0; i < c.n; i++) {
+      memcpy(cp, c.key[c.stream[i]], c.len[c.stream[i]]);
+      cp += c.len[c.stream[i]];
+   }
+   bytes = cp - text;
+   for (i = 0; i < c.vocab; i += 10)
+      tokenset_add_n(p, c.key[i], c.len[i]);
+
+   t0 = bench_now();
+   m = tokenset_build_matcher(p);
+   t1 = bench_now();
+   if (NULL == m) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   printf("%lu tokens, matcher of %.1f MB built in %.1f ms\n",
+          (unsigned long) tokenset_count(p), tokenset_matcher_bytes(m) / 1e6, (t1 - t0) / 1e6);
+   printf("%-10s %-12s %-12s %s\n", "method", "bytes", "matches", "MB/s");
+
+   /* Every substring of a possible token length, on a slice of the text */
+   naive_bytes = bytes < ((size_t) 1 << 22) ? bytes : (size_t) 1 << 22;
+   found = 0;
+   t0 = bench_now();
+   for (i = 1; i <= naive_bytes; i++) {
+      size_t      k;
+
+      for (k = c.minlen; k <= c.maxlen && k <= i; k++)
+         found += tokenset_exists_n(p, text + i - k, k);
+   }
+   t1 = bench_now();
+   printf("%-10s %-12lu %-12lu %.1f\n", "exists_n", (unsigned long) naive_bytes,
+          (unsigned long) found, 1e3 * naive_bytes / (t1 - t0));
+
+   t1 = bench_now();
+   found = tokenset_match_buffer(m, text, bytes, NULL, NULL);
+   t2 = bench_now();
+   printf("%-10s %-12lu %-12lu %.1f\n", "matcher", (unsigned long) bytes,
+          (unsigned long) found, 1e3 * bytes / (t2 - t1));
+
+   tokenset_matcher_free(&m);
+   tokenset_free(&p);
+   free(text);
+   bench_corpus_free(&c);
+}
+
+/* Combining per-worker vocabularies: re-adding every string, merging one at a time, in parallel */
+static void
+bench_merge(unsigned long max, unsigned nthreads)
+{
+   struct bench_corpus c;
+   struct tokenset *shards[64];
+   struct tokenset *dst;
+   unsigned   *remaps[64];
+   size_t      nshards = 64, k, in = 0;
+   unsigned long i;
+   double      t0, t1;
+
+   memset(&c, 0, sizeof(c));
+   c.vocab = max / 4;
+   c.n = max;
+   c.zipf = 1;
+   c.s = 1.0;
+   c.minlen = 3;
+   c.maxlen = 12;
+   if (bench_corpus_make(&c)) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+
+   /* Each shard tokenizes its own slice of the stream */
+   for (k = 0; k < nshards; k++) {
+      shards[k] = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+      for (i = k * (c.n / nshards); i < (k + 1) * (c.n / nshards); i++)
+         tokenset_add_n(shards[k], c.key[c.stream[i]], c.len[c.stream[i]]);
+      in += tokenset_count(shards[k]);
+      remaps[k] = (unsigned *) malloc(tokenset_id_limit(shards[k]) * sizeof(unsigned));
+   }
+
+   printf("%lu shard tokens in %lu shards\n", (unsigned long) in, (unsigned long) nshards);
+   printf("%-12s %-10s %-10s %s\n", "method", "tokens", "ms", "ns/shard token");
+
+   t0 = bench_now();
+   dst = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   for (k = 0; k < nshards; k++) {
+      char      **list = tokenset_get(shards[k]);
+      size_t      j;
+
+      for (j = 0; NULL != list[j]; j++) {
+         tokenset_add(dst, list[j]);
+         free(list[j]);
+      }
+      free(list);
+   }
+   t1 = bench_now();
+   printf("%-12s %-10d %-10.1f %.2f\n", "get+add", tokenset_count(dst), (t1 - t0) / 1e6,
+          bench_ns(t0, t1, in));
+   tokenset_free(&dst);
+
+   t0 = bench_now();
+   dst = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   for (k = 0; k < nshards; k++)
+      tokenset_merge(dst, shards[k], remaps[k]);
+   t1 = bench_now();
+   printf("%-12s %-10d %-10.1f %.2f\n", "merge", tokenset_count(dst), (t1 - t0) / 1e6,
+          bench_ns(t0, t1, in));
+   tokenset_free(&dst);
+
+   for (; nthreads > 0; nthreads /= 2) {
+      char        name[32];
+
+      t0 = bench_now();
+      dst = tokenset_merge_parallel(shards, nshards, TOKENSET_FLAT | TOKENSET_ARENA, nthreads,
+                                    remaps);
+      t1 = bench_now();
+      sprintf(name, "parallel/%u", nthreads);
+      printf("%-12s %-10d %-10.1f %.2f\n", name, tokenset_count(dst), (t1 - t0) / 1e6,
+             bench_ns(t0, t1, in));
+      tokenset_free(&dst);
+   }
+
+   for (k = 0; k < nshards; k++) {
+      tokenset_free(&shards[k]);
+      free(remaps[k]);
+   }
+   bench_corpus_free(&c);
+}
+
+/*
+ * Thread scaling: T threads share one Zipfian stream, each adding its
+ * own contiguous slice, first to a tokenset behind one global mutex,
+ * then to concurrent tokensets.
+ */
+
+struct bench_worker {
+   struct bench_corpus *c;
+   struct tokenset *p;                           /* with lock, when not concurrent */
+   struct tokenset_concurrent *cc;
+   pthread_mutex_t *lock;
+   unsigned long first;
+   unsigned long last;
+   unsigned long sum;                            /* of ids, so the work is not dead */
+};
+
+static void *
+bench_worker_run(void *v)
+{
+   struct bench_worker *w = (struct bench_worker *) v;
+   unsigned long i;
+
+   for (i = w->first; i < w->last; i++) {
+      unsigned long k = w->c->stream[i];
+
+      if (NULL != w->cc)
+         w->sum += tokenset_concurrent_add_n(w->cc, w->c->key[k], w->c->len[k]);
+      else {
+         pthread_mutex_lock(w->lock);
+         w->sum += tokenset_add_n(w->p, w->c->key[k], w->c->len[k]);
+         pthread_mutex_unlock(w->lock);
+      }
+   }
+
+   return NULL;
+}
+
+static void
+bench_threads(unsigned long max, unsigned maxthreads)
+{
+   struct bench_corpus c;
+   struct bench_worker *w;
+   pthread_t  *th;
+   pthread_mutex_t lock;
+   const char *names[3];
+   double      base[3];
+   unsigned    t, i;
+   int         m;
+
+   if (0 == maxthreads)
+      maxthreads = 1;
+   w = (struct bench_worker *) malloc(maxthreads * sizeof(*w));
+   th = (pthread_t *) malloc(maxthreads * sizeof(pthread_t));
+
+   names[0] = "mutex";
+   names[1] = "sharded";
+   names[2] = "sharded+flat";
+
+   memset(&c, 0, sizeof(c));
+   c.vocab = 100000;
+   c.n = max;
+   c.zipf = 1;
+   c.s = 1.0;
+   c.minlen = 3;
+   c.maxlen = 12;
+   if (NULL == w || NULL == th || bench_corpus_make(&c)) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   pthread_mutex_init(&lock, NULL);
+
+   printf("%-14s %-8s %-12s %-12s %s\n", "config", "threads", "ns/add", "Madds/s",
+          "speedup");
+
+   for (m = 0; m < 3; m++) {
+      /* 1, 2, 4, ... and maxthreads itself */
+      for (t = 1; t <= maxthreads; t = t < maxthreads && 2 * t > maxthreads ? maxthreads : 2 * t) {
+         struct tokenset *p = NULL;
+         struct tokenset_concurrent *cc = NULL;
+         double      t0, t1, rate;
+
+         if (0 == m)
+            p = tokenset_new_with_flags(TOKENSET_ARENA);
+         else
+            cc = tokenset_concurrent_new(0, TOKENSET_ARENA | (2 == m ? TOKENSET_FLAT : 0));
+
+         for (i = 0; i < t; i++) {
+            w[i].c = &c;
+            w[i].p = p;
+            w[i].cc = cc;
+            w[i].lock = &lock;
+            w[i].first = c.n / t * i;
+            w[i].last = i + 1 == t ? c.n : c.n / t * (i + 1);
+            w[i].sum = 0;
+         }
+
+         t0 = bench_now();
+         for (i = 0; i < t; i++)
+            pthread_create(&th[i], NULL, bench_worker_run, &w[i]);
+         for (i = 0; i < t; i++)
+            pthread_join(th[i], NULL);
+         t1 = bench_now();
+
+         rate = 1e3 / bench_ns(t0, t1, c.n);
+         if (1 == t)
+            base[m] = rate;
+         printf("%-14s %-8u %-12.2f %-12.2f %.2f\n", names[m], t, bench_ns(t0, t1, c.n), rate,
+                rate / base[m]);
+
+         tokenset_free(&p);
+         tokenset_concurrent_free(&cc);
+      }
+   }
+
+   pthread_mutex_destroy(&lock);
+   bench_corpus_free(&c);
+   free(th);
+   free(w);
+}
+
+int
+main(int argc, char *argv[])
+{
+   const char *what = argc > 1 ? argv[1] : "-";
+   unsigned long max = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+   if ('-' == what[0] || argc < 2)
+      return bench_suite(argc, argv);
+
+   printf("%s\n", tokenset_version());
+
+   if (0 == strcmp(what, "byid"))
+      bench_byid(max);
+   else if (0 == strcmp(what, "alloc"))
+      bench_alloc(max);
+   else if (0 == strcmp(what, "engines"))
+      bench_engines(max);
+   else if (0 == strcmp(what, "batch"))
+      bench_batch(max);
+   else if (0 == strcmp(what, "lookup"))
+      bench_lookup(max);
+   else if (0 == strcmp(what, "hash"))
+      bench_hash(max);
+   else if (0 == strcmp(what, "hashed"))
+      bench_hashed(max);
+   else if (0 == strcmp(what, "bloom"))
+      bench_bloom(max);
+   else if (0 == strcmp(what, "packed"))
+      bench_packed(max);
+   else if (0 == strcmp(what, "freeze"))
+      bench_freeze(max);
+   else if (0 == strcmp(what, "ordered"))
+      bench_ordered(max);
+   else if (0 == strcmp(what, "load"))
+      bench_load(max);
+   else if (0 == strcmp(what, "ingest"))
+      bench_ingest(max);
+   else if (0 == strcmp(what, "match"))
+      bench_match(max);
+   else if (0 == strcmp(what, "sort")) {
+      long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+      bench_sort(max, argc > 3 ? (unsigned) strtoul(argv[3], NULL, 10)
+                 : ncpu > 4 ? (unsigned) ncpu : 4);
+   }
+   else if (0 == strcmp(what, "merge")) {
+      long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+      bench_merge(max, argc > 3 ? (unsigned) strtoul(argv[3], NULL, 10)
+                  : ncpu > 4 ? (unsigned) ncpu : 4);
+   }
+   else if (0 == strcmp(what, "threads")) {
+      long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+      bench_threads(max, argc > 3 ? (unsigned) strtoul(argv[3], NULL, 10)
+                    : ncpu > 4 ? (unsigned) ncpu : 4);
+   }
+   else
+      return bench_suite(1, argv);
+
+   return 0;
+}
@@ -1,6 +1,9 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "tokenset.h"
 #include "t/tinytest.h"
 
@@ -200,6 +203,1108 @@ test_stress_3(void)
 }
 
 
+static void
+test_get_by_id_n(void)
+{
+   struct tokenset *p = tokenset_new();
+   const char *cp;
+   size_t      len;
+
+   printf_test_name("test_get_by_id_n", "tokenset_get_by_id_n, tokenset_id_limit");
+
+   tokenset_add(p, "alpha");
+   tokenset_add(p, "be");
+   tokenset_add(p, "gamma");
+   tokenset_remove(p, "be");
+
+   cp = tokenset_get_by_id_n(p, 0, &len);
+   ASSERT_STRING_EQUALS("alpha", cp);
+   ASSERT_EQUALS(5, len);
+   ASSERT_EQUALS(NULL, tokenset_get_by_id_n(p, 1, &len));
+   ASSERT_EQUALS(0, len);
+   ASSERT_STRING_EQUALS("gamma", tokenset_get_by_id(p, 2));
+   ASSERT_EQUALS(NULL, tokenset_get_by_id(p, 3));
+   ASSERT_EQUALS(3, tokenset_id_limit(p));
+
+   tokenset_reset(p);
+   ASSERT_EQUALS(NULL, tokenset_get_by_id(p, 0));
+   ASSERT_EQUALS(0, tokenset_id_limit(p));
+
+   tokenset_free(&p);
+   ASSERT_EQUALS(NULL, p);
+}
+
+
+static void
+test_get_range(void)
+{
+   struct tokenset *p = tokenset_new();
+   const char *toks[8];
+   size_t      lens[8];
+   char        buff[16];
+   int         i;
+
+   printf_test_name("test_get_range", "tokenset_get_range");
+
+   for (i = 0; i < 6; i++) {
+      sprintf(buff, "tok%d", i * 11);
+      tokenset_add(p, buff);
+   }
+   tokenset_remove(p, "tok22");
+
+   ASSERT_EQUALS(4, tokenset_get_range(p, 2, 8, toks, lens));
+   ASSERT_EQUALS(NULL, toks[0]);
+   ASSERT_EQUALS(0, lens[0]);
+   ASSERT_STRING_EQUALS("tok33", toks[1]);
+   ASSERT_EQUALS(5, lens[1]);
+   ASSERT_STRING_EQUALS("tok55", toks[3]);
+   ASSERT_EQUALS(0, tokenset_get_range(p, 6, 8, toks, NULL));
+
+   tokenset_free(&p);
+   ASSERT_EQUALS(NULL, p);
+}
+
+
+static void
+test_arena(void)
+{
+   struct tokenset *p = tokenset_new_with_flags(TOKENSET_ARENA);
+   char        buff[100];
+   int         i;
+
+   printf_test_name("test_arena", "tokenset_new_with_flags, TOKENSET_ARENA");
+
+   ASSERT("Constructor test", p);
+
+   for (i = 0; i < 5000; i++) {
+      sprintf(buff, "arena_token_%d", i);
+      ASSERT_EQUALS(i, tokenset_add(p, buff));
+   }
+
+   ASSERT_EQUALS(5000, tokenset_count(p));
+   ASSERT_STRING_EQUALS("arena_token_4321", tokenset_get_by_id(p, 4321));
+
+   tokenset_remove(p, "arena_token_10");
+   tokenset_remove(p, "arena_token_11");
+   ASSERT_EQUALS(4998, tokenset_count(p));
+   ASSERT_EQUALS(5000, tokenset_add(p, "recycled"));
+   ASSERT_EQUALS(5000, tokenset_id(p, "recycled"));
+   ASSERT_EQUALS(-1, tokenset_id(p, "arena_token_10"));
+
+   tokenset_reset(p);
+   ASSERT_EQUALS(0, tokenset_count(p));
+   ASSERT_EQUALS(0, tokenset_add(p, "again"));
+   ASSERT_STRING_EQUALS("again", tokenset_get_by_id(p, 0));
+
+   tokenset_free(&p);
+   ASSERT_EQUALS(NULL, p);
+}
+
+
+static void
+test_add_n(void)
+{
+   struct tokenset *p = tokenset_new();
+   const char  line[] = "hello world, hello\0nul";
+   size_t      len;
+
+   printf_test_name("test_add_n",
+                    "tokenset_add_n, tokenset_id_n, tokenset_exists_n, tokenset_remove_n");
+
+   ASSERT_EQUALS(0, tokenset_add_n(p, line, 5));
+   ASSERT_EQUALS(1, tokenset_add_n(p, line + 6, 5));
+   ASSERT_EQUALS(0, tokenset_add_n(p, line + 13, 5));
+   ASSERT_EQUALS(2, tokenset_add_n(p, line + 13, 9));
+   ASSERT_EQUALS(3, tokenset_add_n(p, line, 0));
+
+   ASSERT_EQUALS(4, tokenset_count(p));
+   ASSERT_EQUALS(1, tokenset_id(p, "world"));
+   ASSERT_EQUALS(0, tokenset_id_n(p, "hello\0nul", 5));
+   ASSERT_EQUALS(2, tokenset_id_n(p, "hello\0nul", 9));
+   ASSERT_EQUALS(1, tokenset_exists_n(p, "hello\0nul", 9));
+   ASSERT_EQUALS(0, tokenset_exists_n(p, "hello\0nux", 9));
+   ASSERT_EQUALS(3, tokenset_id(p, ""));
+
+   ASSERT_EQUALS(0, memcmp("hello\0nul", tokenset_get_by_id_n(p, 2, &len), 10));
+   ASSERT_EQUALS(9, len);
+
+   tokenset_remove_n(p, "hello\0nul", 9);
+   ASSERT_EQUALS(0, tokenset_exists_n(p, "hello\0nul", 9));
+   ASSERT_EQUALS(1, tokenset_exists(p, "hello"));
+
+   tokenset_free(&p);
+   ASSERT_EQUALS(NULL, p);
+}
+
+
+static void
+test_flat(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct tokenset *q = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   char        buff[100];
+   char      **list1, **list2;
+   int         i, k;
+
+   printf_test_name("test_flat", "TOKENSET_FLAT against the default engine");
+
+   srand(17);
+   for (i = 0; i < 20000; i++) {
+      sprintf(buff, "w%d", rand() % 3000);
+      if (rand() % 4 == 0) {
+         tokenset_remove(p, buff);
+         tokenset_remove(q, buff);
+      }
+      else
+         ASSERT_EQUALS(tokenset_add(p, buff), tokenset_add(q, buff));
+   }
+
+   ASSERT_EQUALS(tokenset_count(p), tokenset_count(q));
+
+   for (i = 0; i < 3000; i++) {
+      sprintf(buff, "w%d", i);
+      ASSERT_EQUALS(tokenset_id(p, buff), tokenset_id(q, buff));
+   }
+
+   tokenset_sort(p);
+   tokenset_sort(q);
+   list1 = tokenset_get(p);
+   list2 = tokenset_get(q);
+
+   for (k = 0; NULL != list1[k]; k++) {
+      ASSERT("same listing", NULL != list2[k]);
+      ASSERT_STRING_EQUALS(list1[k], list2[k]);
+      free(list1[k]);
+      free(list2[k]);
+   }
+   ASSERT_EQUALS(NULL, list2[k]);
+   free(list1);
+   free(list2);
+
+   tokenset_reset(q);
+   ASSERT_EQUALS(0, tokenset_count(q));
+   ASSERT_EQUALS(-1, tokenset_id(q, "w1"));
+   ASSERT_EQUALS(0, tokenset_add(q, "w1"));
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+   ASSERT_EQUALS(NULL, q);
+}
+
+
+static void
+test_add_batch(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct tokenset *q = tokenset_new_with_flags(TOKENSET_FLAT);
+   const char *keys[100];
+   size_t      lens[100];
+   int         ids[100];
+   char        words[100][16];
+   int         i;
+
+   printf_test_name("test_add_batch", "tokenset_add_batch");
+
+   for (i = 0; i < 100; i++) {
+      sprintf(words[i], "b%d", (i * 7) % 40);
+      keys[i] = words[i];
+      lens[i] = strlen(words[i]);
+   }
+
+   tokenset_add(p, "b3");
+   ASSERT_EQUALS(39, tokenset_add_batch(p, keys, lens, 100, ids));
+   ASSERT_EQUALS(40, tokenset_add_batch(q, keys, NULL, 100, ids));
+   ASSERT_EQUALS(0, tokenset_add_batch(q, keys, lens, 100, NULL));
+
+   for (i = 0; i < 100; i++) {
+      ASSERT_EQUALS(tokenset_id(q, words[i]), ids[i]);
+      ASSERT_EQUALS(1, tokenset_exists(p, words[i]));
+   }
+   ASSERT_EQUALS(ids[0], ids[40]);
+   ASSERT_EQUALS(0, tokenset_id(p, "b3"));
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+   ASSERT_EQUALS(NULL, q);
+}
+
+
+static void
+test_id_batch(void)
+{
+   struct tokenset *p = tokenset_new();
+   const char  text[] = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+   const char *keys[120];
+   size_t      lens[120];
+   int         ids[120];
+   int         hits[120];
+   int         i;
+
+   printf_test_name("test_id_batch", "tokenset_id_batch, tokenset_exists_batch");
+
+   /* Keys of every length from 1 to 60, half of them present */
+   for (i = 0; i < 120; i++) {
+      keys[i] = text + i % 2;
+      lens[i] = 1 + i / 2;
+      if (i % 2 == 0)
+         tokenset_add_n(p, keys[i], lens[i]);
+   }
+
+   ASSERT_EQUALS(60, tokenset_id_batch(p, keys, lens, 120, ids));
+   ASSERT_EQUALS(60, tokenset_exists_batch(p, keys, lens, 120, hits));
+
+   for (i = 0; i < 120; i++) {
+      ASSERT_EQUALS(tokenset_id_n(p, keys[i], lens[i]), ids[i]);
+      ASSERT_EQUALS(i % 2 == 0 ? 1 : 0, hits[i]);
+   }
+
+   keys[0] = "abc";
+   keys[1] = "zzz";
+   tokenset_add(p, "abc");
+   ASSERT_EQUALS(1, tokenset_id_batch(p, keys, NULL, 2, ids));
+   ASSERT_EQUALS(tokenset_id(p, "abc"), ids[0]);
+   ASSERT_EQUALS(-1, ids[1]);
+
+   tokenset_free(&p);
+   ASSERT_EQUALS(NULL, p);
+}
+
+
+static void
+test_hash_select(void)
+{
+   unsigned    hashes[3];
+   const char *names[3];
+   struct tokenset_stats st;
+   const char *keys[3];
+   int         ids[3];
+   char        buff[100];
+   int         h, e, i;
+
+   printf_test_name("test_hash_select", "TOKENSET_HASH_*, tokenset_hash_with, tokenset_stats");
+
+   /* Published xxHash32 test vectors */
+   ASSERT_EQUALS(0x02cc5d05u, tokenset_hash_with(TOKENSET_HASH_XXH32, "", 0));
+   ASSERT_EQUALS(0x32d153ffu, tokenset_hash_with(TOKENSET_HASH_XXH32, "abc", 3));
+   ASSERT_EQUALS(0xe2293b2fu, tokenset_hash_with(TOKENSET_HASH_XXH32,
+                                                 "Nobody inspects the spammish repetition",
+                                                 39));
+
+   hashes[0] = TOKENSET_HASH_JEN;
+   names[0] = "jen";
+   hashes[1] = TOKENSET_HASH_XXH32;
+   names[1] = "xxh32";
+   hashes[2] = TOKENSET_HASH_WY;
+   names[2] = "wy";
+
+   for (h = 0; h < 3; h++) {
+      for (e = 0; e < 2; e++) {
+         struct tokenset *p = tokenset_new_with_flags(hashes[h] | (e ? TOKENSET_FLAT : 0));
+
+         for (i = 0; i < 2000; i++) {
+            sprintf(buff, "a somewhat longer token number %d", i);
+            ASSERT_EQUALS(i, tokenset_add(p, buff));
+         }
+         for (i = 0; i < 2000; i += 2) {
+            sprintf(buff, "a somewhat longer token number %d", i);
+            tokenset_remove(p, buff);
+         }
+         for (i = 0; i < 2000; i++) {
+            sprintf(buff, "a somewhat longer token number %d", i);
+            ASSERT_EQUALS(i % 2 ? i : -1, tokenset_id(p, buff));
+         }
+
+         keys[0] = "a somewhat longer token number 7";
+         keys[1] = "a somewhat longer token number 8";
+         keys[2] = "a somewhat longer token number 1999";
+         ASSERT_EQUALS(2, tokenset_id_batch(p, keys, NULL, 3, ids));
+         ASSERT_EQUALS(7, ids[0]);
+         ASSERT_EQUALS(-1, ids[1]);
+         ASSERT_EQUALS(1999, ids[2]);
+
+         tokenset_stats(p, &st);
+         ASSERT_STRING_EQUALS(names[h], st.hash);
+         ASSERT_STRING_EQUALS(e ? "flat" : "uthash", st.engine);
+         ASSERT_EQUALS(1000, st.count);
+         ASSERT("has buckets", st.buckets >= 1000 / 10);
+
+         tokenset_free(&p);
+      }
+   }
+}
+
+
+static void
+test_hashed(void)
+{
+   struct tokenset *sets[3];
+   const char *words[5];
+   unsigned    hv;
+   char        buff[100];
+   int         i, k;
+
+   printf_test_name("test_hashed", "tokenset_hash, tokenset_add_hashed, tokenset_id_hashed, tokenset_exists_hashed");
+
+   ASSERT_EQUALS(tokenset_hash_with(0, "token", 5), tokenset_hash("token", 5));
+   ASSERT_EQUALS(tokenset_hash_with(TOKENSET_HASH_JEN, "", 0), tokenset_hash("", 0));
+
+   /* One hash serves every set with the default hash, whatever the engine */
+   sets[0] = tokenset_new();
+   sets[1] = tokenset_new_with_flags(TOKENSET_FLAT);
+   sets[2] = tokenset_new_with_flags(TOKENSET_ARENA | TOKENSET_ORDERED);
+   words[0] = "the";
+   words[1] = "a";
+   words[2] = "of";
+   words[3] = "spam";
+   words[4] = "eggs";
+   for (i = 0; i < 5; i++)
+      tokenset_add(sets[i < 3 ? 1 : 2], (char *) words[i]);
+
+   for (i = 0; i < 3000; i++) {
+      if (i < 5)
+         strcpy(buff, words[i]);
+      else
+         sprintf(buff, "word%d", i);
+      hv = tokenset_hash(buff, strlen(buff));
+      ASSERT_EQUALS(i, tokenset_add_hashed(sets[0], buff, strlen(buff), hv));
+      ASSERT_EQUALS(i, tokenset_id_hashed(sets[0], buff, strlen(buff), hv));
+      ASSERT_EQUALS(i < 3, tokenset_exists_hashed(sets[1], buff, strlen(buff), hv));
+      ASSERT_EQUALS(i == 3 || i == 4, tokenset_exists_hashed(sets[2], buff, strlen(buff), hv));
+      ASSERT_EQUALS(i < 3 ? i : -1, tokenset_id_hashed(sets[1], buff, strlen(buff), hv));
+   }
+   for (k = 0; k < 3; k++) {
+      ASSERT_EQUALS(1, tokenset_exists_n(sets[k], "of", 2) == (k < 2));
+      tokenset_free(&sets[k]);
+   }
+
+   /* Other hash functions go through tokenset_hash_with() */
+   sets[0] = tokenset_new_with_flags(TOKENSET_HASH_WY | TOKENSET_FLAT);
+   hv = tokenset_hash_with(TOKENSET_HASH_WY, "wy", 2);
+   ASSERT_EQUALS(0, tokenset_add_hashed(sets[0], "wy", 2, hv));
+   ASSERT_EQUALS(0, tokenset_id(sets[0], "wy"));
+   ASSERT_EQUALS(1, tokenset_exists_hashed(sets[0], "wy", 2, hv));
+   tokenset_free(&sets[0]);
+}
+
+
+static void
+test_reserve(void)
+{
+   struct tokenset *p = tokenset_new_with_capacity(50000);
+   struct tokenset *q = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ARENA);
+   struct tokenset_stats st;
+   size_t      buckets;
+   char        buff[100];
+   int         i;
+
+   printf_test_name("test_reserve", "tokenset_new_with_capacity, tokenset_reserve");
+
+   ASSERT("Constructor test", p);
+   ASSERT_EQUALS(0, tokenset_reserve(q, 50000));
+
+   tokenset_add(p, "first");
+   tokenset_add(q, "first");
+   tokenset_stats(p, &st);
+   buckets = st.buckets;
+   ASSERT("sized up front", buckets >= 50000);
+   tokenset_stats(q, &st);
+   ASSERT("sized up front", st.buckets >= 50000);
+
+   for (i = 1; i < 50000; i++) {
+      sprintf(buff, "reserved %d", i);
+      ASSERT_EQUALS(i, tokenset_add(p, buff));
+      ASSERT_EQUALS(i, tokenset_add(q, buff));
+   }
+
+   /* No rehash happened on the way */
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(buckets, st.buckets);
+   buckets = st.buckets;
+   tokenset_stats(q, &st);
+   ASSERT("flat table did not grow", st.buckets < 2 * 50000 * 8 / 7);
+
+   /* Reserving what is already there changes nothing */
+   ASSERT_EQUALS(0, tokenset_reserve(p, 100));
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(buckets, st.buckets);
+
+   /* The reservation outlives a reset */
+   tokenset_reset(p);
+   tokenset_add(p, "again");
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(buckets, st.buckets);
+   ASSERT_EQUALS(0, tokenset_id(p, "again"));
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+   ASSERT_EQUALS(NULL, q);
+}
+
+
+static void
+test_stats(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct tokenset *q = tokenset_new_with_flags(TOKENSET_FLAT | TOKENSET_ORDERED);
+   struct tokenset *r = tokenset_new_with_capacity(20000);
+   struct tokenset_stats st;
+   size_t      index_bytes, node_size;
+   char        buff[100];
+   int         i;
+
+   printf_test_name("test_stats", "tokenset_stats");
+
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(0, st.expansions);
+   ASSERT_EQUALS(0, st.node_bytes);
+   ASSERT_EQUALS(0, st.text_bytes);
+   ASSERT_EQUALS(0, st.table_bytes);
+   ASSERT("empty set has no load", 0.0 == st.load_factor);
+
+   tokenset_add(q, "seed");
+   tokenset_stats(q, &st);
+   index_bytes = st.index_bytes;
+
+   for (i = 0; i < 20000; i++) {
+      sprintf(buff, "k%d", i);
+      tokenset_add(p, buff);
+      tokenset_add(q, buff);
+      tokenset_add(r, buff);
+   }
+
+   /* Short tokens live in their nodes; one long one takes len + 1 bytes */
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(0, st.text_bytes);
+   tokenset_add(p, "a token well past the inline limit");
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(strlen("a token well past the inline limit") + 1, st.text_bytes);
+
+   /* The limit itself: 15 bytes fit the node, 16 do not */
+   tokenset_add(p, "fifteen bytes!!");
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(strlen("a token well past the inline limit") + 1, st.text_bytes);
+   tokenset_add(p, "sixteen bytes!!!");
+   tokenset_stats(p, &st);
+   ASSERT_EQUALS(strlen("a token well past the inline limit") + 18, st.text_bytes);
+   ASSERT_STRING_EQUALS("fifteen bytes!!", tokenset_get_by_id(p, 20001));
+   ASSERT_STRING_EQUALS("sixteen bytes!!!", tokenset_get_by_id(p, 20002));
+   tokenset_remove(p, "fifteen bytes!!");
+   tokenset_remove(p, "sixteen bytes!!!");
+   tokenset_stats(p, &st);
+
+   ASSERT_EQUALS(20001, st.count);
+   ASSERT("uthash doubled on the way", st.expansions > 5);
+   ASSERT("load factor", st.load_factor == (double) st.count / st.buckets);
+   ASSERT("ideal chain", st.ideal_chain_maxlen >= 1);
+   ASSERT("nonideal items", st.nonideal_items <= st.count);
+   ASSERT_EQUALS(0, st.noexpand);
+   ASSERT_EQUALS(0, st.deleted);
+   ASSERT("nodes counted", st.node_bytes >= st.count * sizeof(void *));
+   node_size = st.node_bytes / st.count;
+   ASSERT("buckets counted", st.table_bytes > st.buckets * sizeof(void *));
+   ASSERT("id index counted", st.index_bytes >= st.count * sizeof(void *));
+   ASSERT("the set itself counted", st.total_bytes > st.node_bytes + st.text_bytes
+          + st.table_bytes + st.index_bytes);
+
+   /* Flat: removals leave deleted markers, the tree adds to the index */
+   for (i = 0; i < 20000; i += 2) {
+      sprintf(buff, "k%d", i);
+      tokenset_remove(q, buff);
+   }
+   tokenset_stats(q, &st);
+   ASSERT_EQUALS(10001, st.count);
+   ASSERT("flat grew", st.expansions > 5);
+   ASSERT("some slots deleted", st.deleted > 0 && st.deleted <= 10000);
+   ASSERT("load factor", st.load_factor < 7.0 / 8);
+   ASSERT_EQUALS(0, st.ideal_chain_maxlen);
+   ASSERT("slots and control bytes", st.table_bytes == st.buckets * (1 + sizeof(unsigned)));
+   ASSERT("flat nodes carry no uthash handle", st.node_bytes / st.count + 32 <= node_size);
+   ASSERT("tree counted", st.index_bytes > index_bytes + 10000 * sizeof(void *));
+
+   /* A reserved set never grows */
+   tokenset_stats(r, &st);
+   ASSERT_EQUALS(0, st.expansions);
+   ASSERT("reserved buckets", st.buckets >= 20000);
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+   tokenset_free(&r);
+}
+
+
+#define CONC_THREADS  4
+#define CONC_KEYS     20000
+
+struct conc_arg {
+   struct tokenset_concurrent *c;
+   int         start;                            /* where in the key space this thread begins */
+   int         ids[CONC_KEYS];
+};
+
+static void *
+conc_worker(void *v)
+{
+   struct conc_arg *a = (struct conc_arg *) v;
+   char        buff[100];
+   int         i, k;
+
+   /* Every thread adds every key, each starting somewhere else */
+   for (i = 0; i < CONC_KEYS; i++) {
+      k = (a->start + i) % CONC_KEYS;
+      sprintf(buff, "shared %d", k);
+      a->ids[k] = tokenset_concurrent_add_n(a->c, buff, strlen(buff));
+   }
+
+   return NULL;
+}
+
+static void
+test_concurrent(void)
+{
+   struct tokenset_concurrent *c = tokenset_concurrent_new(8, TOKENSET_FLAT);
+   struct conc_arg *a = (struct conc_arg *) malloc(CONC_THREADS * sizeof(struct conc_arg));
+   pthread_t   th[CONC_THREADS];
+   char       *seen = (char *) calloc(CONC_KEYS, 1);
+   char        buff[100];
+   const char *tok;
+   size_t      len;
+   int         i, k;
+
+   printf_test_name("test_concurrent", "tokenset_concurrent_add_n, tokenset_concurrent_get_by_id_n");
+
+   ASSERT("Constructor test", c);
+
+   for (i = 0; i < CONC_THREADS; i++) {
+      a[i].c = c;
+      a[i].start = i * CONC_KEYS / CONC_THREADS;
+      ASSERT_EQUALS(0, pthread_create(&th[i], NULL, conc_worker, &a[i]));
+   }
+   for (i = 0; i < CONC_THREADS; i++)
+      pthread_join(th[i], NULL);
+
+   ASSERT_EQUALS(CONC_KEYS, tokenset_concurrent_count(c));
+
+   /* All threads saw the same ids, and they are exactly 0 .. CONC_KEYS - 1 */
+   for (k = 0; k < CONC_KEYS; k++) {
+      for (i = 1; i < CONC_THREADS; i++)
+         ASSERT_EQUALS(a[0].ids[k], a[i].ids[k]);
+      ASSERT("dense", a[0].ids[k] >= 0 && a[0].ids[k] < CONC_KEYS);
+      ASSERT("unique", !seen[a[0].ids[k]]);
+      seen[a[0].ids[k]] = 1;
+
+      sprintf(buff, "shared %d", k);
+      ASSERT_EQUALS(a[0].ids[k], tokenset_concurrent_id_n(c, buff, strlen(buff)));
+      tok = tokenset_concurrent_get_by_id_n(c, (unsigned) a[0].ids[k], &len);
+      ASSERT_EQUALS(strlen(buff), len);
+      ASSERT_STRING_EQUALS(buff, tok);
+   }
+
+   ASSERT_EQUALS(0, tokenset_concurrent_exists_n(c, "absent", 6));
+   ASSERT_EQUALS(-1, tokenset_concurrent_id_n(c, "absent", 6));
+   ASSERT_EQUALS(NULL, tokenset_concurrent_get_by_id_n(c, CONC_KEYS, NULL));
+   ASSERT_EQUALS(NULL, tokenset_concurrent_get_by_id_n(c, 0x7FFFFFFF, NULL));
+   ASSERT_EQUALS(NULL, tokenset_concurrent_get_by_id_n(c, 0xFFFFFFFF, NULL));
+
+   free(seen);
+   free(a);
+   tokenset_concurrent_free(&c);
+   ASSERT_EQUALS(NULL, c);
+}
+
+
+static void
+test_freeze(void)
+{
+   struct tokenset *p = tokenset_new_with_flags(TOKENSET_FLAT);
+   struct tokenset_frozen *f;
+   char        buff[100];
+   const char *tok;
+   size_t      len;
+   int         i;
+
+   printf_test_name("test_freeze", "tokenset_freeze, tokenset_frozen_id_n");
+
+   for (i = 0; i < 30000; i++) {
+      sprintf(buff, "frozen %d", i);
+      tokenset_add(p, buff);
+   }
+   tokenset_add_n(p, "", 0);
+   tokenset_add_n(p, "nul\0byte", 8);
+   tokenset_remove(p, "frozen 7");
+
+   f = tokenset_freeze(p);
+   ASSERT("Freeze test", f);
+   ASSERT_EQUALS((size_t) tokenset_count(p), tokenset_frozen_count(f));
+   ASSERT_EQUALS(tokenset_id_limit(p), tokenset_frozen_id_limit(f));
+
+   for (i = 0; i < 30000; i++) {
+      sprintf(buff, "frozen %d", i);
+      ASSERT_EQUALS(tokenset_id(p, buff), tokenset_frozen_id(f, buff));
+      if (7 == i)
+         continue;
+      tok = tokenset_frozen_get_by_id_n(f, (unsigned) i, &len);
+      ASSERT_STRING_EQUALS(buff, tok);
+      ASSERT_EQUALS(strlen(buff), len);
+   }
+   ASSERT_EQUALS(30000, tokenset_frozen_id_n(f, "", 0));
+   ASSERT_EQUALS(30001, tokenset_frozen_id_n(f, "nul\0byte", 8));
+   ASSERT_EQUALS(-1, tokenset_frozen_id_n(f, "nul", 3));
+   ASSERT_EQUALS(NULL, tokenset_frozen_get_by_id_n(f, 7, &len));
+   ASSERT_EQUALS(0, len);
+   ASSERT_EQUALS(NULL, tokenset_frozen_get_by_id_n(f, 30002, NULL));
+
+   /* Non-members */
+   for (i = 30000; i < 60000; i++) {
+      sprintf(buff, "frozen %d", i);
+      ASSERT_EQUALS(0, tokenset_frozen_exists_n(f, buff, strlen(buff)));
+   }
+
+   /* The snapshot does not follow the live set, and outlives it */
+   tokenset_add(p, "later");
+   ASSERT_EQUALS(-1, tokenset_frozen_id(f, "later"));
+   tokenset_free(&p);
+   ASSERT_EQUALS(29999, tokenset_frozen_id(f, "frozen 29999"));
+   tokenset_frozen_free(&f);
+   ASSERT_EQUALS(NULL, f);
+
+   /* An empty set freezes too */
+   p = tokenset_new();
+   f = tokenset_freeze(p);
+   ASSERT("Freeze test", f);
+   ASSERT_EQUALS(0, tokenset_frozen_count(f));
+   ASSERT_EQUALS(-1, tokenset_frozen_id(f, "anything"));
+   tokenset_frozen_free(&f);
+   tokenset_free(&p);
+}
+
+
+static void
+test_save_mmap(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct tokenset_frozen *f;
+   const char *path = "t/test.tks";
+   char        buff[100];
+   FILE       *out;
+   size_t      len, blob;
+   unsigned    bad;                               /* a uint32_t offset */
+   int         i;
+
+   printf_test_name("test_save_mmap", "tokenset_save, tokenset_open_mmap");
+
+   for (i = 0; i < 5000; i++) {
+      sprintf(buff, "mapped %d", i);
+      tokenset_add(p, buff);
+   }
+   tokenset_remove(p, "mapped 42");
+
+   ASSERT_EQUALS(0, tokenset_save(p, path));
+   f = tokenset_open_mmap(path);
+   ASSERT("Open test", f);
+   ASSERT_EQUALS(4999, tokenset_frozen_count(f));
+   for (i = 0; i < 5000; i++) {
+      sprintf(buff, "mapped %d", i);
+      ASSERT_EQUALS(tokenset_id(p, buff), tokenset_frozen_id(f, buff));
+   }
+   ASSERT_STRING_EQUALS("mapped 4999", tokenset_frozen_get_by_id_n(f, 4999, &len));
+   ASSERT_EQUALS(11, len);
+   ASSERT_EQUALS(-1, tokenset_frozen_id(f, "mapped 5000"));
+   tokenset_frozen_free(&f);
+   ASSERT_EQUALS(NULL, f);
+
+   /* A damaged offset past the blob: lookups of the ids around it fail */
+   for (i = 0, blob = 0; i < 5000; i++)
+      if (42 != i)
+         blob += sprintf(buff, "mapped %d", i) + 1;
+   out = fopen(path, "r+b");
+   fseek(out, 0, SEEK_END);
+   bad = 0xFFFFFFF0u;
+   fseek(out, ftell(out) - (long) (4999 + blob) - (long) ((5001 - 10) * sizeof(bad)), SEEK_SET);
+   fwrite(&bad, sizeof(bad), 1, out);
+   fclose(out);
+   f = tokenset_open_mmap(path);
+   ASSERT("Open test", f);
+   ASSERT_EQUALS(NULL, tokenset_frozen_get_by_id_n(f, 9, &len));
+   ASSERT_EQUALS(0, len);
+   ASSERT_EQUALS(NULL, tokenset_frozen_get_by_id_n(f, 10, &len));
+   ASSERT_EQUALS(-1, tokenset_frozen_id(f, "mapped 9"));
+   ASSERT_EQUALS(-1, tokenset_frozen_id(f, "mapped 10"));
+   ASSERT_STRING_EQUALS("mapped 11", tokenset_frozen_get_by_id_n(f, 11, &len));
+   tokenset_frozen_free(&f);
+
+   /* Anything else is turned away */
+   out = fopen(path, "wb");
+   fputs("not a tokenset, though long enough for a header", out);
+   fclose(out);
+   ASSERT_EQUALS(NULL, tokenset_open_mmap(path));
+   remove(path);
+   ASSERT_EQUALS(NULL, tokenset_open_mmap(path));
+
+   tokenset_free(&p);
+}
+
+
+/* Check ids against a plain byte-at-a-time split of buf on delims */
+static int
+ingest_agrees(struct tokenset *p, const char *buf, size_t len, const char *delims,
+              const int *ids, size_t n)
+{
+   size_t      i = 0, j, k = 0;
+
+   for (;;) {
+      while (i < len && NULL != strchr(delims, buf[i]))
+         i++;
+      if (i == len)
+         return k == n;
+      for (j = i; j < len && NULL == strchr(delims, buf[j]); j++)
+         ;
+      if (k == n || ids[k] != tokenset_id_n(p, buf + i, j - i))
+         return 0;
+      k++;
+      i = j;
+   }
+}
+
+struct ingest_tally {
+   size_t      tokens;
+   int         last;
+};
+
+static void
+ingest_cb(void *arg, const int *ids, size_t n)
+{
+   struct ingest_tally *t = (struct ingest_tally *) arg;
+
+   t->tokens += n;
+   t->last = ids[n - 1];
+}
+
+static void
+test_ingest(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct ingest_tally tally;
+   const char  text[] = "  The cat, the hat; the\tcat!\n(on a mat)  ";
+   size_t      len = 70000;
+   char       *buf = (char *) malloc(len + 1);
+   int        *ids = (int *) malloc((len / 2 + 1) * sizeof(int));
+   const char *odd = "acegikmoqsuwy02468 ";       /* too many runs to vectorize */
+   FILE       *fp;
+   size_t      i, n;
+
+   printf_test_name("test_ingest", "tokenset_ingest_buffer, tokenset_ingest_fd");
+
+   n = tokenset_ingest_buffer(p, text, strlen(text), NULL, ids);
+   ASSERT_EQUALS(9, n);
+   ASSERT_EQUALS(0, ids[0]);
+   ASSERT_EQUALS(tokenset_id(p, "cat,"), ids[1]);
+   ASSERT_EQUALS(ids[2], ids[4]);
+   ASSERT_EQUALS(-1, tokenset_id(p, "cat"));
+
+   n = tokenset_ingest_buffer(p, text, strlen(text), TOKENSET_DELIMS_PUNCT, ids);
+   ASSERT_EQUALS(9, n);
+   ASSERT_EQUALS(tokenset_id(p, "cat"), ids[1]);
+   ASSERT_EQUALS(ids[1], ids[5]);
+   ASSERT_STRING_EQUALS("mat", tokenset_get_by_id(p, ids[8]));
+
+   /* Random text, across every alignment, by both scanners */
+   for (i = 0; i < len; i++)
+      buf[i] = "ab cd\te.,f0 "[rand() % 12];
+   buf[len] = '\0';
+   n = tokenset_ingest_buffer(p, buf, len, TOKENSET_DELIMS_PUNCT, ids);
+   ASSERT("punctuation", ingest_agrees(p, buf, len, TOKENSET_DELIMS_PUNCT, ids, n));
+   n = tokenset_ingest_buffer(p, buf + 3, len - 3, odd, ids);
+   ASSERT("no SIMD", ingest_agrees(p, buf + 3, len - 3, odd, ids, n));
+   ASSERT_EQUALS(0, tokenset_ingest_buffer(p, "  \n ", 4, NULL, NULL));
+
+   /* From a file: a token longer than the read buffer, then many short ones */
+   tokenset_reset(p);
+   fp = tmpfile();
+   for (i = 0; i < 1500000; i++)
+      fputc('x', fp);
+   for (i = 0; i < 400000; i++)
+      fprintf(fp, " w%d", (int) (i % 1000));
+   fputs(" last", fp);
+   rewind(fp);
+
+   tally.tokens = 0;
+   ASSERT_EQUALS(0, tokenset_ingest_fd(p, fileno(fp), NULL, ingest_cb, &tally));
+   ASSERT_EQUALS(400002, tally.tokens);
+   ASSERT_EQUALS(1002, tokenset_count(p));
+   ASSERT_EQUALS(tokenset_id(p, "last"), tally.last);
+   ASSERT_EQUALS(1500000, strlen(tokenset_get_by_id(p, 0)));
+   ASSERT_EQUALS(tokenset_id_n(p, "w999", 4), 1000);
+   fclose(fp);
+
+   free(buf);
+   free(ids);
+   tokenset_free(&p);
+}
+
+
+static void
+test_counts(void)
+{
+   struct tokenset *p = tokenset_new_with_flags(TOKENSET_COUNTS);
+   struct tokenset *q = tokenset_new_with_flags(TOKENSET_COUNTS | TOKENSET_FLAT);
+   const char *text = "b a c a b a d e a e";
+   unsigned    top[8];
+   char        buff[32];
+   int         i, j;
+
+   printf_test_name("test_counts", "TOKENSET_COUNTS, tokenset_top_k, tokenset_prune");
+
+   tokenset_ingest_buffer(p, text, strlen(text), NULL, NULL);
+   ASSERT_EQUALS(4, tokenset_freq(p, tokenset_id(p, "a")));
+   ASSERT_EQUALS(2, tokenset_freq(p, tokenset_id(p, "b")));
+   ASSERT_EQUALS(1, tokenset_freq(p, tokenset_id(p, "c")));
+   ASSERT_EQUALS(0, tokenset_freq(p, 99));
+
+   /* Ties go to the smaller id: b before e, c before d */
+   ASSERT_EQUALS(5, tokenset_top_k(p, 8, top));
+   ASSERT_STRING_EQUALS("a", tokenset_get_by_id(p, top[0]));
+   ASSERT_STRING_EQUALS("b", tokenset_get_by_id(p, top[1]));
+   ASSERT_STRING_EQUALS("e", tokenset_get_by_id(p, top[2]));
+   ASSERT_STRING_EQUALS("c", tokenset_get_by_id(p, top[3]));
+   ASSERT_STRING_EQUALS("d", tokenset_get_by_id(p, top[4]));
+   ASSERT_EQUALS(2, tokenset_top_k(p, 2, top));
+   ASSERT_STRING_EQUALS("b", tokenset_get_by_id(p, top[1]));
+
+   ASSERT_EQUALS(2, tokenset_prune(p, 2));
+   ASSERT_EQUALS(3, tokenset_count(p));
+   ASSERT_EQUALS(0, tokenset_exists(p, "c"));
+   ASSERT_EQUALS(0, tokenset_id(p, "b"));
+
+   /* Removing forgets the count */
+   tokenset_remove(p, "a");
+   tokenset_add(p, "a");
+   ASSERT_EQUALS(1, tokenset_freq(p, tokenset_id(p, "a")));
+
+   /* Token i added i + 1 times; the heap must agree with the obvious answer */
+   for (j = 0; j < 200; j++)
+      for (i = j; i < 200; i++) {
+         sprintf(buff, "n%d", (i * 37) % 200);
+         tokenset_add(q, buff);
+      }
+   ASSERT_EQUALS(8, tokenset_top_k(q, 8, top));
+   for (i = 0; i < 8; i++)
+      ASSERT_EQUALS((unsigned) (200 - i), tokenset_freq(q, top[i]));
+   ASSERT_EQUALS(100, tokenset_prune(q, 101));
+   ASSERT_EQUALS(100, tokenset_count(q));
+   ASSERT_EQUALS(0, tokenset_top_k(q, 0, top));
+
+   /* Without the flag each token counts once */
+   tokenset_free(&p);
+   p = tokenset_new();
+   tokenset_add(p, "x");
+   tokenset_add(p, "x");
+   ASSERT_EQUALS(1, tokenset_freq(p, 0));
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+}
+
+
+static void
+test_reuse_compact(void)
+{
+   unsigned    modes[2];
+   unsigned   *remap = (unsigned *) malloc(2000 * sizeof(unsigned));
+   char        buff[32];
+   int         m, i;
+
+   printf_test_name("test_reuse_compact", "TOKENSET_REUSE_IDS, tokenset_compact");
+
+   modes[0] = TOKENSET_REUSE_IDS;
+   modes[1] = TOKENSET_REUSE_IDS | TOKENSET_FLAT | TOKENSET_ARENA;
+
+   for (m = 0; m < 2; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+      struct tokenset *q = tokenset_new_with_flags(modes[m] & ~TOKENSET_REUSE_IDS);
+      struct tokenset_iter it;
+      const char *tok;
+      unsigned    id;
+      size_t      seen;
+
+      for (i = 0; i < 1000; i++) {
+         sprintf(buff, "churn %d", i);
+         tokenset_add(p, buff);
+         tokenset_add(q, buff);
+      }
+      for (i = 1; i < 1000; i += 2) {
+         sprintf(buff, "churn %d", i);
+         tokenset_remove(p, buff);
+         tokenset_remove(q, buff);
+      }
+
+      /* Freed ids go back out, newest first, before fresh ones */
+      ASSERT_EQUALS(999, tokenset_add(p, "fresh 0"));
+      for (i = 1; i < 600; i++) {
+         sprintf(buff, "fresh %d", i);
+         tokenset_add(p, buff);
+         tokenset_add(q, buff);
+      }
+      ASSERT_EQUALS(1100, tokenset_count(p));
+      ASSERT_EQUALS(1100, tokenset_id_limit(p));
+      ASSERT_EQUALS(1599, tokenset_id_limit(q));
+
+      /* Every token listed once, ids and texts agreeing */
+      seen = 0;
+      tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+      while (tokenset_iter_next(&it, &tok, NULL, &id)) {
+         ASSERT_EQUALS((int) id, tokenset_id_n(p, tok, strlen(tok)));
+         seen += 1;
+      }
+      ASSERT_EQUALS(1100, seen);
+
+      /* Compaction closes the gaps and says where everything went */
+      ASSERT_EQUALS(1099, tokenset_compact(q, remap));
+      ASSERT_EQUALS(1099, tokenset_id_limit(q));
+      ASSERT_EQUALS(0, remap[0]);
+      ASSERT_EQUALS((unsigned) -1, remap[1]);
+      ASSERT_EQUALS(1, remap[2]);
+      ASSERT_EQUALS(500, remap[1000]);
+      for (i = 0; i < 1000; i += 2) {
+         sprintf(buff, "churn %d", i);
+         ASSERT_EQUALS(i / 2, tokenset_id(q, buff));
+         ASSERT_STRING_EQUALS(buff, tokenset_get_by_id(q, i / 2));
+      }
+      ASSERT_STRING_EQUALS("fresh 599", tokenset_get_by_id(q, 1098));
+
+      seen = 0;
+      tokenset_sort(q);
+      tokenset_iter_init(q, &it, TOKENSET_ITER_LIST);
+      while (tokenset_iter_next(&it, &tok, NULL, &id)) {
+         ASSERT_EQUALS((int) id, tokenset_id_n(q, tok, strlen(tok)));
+         seen += 1;
+      }
+      ASSERT_EQUALS(1099, seen);
+
+      /* The table still works after renumbering */
+      tokenset_remove(q, "churn 0");
+      ASSERT_EQUALS(-1, tokenset_id(q, "churn 0"));
+      ASSERT_EQUALS(1099, tokenset_add(q, "after"));
+      ASSERT_EQUALS(1099, tokenset_compact(q, NULL));
+      ASSERT_EQUALS(1098, tokenset_id(q, "after"));
+      ASSERT_STRING_EQUALS("churn 2", tokenset_get_by_id(q, 0));
+
+      tokenset_free(&p);
+      tokenset_free(&q);
+   }
+
+   free(remap);
+}
+
+
+/* Tokens of p visited by it, checking they ascend; -1 if they do not */
+static int
+ordered_walk(struct tokenset_iter *it)
+{
+   const char *tok, *prev = NULL;
+   size_t      len, prevlen = 0;
+   int         n = 0;
+
+   while (tokenset_iter_next(it, &tok, &len, NULL)) {
+      if (NULL != prev) {
+         int         c = memcmp(prev, tok, prevlen < len ? prevlen : len);
+
+         if (c > 0 || (0 == c && prevlen >= len))
+            return -1;
+      }
+      prev = tok;
+      prevlen = len;
+      n += 1;
+   }
+
+   return n;
+}
+
+static void
+test_ordered(void)
+{
+   unsigned    modes[2];
+   char        buff[32];
+   int         m, i;
+
+   printf_test_name("test_ordered", "TOKENSET_ORDERED, tokenset_lower_bound, tokenset_iter_range");
+
+   modes[0] = TOKENSET_ORDERED;
+   modes[1] = TOKENSET_ORDERED | TOKENSET_FLAT;
+
+   for (m = 0; m < 2; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+      struct tokenset *q = tokenset_new_with_flags(modes[m] & ~TOKENSET_ORDERED);
+      struct tokenset_iter it;
+      const char *tok;
+
+      /* Deep enough for splits, merges and borrows at every level */
+      for (i = 0; i < 20000; i++) {
+         sprintf(buff, "%x", (unsigned) (i * 2654435761u) >> 8);
+         tokenset_add(p, buff);
+         tokenset_add(q, buff);
+      }
+      for (i = 0; i < 20000; i += 3) {
+         sprintf(buff, "%x", (unsigned) (i * 2654435761u) >> 8);
+         tokenset_remove(p, buff);
+         tokenset_remove(q, buff);
+      }
+      tokenset_add_n(p, "", 0);
+      tokenset_add_n(q, "", 0);
+
+      tokenset_iter_init(p, &it, TOKENSET_ITER_SORTED);
+      ASSERT_EQUALS(tokenset_count(p), ordered_walk(&it));
+
+      /* Ranges agree with the sorted listing of a plain tokenset */
+      tokenset_iter_range(p, &it, "4", 1, "a", 1);
+      i = ordered_walk(&it);
+      tokenset_iter_range(q, &it, "4", 1, "a", 1);
+      ASSERT_EQUALS(i, ordered_walk(&it));
+      ASSERT("nonempty", i > 1000);
+
+      tokenset_lower_bound(p, &it, "7ff", 3);
+      tokenset_iter_next(&it, &tok, NULL, NULL);
+      ASSERT("at or past the key", strcmp(tok, "7ff") >= 0);
+      tokenset_lower_bound(q, &it, "7ff", 3);
+      i = ordered_walk(&it);
+      tokenset_lower_bound(p, &it, "7ff", 3);
+      ASSERT_EQUALS(i, ordered_walk(&it));
+
+      tokenset_lower_bound(p, &it, "", 0);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, &tok, NULL, NULL));
+      ASSERT_STRING_EQUALS("", tok);
+      tokenset_lower_bound(p, &it, "zz", 2);
+      ASSERT_EQUALS(0, tokenset_iter_next(&it, &tok, NULL, NULL));
+      tokenset_iter_range(p, &it, "5", 1, "5", 1);
+      ASSERT_EQUALS(0, ordered_walk(&it));
+
+      /* tokenset_sort() takes the order from the index */
+      tokenset_sort(p);
+      tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+      ASSERT_EQUALS(tokenset_count(p), ordered_walk(&it));
+
+      /* Empty it completely, then reuse it */
+      for (i = 0; i < 20000; i++) {
+         sprintf(buff, "%x", (unsigned) (i * 2654435761u) >> 8);
+         tokenset_remove(p, buff);
+      }
+      tokenset_remove(p, "");
+      ASSERT_EQUALS(0, tokenset_count(p));
+      tokenset_iter_init(p, &it, TOKENSET_ITER_SORTED);
+      ASSERT_EQUALS(0, ordered_walk(&it));
+      tokenset_add(p, "b");
+      tokenset_add(p, "a");
+      tokenset_reset(p);
+      tokenset_add(p, "d");
+      tokenset_add(p, "c");
+      tokenset_iter_init(p, &it, TOKENSET_ITER_SORTED);
+      ASSERT_EQUALS(2, ordered_walk(&it));
+
+      tokenset_free(&p);
+      tokenset_free(&q);
+   }
+}
+
+
 static void
 test_add(void)
 {
@@ -225,6 +1330,598 @@ test_add(void)
 }
 
 
+/* Count occurrences in buf of tokens of up to maxlen bytes, one lookup at a time */
+static size_t
+matcher_brute(struct tokenset *p, const char *buf, size_t len, size_t maxlen)
+{
+   size_t      end, k, n = 0;
+
+   for (end = 1; end <= len; end++)
+      for (k = 1; k <= maxlen && k <= end; k++)
+         n += tokenset_exists_n(p, buf + end - k, k);
+
+   return n;
+}
+
+struct matcher_log {
+   struct tokenset_match ms[8];
+   size_t      n;
+   size_t      end;                              /* of the last match, which must not go back */
+   int         bad;
+   struct tokenset *p;
+   const char *text;
+};
+
+static void
+matcher_cb(void *arg, const struct tokenset_match *ms, size_t n)
+{
+   struct matcher_log *log = (struct matcher_log *) arg;
+   size_t      i, len;
+   const char *tok;
+
+   for (i = 0; i < n; i++) {
+      tok = tokenset_get_by_id_n(log->p, ms[i].id, &len);
+      if (len != ms[i].len || 0 != memcmp(tok, log->text + ms[i].offset, len))
+         log->bad = 1;
+      if (ms[i].offset + len < log->end)
+         log->bad = 1;
+      log->end = ms[i].offset + len;
+      if (log->n < 8)
+         log->ms[log->n] = ms[i];
+      log->n++;
+   }
+}
+
+static void
+test_matcher(void)
+{
+   struct tokenset *p = tokenset_new();
+   struct tokenset_matcher *m;
+   struct matcher_log log;
+   size_t      len = 1300000, n, i;
+   char       *buf = (char *) malloc(len);
+   char        all[256];
+   char        key[8];
+   FILE       *fp;
+
+   printf_test_name("test_matcher", "tokenset_build_matcher, tokenset_match_buffer, tokenset_match_fd");
+
+   tokenset_add(p, "he");
+   tokenset_add(p, "she");
+   tokenset_add(p, "gone");
+   tokenset_add(p, "his");
+   tokenset_add(p, "hers");
+   tokenset_add(p, "");
+   tokenset_remove(p, "gone");
+
+   m = tokenset_build_matcher(p);
+   ASSERT("built", NULL != m);
+   memset(&log, 0, sizeof(log));
+   log.p = p;
+   log.text = "ushers gone";
+   ASSERT_EQUALS(3, tokenset_match_buffer(m, log.text, strlen(log.text), matcher_cb, &log));
+   ASSERT_EQUALS(3, log.n);
+   ASSERT_EQUALS(0, log.bad);
+   ASSERT_EQUALS(tokenset_id(p, "she"), (int) log.ms[0].id);
+   ASSERT_EQUALS(1, log.ms[0].offset);
+   ASSERT_EQUALS(tokenset_id(p, "he"), (int) log.ms[1].id);
+   ASSERT_EQUALS(2, log.ms[1].offset);
+   ASSERT_EQUALS(tokenset_id(p, "hers"), (int) log.ms[2].id);
+   ASSERT_EQUALS(4, log.ms[2].len);
+   ASSERT_EQUALS(0, tokenset_match_buffer(m, "xyz", 3, matcher_cb, &log));
+   tokenset_matcher_free(&m);
+   ASSERT_EQUALS(NULL, m);
+
+   /* A random dictionary against random text, then the same text from a file */
+   tokenset_reset(p);
+   for (i = 0; i < 300; i++) {
+      size_t      k, klen = 1 + rand() % 4;
+
+      for (k = 0; k < klen; k++)
+         key[k] = "abc"[rand() % 3];
+      tokenset_add_n(p, key, klen);
+   }
+   for (i = 0; i < len; i++)
+      buf[i] = "abcd"[rand() % 4];
+
+   m = tokenset_build_matcher(p);
+   n = matcher_brute(p, buf, len, 4);
+   memset(&log, 0, sizeof(log));
+   log.p = p;
+   log.text = buf;
+   ASSERT_EQUALS(n, tokenset_match_buffer(m, buf, len, matcher_cb, &log));
+   ASSERT_EQUALS(n, log.n);
+   ASSERT_EQUALS(0, log.bad);
+   ASSERT_EQUALS(n, tokenset_match_buffer(m, buf, len, NULL, NULL));
+
+   fp = tmpfile();
+   fwrite(buf, 1, len, fp);
+   rewind(fp);
+   memset(&log, 0, sizeof(log));
+   log.p = p;
+   log.text = buf;
+   ASSERT_EQUALS(0, tokenset_match_fd(m, fileno(fp), matcher_cb, &log, &i));
+   ASSERT_EQUALS(n, i);
+   ASSERT_EQUALS(0, log.bad);
+   fclose(fp);
+   tokenset_matcher_free(&m);
+
+   /* Few matches, so the scan's lanes hold them over */
+   tokenset_reset(p);
+   tokenset_add(p, "abcda");
+   tokenset_add(p, "dd");
+   tokenset_add(p, "dabc");
+   m = tokenset_build_matcher(p);
+   n = matcher_brute(p, buf, len, 5);
+   memset(&log, 0, sizeof(log));
+   log.p = p;
+   log.text = buf;
+   ASSERT_EQUALS(n, tokenset_match_buffer(m, buf, len, matcher_cb, &log));
+   ASSERT_EQUALS(n, log.n);
+   ASSERT_EQUALS(0, log.bad);
+   tokenset_matcher_free(&m);
+
+   /* Every byte value in use */
+   for (i = 0; i < 256; i++)
+      all[i] = (char) (255 - i);
+   tokenset_add_n(p, all, 256);
+   m = tokenset_build_matcher(p);
+   ASSERT_EQUALS(1 + matcher_brute(p, all, 256, 5), tokenset_match_buffer(m, all, 256, NULL, NULL));
+   ASSERT_EQUALS(n, tokenset_match_buffer(m, buf, len, NULL, NULL));
+   ASSERT("bytes", tokenset_matcher_bytes(m) > 257 * 256 * 4);
+   tokenset_matcher_free(&m);
+
+   free(buf);
+   tokenset_free(&p);
+}
+
+
+static void
+test_inline(void)
+{
+   unsigned    modes[3];
+   char        buff[40];
+   size_t      len;
+   int         m, i;
+
+   printf_test_name("test_inline", "short tokens kept in their nodes");
+
+   modes[0] = 0;
+   modes[1] = TOKENSET_ARENA;
+   modes[2] = TOKENSET_ARENA | TOKENSET_FLAT;
+
+   for (m = 0; m < 3; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+
+      /* Lengths 1 to 39 straddle the inline limit */
+      for (i = 1; i < 40; i++) {
+         memset(buff, 'a' + i % 26, (size_t) i);
+         ASSERT_EQUALS(i - 1, tokenset_add_n(p, buff, (size_t) i));
+      }
+      for (i = 1; i < 40; i++) {
+         const char *tok = tokenset_get_by_id_n(p, (unsigned) i - 1, &len);
+
+         ASSERT_EQUALS((size_t) i, len);
+         ASSERT_EQUALS('\0', tok[len]);
+         memset(buff, 'a' + i % 26, (size_t) i);
+         ASSERT_EQUALS(i - 1, tokenset_id_n(p, buff, (size_t) i));
+      }
+
+      /* Freed nodes come back for tokens of the other kind */
+      for (i = 1; i < 40; i += 2) {
+         memset(buff, 'a' + i % 26, (size_t) i);
+         tokenset_remove_n(p, buff, (size_t) i);
+      }
+      for (i = 1; i < 40; i += 2) {
+         memset(buff, 'A' + i % 26, (size_t) (40 - i));
+         tokenset_add_n(p, buff, (size_t) (40 - i));
+      }
+      for (i = 1; i < 40; i += 2) {
+         memset(buff, 'A' + i % 26, (size_t) (40 - i));
+         ASSERT_EQUALS(1, tokenset_exists_n(p, buff, (size_t) (40 - i)));
+         memset(buff, 'a' + (i + 1) % 26, (size_t) (i + 1));
+         ASSERT_EQUALS(i + 1 < 40, tokenset_exists_n(p, buff, (size_t) (i + 1)));
+      }
+      ASSERT_EQUALS(39, tokenset_count(p));
+
+      tokenset_free(&p);
+   }
+}
+
+
+static void
+test_merge(void)
+{
+   struct tokenset *dst = tokenset_new_with_flags(TOKENSET_COUNTS | TOKENSET_FLAT);
+   struct tokenset *src = tokenset_new_with_flags(TOKENSET_COUNTS | TOKENSET_HASH_WY);
+   struct tokenset *shards[8];
+   struct tokenset *seq, *one, *four;
+   unsigned    remap[8];
+   unsigned   *remaps[8], *again[8];
+   char        buff[32];
+   size_t      len;
+   int         i, k, ok;
+
+   printf_test_name("test_merge", "tokenset_merge, tokenset_merge_parallel");
+
+   tokenset_add(dst, "a");
+   tokenset_add(dst, "b");
+   tokenset_add(src, "b");
+   tokenset_add(src, "b");
+   tokenset_add(src, "gone");
+   tokenset_add(src, "c");
+   tokenset_remove(src, "gone");
+   ASSERT_EQUALS(0, tokenset_merge(dst, src, remap));
+   ASSERT_EQUALS(3, tokenset_count(dst));
+   ASSERT_EQUALS(1, remap[0]);
+   ASSERT_EQUALS((unsigned) -1, remap[1]);
+   ASSERT_EQUALS(2, remap[2]);
+   ASSERT_EQUALS(3, tokenset_freq(dst, 1));
+   ASSERT_EQUALS(1, tokenset_freq(dst, 2));
+   ASSERT_EQUALS(2, tokenset_freq(src, 0));
+   tokenset_free(&dst);
+   tokenset_free(&src);
+
+   /* Shards with overlapping vocabularies, counted */
+   seq = tokenset_new_with_flags(TOKENSET_COUNTS);
+   for (k = 0; k < 8; k++) {
+      shards[k] = tokenset_new_with_flags(k % 2 ? TOKENSET_COUNTS | TOKENSET_FLAT
+                                          : TOKENSET_COUNTS | TOKENSET_HASH_XXH32);
+      for (i = 0; i < 3000; i++) {
+         sprintf(buff, "w%d", rand() % 5000);
+         tokenset_add(shards[k], buff);
+      }
+      sprintf(buff, "w%d", rand() % 5000);
+      tokenset_remove(shards[k], buff);
+      ASSERT_EQUALS(0, tokenset_merge(seq, shards[k], NULL));
+      remaps[k] = (unsigned *) malloc(tokenset_id_limit(shards[k]) * sizeof(unsigned));
+      again[k] = (unsigned *) malloc(tokenset_id_limit(shards[k]) * sizeof(unsigned));
+   }
+
+   one = tokenset_merge_parallel(shards, 8, TOKENSET_COUNTS, 1, remaps);
+   four = tokenset_merge_parallel(shards, 8, TOKENSET_COUNTS, 4, again);
+   ASSERT("merged", NULL != one && NULL != four);
+   ASSERT_EQUALS(tokenset_count(seq), tokenset_count(one));
+   ASSERT_EQUALS(tokenset_count(one), (int) tokenset_id_limit(one));
+
+   /* Ids do not depend on the thread count, and every remap points at its token */
+   ok = 1;
+   for (i = 0; i < tokenset_count(one); i++)
+      ok &= 0 == strcmp(tokenset_get_by_id(one, (unsigned) i),
+                        tokenset_get_by_id(four, (unsigned) i));
+   for (k = 0; k < 8; k++) {
+      unsigned    id;
+
+      for (id = 0; id < tokenset_id_limit(shards[k]); id++) {
+         const char *tok = tokenset_get_by_id_n(shards[k], id, &len);
+
+         if (NULL == tok)
+            ok &= (unsigned) -1 == remaps[k][id];
+         else {
+            ok &= remaps[k][id] == again[k][id];
+            ok &= tokenset_id_n(one, tok, len) == (int) remaps[k][id];
+         }
+      }
+   }
+   ASSERT("remaps agree", ok);
+
+   /* Counts add up as they do merging one shard at a time */
+   for (i = 0; i < tokenset_count(one); i++) {
+      const char *tok = tokenset_get_by_id_n(one, (unsigned) i, &len);
+
+      ok &= tokenset_freq(one, (unsigned) i)
+         == tokenset_freq(seq, (unsigned) tokenset_id_n(seq, tok, len));
+   }
+   ASSERT("counts agree", ok);
+
+   tokenset_free(&one);
+   tokenset_free(&four);
+   tokenset_free(&seq);
+   for (k = 0; k < 8; k++) {
+      tokenset_free(&shards[k]);
+      free(remaps[k]);
+      free(again[k]);
+   }
+}
+
+
+/* Is the listing order of p sorted, with every token still under its id */
+static int
+sort_checks(struct tokenset *p, size_t n)
+{
+   struct tokenset_iter it;
+   const char *tok, *prev = NULL;
+   size_t      len, prevlen = 0, seen = 0;
+   unsigned    id;
+
+   tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+   while (tokenset_iter_next(&it, &tok, &len, &id)) {
+      if (NULL != prev) {
+         int         c = memcmp(prev, tok, prevlen < len ? prevlen : len);
+
+         if (c > 0 || (0 == c && prevlen >= len))
+            return 0;
+      }
+      if (tokenset_id_n(p, tok, len) != (int) id)
+         return 0;
+      prev = tok;
+      prevlen = len;
+      seen++;
+   }
+
+   return seen == n;
+}
+
+static void
+test_sort(void)
+{
+   struct tokenset_iter it;
+   unsigned    modes[3];
+   char        buff[200];
+   size_t      i, k, len, n;
+   int         m;
+
+   printf_test_name("test_sort", "tokenset_sort, tokenset_sort_parallel");
+
+   modes[0] = 0;
+   modes[1] = TOKENSET_FLAT;
+   modes[2] = TOKENSET_FLAT | TOKENSET_ARENA;
+
+   for (m = 0; m < 3; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+
+      /* Empty, NUL bytes, high bytes, prefixes of each other and long shared prefixes */
+      tokenset_sort(p);
+      ASSERT("empty", sort_checks(p, 0));
+      tokenset_add_n(p, "", 0);
+      tokenset_add_n(p, "a\0", 2);
+      tokenset_add_n(p, "a", 1);
+      tokenset_add_n(p, "a\0b", 3);
+      tokenset_add_n(p, "\xff", 1);
+      tokenset_add_n(p, "abcdefgh", 8);
+      tokenset_add_n(p, "abcdefghi", 9);
+      tokenset_add_n(p, "abcdefg", 7);
+      memset(buff, 'x', sizeof(buff));
+      for (i = 0; i < 300; i++) {
+         len = 100 + rand() % 100;
+         for (k = 90; k < len; k++)
+            buff[k] = "xy\0"[rand() % 3];
+         tokenset_add_n(p, buff, len);
+      }
+      for (i = 0; i < 5000; i++) {
+         len = rand() % 20;
+         for (k = 0; k < len; k++)
+            buff[k] = (char) (rand() % 4 ? 'a' + rand() % 3 : rand() % 256);
+         tokenset_add_n(p, buff, len);
+      }
+      for (i = 3; i < 5000; i += 3) {
+         const char *tok = tokenset_get_by_id_n(p, (unsigned) i, &len);
+
+         if (NULL != tok) {
+            memcpy(buff, tok, len);
+            tokenset_remove_n(p, buff, len);
+         }
+      }
+      n = (size_t) tokenset_count(p);
+      tokenset_sort(p);
+      ASSERT("sorted", sort_checks(p, n));
+      tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+      tokenset_iter_next(&it, NULL, &len, NULL);
+      ASSERT_EQUALS((size_t) 0, len);
+
+      /* Enough for threads, which split on the second byte */
+      for (i = 0; i < 70000; i++) {
+         sprintf(buff, "t%c%lu", (char) ('a' + i % 7), (unsigned long) (i * 2654435761u % 1000003));
+         tokenset_add(p, buff);
+      }
+      n = (size_t) tokenset_count(p);
+      tokenset_sort_parallel(p, 4);
+      ASSERT("sorted in parallel", sort_checks(p, n));
+      tokenset_add(p, "zzz");
+      tokenset_sort_parallel(p, 0);
+      ASSERT("sorted again", sort_checks(p, n + 1));
+
+      tokenset_free(&p);
+   }
+}
+
+
+static void
+test_bloom(void)
+{
+   unsigned    modes[3];
+   const char *keys[4];
+   int         ids[4];
+   char        buff[32];
+   int         m, i, wrong;
+
+   printf_test_name("test_bloom", "TOKENSET_BLOOM, tokenset_bloom");
+
+   modes[0] = TOKENSET_BLOOM;
+   modes[1] = TOKENSET_BLOOM | TOKENSET_FLAT | TOKENSET_ARENA;
+   modes[2] = 0;                                  /* turned on afterwards */
+
+   for (m = 0; m < 3; m++) {
+      struct tokenset *p = tokenset_new_with_flags(modes[m]);
+      struct tokenset_stats st;
+      size_t      bytes;
+
+      /* Grows well past the smallest filter */
+      for (i = 0; i < 5000; i++) {
+         sprintf(buff, "present %d", i);
+         ASSERT_EQUALS(i, tokenset_add(p, buff));
+      }
+      if (2 == m) {
+         tokenset_stats(p, &st);
+         ASSERT_EQUALS(0, st.bloom_bytes);
+         ASSERT_EQUALS(0, tokenset_bloom(p, 100));
+         ASSERT_EQUALS(1, tokenset_exists(p, "present 0"));
+      }
+      tokenset_stats(p, &st);
+      ASSERT("filter sized for the tokens", st.bloom_bytes >= 5000 * 2);
+      bytes = st.bloom_bytes;
+
+      /* No false negatives, and no false positives get past the table */
+      for (i = wrong = 0; i < 5000; i++) {
+         sprintf(buff, "present %d", i);
+         wrong += i != tokenset_id(p, buff);
+      }
+      for (i = 0; i < 50000; i++) {
+         sprintf(buff, "absent %d", i);
+         wrong += tokenset_exists(p, buff);
+      }
+      ASSERT_EQUALS(0, wrong);
+
+      keys[0] = "present 7";
+      keys[1] = "absent 7";
+      keys[2] = "present 4999";
+      keys[3] = "";
+      ASSERT_EQUALS(2, tokenset_id_batch(p, keys, NULL, 4, ids));
+      ASSERT_EQUALS(7, ids[0]);
+      ASSERT_EQUALS(-1, ids[1]);
+      ASSERT_EQUALS(4999, ids[2]);
+      ASSERT_EQUALS(-1, ids[3]);
+
+      /* Removed tokens linger in the filter but not in the answers */
+      for (i = 0; i < 5000; i += 2) {
+         sprintf(buff, "present %d", i);
+         tokenset_remove(p, buff);
+      }
+      ASSERT_EQUALS(0, tokenset_exists(p, "present 0"));
+      ASSERT_EQUALS(2500, tokenset_compact(p, NULL));
+      for (i = wrong = 0; i < 5000; i++) {
+         sprintf(buff, "present %d", i);
+         wrong += (i % 2 ? i / 2 : -1) != tokenset_id(p, buff);
+      }
+      ASSERT_EQUALS(0, wrong);
+      tokenset_stats(p, &st);
+      ASSERT("rebuilt no larger", st.bloom_bytes <= bytes);
+
+      /* A reset empties the filter too */
+      tokenset_reset(p);
+      ASSERT_EQUALS(0, tokenset_exists(p, "present 1"));
+      ASSERT_EQUALS(0, tokenset_add(p, "present 1"));
+      ASSERT_EQUALS(1, tokenset_exists(p, "present 1"));
+
+      /* Off again, and everything still answers */
+      ASSERT_EQUALS(0, tokenset_bloom(p, 0));
+      tokenset_stats(p, &st);
+      ASSERT_EQUALS(0, st.bloom_bytes);
+      ASSERT_EQUALS(0, tokenset_id(p, "present 1"));
+      ASSERT_EQUALS(1, tokenset_add(p, "present 2"));
+
+      tokenset_free(&p);
+   }
+}
+
+
+static void
+test_packed(void)
+{
+   unsigned    hashes[2];
+   int         lens[3] = { 12, 32, 64 };
+   char        buff[80];
+   int         h, i, l, wrong;
+
+   printf_test_name("test_packed", "tokenset_packed_*");
+
+   hashes[0] = 0;
+   hashes[1] = TOKENSET_HASH_WY | TOKENSET_ARENA;    /* the arena flag is ignored */
+
+   for (h = 0; h < 2; h++) {
+      struct tokenset_packed *k = tokenset_packed_new(hashes[h]);
+      struct tokenset_packed *r = tokenset_packed_new(hashes[h]);
+      const char *tok;
+      size_t      len, text = 0, bytes;
+
+      ASSERT("Constructor test", k);
+      ASSERT_EQUALS(0, tokenset_packed_add_n(k, "alpha", 5));
+      ASSERT_EQUALS(1, tokenset_packed_add_n(k, "beta", 4));
+      ASSERT_EQUALS(0, tokenset_packed_add_n(k, "alpha", 5));
+      ASSERT_EQUALS(2, tokenset_packed_add_n(k, "a\0b", 3));
+      ASSERT_EQUALS(3, tokenset_packed_add_n(k, "", 0));
+      ASSERT_EQUALS(4, tokenset_packed_count(k));
+
+      tok = tokenset_packed_get_by_id_n(k, 2, &len);
+      ASSERT_EQUALS(3, len);
+      ASSERT("bytes kept", 0 == memcmp(tok, "a\0b", 4));
+      tok = tokenset_packed_get_by_id_n(k, 3, &len);
+      ASSERT_EQUALS(0, len);
+      ASSERT_STRING_EQUALS("", tok);
+      ASSERT_EQUALS(NULL, tokenset_packed_get_by_id_n(k, 4, &len));
+      ASSERT_EQUALS(0, len);
+      ASSERT_EQUALS(-1, tokenset_packed_id_n(k, "a", 1));
+      ASSERT_EQUALS(1, tokenset_packed_exists_n(k, "beta", 4));
+      ASSERT_EQUALS(0, tokenset_packed_exists_n(k, "bet", 3));
+
+      /* Many rehashes on the way; every token is found again */
+      for (i = wrong = 0; i < 100000; i++) {
+         len = sprintf(buff, "packed %d", i);
+         text += len;
+         wrong += i + 4 != tokenset_packed_add_n(k, buff, len);
+      }
+      ASSERT_EQUALS(0, wrong);
+      for (i = wrong = 0; i < 100000; i++) {
+         len = sprintf(buff, "packed %d", i);
+         wrong += i + 4 != tokenset_packed_id_n(k, buff, len);
+         tok = tokenset_packed_get_by_id_n(k, i + 4, &len);
+         wrong += len != strlen(buff) || 0 != strcmp(tok, buff);
+         len = sprintf(buff, "absent %d", i);
+         wrong += tokenset_packed_exists_n(k, buff, len);
+      }
+      ASSERT_EQUALS(0, wrong);
+
+      /* Under 16 bytes per token besides the token itself */
+      ASSERT("packed", tokenset_packed_bytes(k) - text < 16 * tokenset_packed_count(k));
+
+      /*
+       * Longer keys: under 16 once shrunk, and while growing within an
+       * eighth of the token bytes of that, checked whenever it grows
+       */
+      for (l = 0; l < 3; l++) {
+         struct tokenset_packed *g = tokenset_packed_new(hashes[h]);
+         size_t      gtext = 0, gbytes = tokenset_packed_bytes(g), n;
+
+         for (i = wrong = 0; i < 100000; i++) {
+            len = sprintf(buff, "%0*d", lens[l], i);
+            gtext += len;
+            tokenset_packed_add_n(g, buff, len);
+            if (gbytes == tokenset_packed_bytes(g))
+               continue;
+            gbytes = tokenset_packed_bytes(g);
+            n = tokenset_packed_count(g);
+            wrong += n >= 256 && gbytes - gtext >= 16 * n + (gtext + n) / 8;
+         }
+         ASSERT_EQUALS(0, wrong);
+         tokenset_packed_shrink(g);
+         ASSERT("packed", tokenset_packed_bytes(g) - gtext < 16 * tokenset_packed_count(g));
+         for (i = wrong = 0; i < 100000; i += 997) {
+            len = sprintf(buff, "%0*d", lens[l], i);
+            wrong += i != tokenset_packed_id_n(g, buff, len);
+         }
+         ASSERT_EQUALS(0, wrong);
+         ASSERT_EQUALS(100000, tokenset_packed_add_n(g, "after", 5));
+         ASSERT_EQUALS(100000, tokenset_packed_id_n(g, "after", 5));
+         tokenset_packed_free(&g);
+      }
+
+      /* Reserved up front, nothing grows */
+      ASSERT_EQUALS(0, tokenset_packed_reserve(r, 100000, text));
+      bytes = tokenset_packed_bytes(r);
+      for (i = 0; i < 100000; i++) {
+         len = sprintf(buff, "packed %d", i);
+         tokenset_packed_add_n(r, buff, len);
+      }
+      ASSERT_EQUALS(bytes, tokenset_packed_bytes(r));
+      ASSERT("tight", bytes - text < 13 * tokenset_packed_count(r));
+
+      tokenset_packed_free(&k);
+      tokenset_packed_free(&r);
+      ASSERT_EQUALS(NULL, k);
+   }
+}
+
+
 static void
 test_remove_1(void)
 {
@@ -378,6 +2075,68 @@ test_get(void)
    ASSERT_EQUALS(NULL, p);
 }
 
+static void
+test_iter(void)
+{
+   struct tokenset *p = tokenset_new_with_flags(TOKENSET_FLAT);
+   struct tokenset *q = tokenset_new();
+   struct tokenset_iter it;
+   const char *toks[8];
+   size_t      lens[8];
+   const char *cp;
+   size_t      len;
+   unsigned    id;
+   int         k;
+
+   printf_test_name("test_iter", "tokenset_get_view, tokenset_iter_init, tokenset_iter_next");
+
+   for (k = 0; k < 2; k++) {
+      struct tokenset *z = k ? q : p;
+
+      tokenset_add(z, "pear");
+      tokenset_add(z, "fig");
+      tokenset_add(z, "apple");
+      tokenset_add(z, "kiwi");
+      tokenset_remove(z, "fig");
+
+      ASSERT_EQUALS(3, tokenset_get_view(z, toks, lens, 8));
+      ASSERT_STRING_EQUALS("pear", toks[0]);
+      ASSERT_STRING_EQUALS("apple", toks[1]);
+      ASSERT_EQUALS(4, lens[2]);
+      ASSERT("borrowed, not copied", toks[0] == tokenset_get_by_id(z, 0));
+      ASSERT_EQUALS(2, tokenset_get_view(z, toks, NULL, 2));
+
+      tokenset_iter_init(z, &it, TOKENSET_ITER_SORTED);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, &cp, &len, &id));
+      ASSERT_STRING_EQUALS("apple", cp);
+      ASSERT_EQUALS(5, len);
+      ASSERT_EQUALS(2, id);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, &cp, NULL, NULL));
+      ASSERT_STRING_EQUALS("kiwi", cp);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, &cp, NULL, NULL));
+      ASSERT_STRING_EQUALS("pear", cp);
+      ASSERT_EQUALS(0, tokenset_iter_next(&it, &cp, NULL, NULL));
+
+      tokenset_iter_init(z, &it, TOKENSET_ITER_ID);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, NULL, NULL, &id));
+      ASSERT_EQUALS(0, id);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, NULL, NULL, &id));
+      ASSERT_EQUALS(2, id);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, NULL, NULL, &id));
+      ASSERT_EQUALS(3, id);
+      ASSERT_EQUALS(0, tokenset_iter_next(&it, NULL, NULL, &id));
+
+      /* Sorting changed the listing order */
+      tokenset_iter_init(z, &it, TOKENSET_ITER_LIST);
+      ASSERT_EQUALS(1, tokenset_iter_next(&it, &cp, NULL, NULL));
+      ASSERT_STRING_EQUALS("apple", cp);
+   }
+
+   tokenset_free(&p);
+   tokenset_free(&q);
+   ASSERT_EQUALS(NULL, q);
+}
+
 static void
 test_reset(void)
 {
@@ -417,11 +2176,36 @@ main(void)
    RUN(test_stress_1);
    RUN(test_stress_2);
    RUN(test_stress_3);
+   RUN(test_get_by_id_n);
+   RUN(test_get_range);
+   RUN(test_arena);
+   RUN(test_flat);
    RUN(test_add);
+   RUN(test_add_n);
+   RUN(test_add_batch);
+   RUN(test_id_batch);
+   RUN(test_hash_select);
+   RUN(test_hashed);
+   RUN(test_reserve);
+   RUN(test_stats);
+   RUN(test_concurrent);
+   RUN(test_freeze);
+   RUN(test_save_mmap);
+   RUN(test_ingest);
+   RUN(test_counts);
+   RUN(test_reuse_compact);
+   RUN(test_ordered);
+   RUN(test_matcher);
+   RUN(test_inline);
+   RUN(test_merge);
+   RUN(test_sort);
+   RUN(test_bloom);
+   RUN(test_packed);
    RUN(test_remove_1);
    RUN(test_remove_2);
    RUN(test_add_remove_add);
    RUN(test_get);
+   RUN(test_iter);
    RUN(test_reset);
 
    return TEST_REPORT();
@@ -9,12 +9,27 @@
  *  tokenset_add(). Retrieve these tokens integer using tokenset_get_by_id().
  */
 
+#define _POSIX_C_SOURCE 200809L                  /* pthread rwlocks and mkstemp under -ansi */
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "uthash.h"
 #include "tokenset.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef  IS_NULL
 #undef  IS_NULL
 #endif
@@ -25,200 +40,4955 @@
 #endif
 #define FREE(p)      ((NULL == (p)) ? (0) : (free((p)), (p) = NULL))
 
+/*
+ * Tokens shorter than TOKEN_INLINE bytes are kept in the node itself,
+ * in the room the text pointer of a longer one takes, so the common
+ * case needs no second allocation and a key comparison stays within
+ * the node's cache lines. The uthash engine links nodes through hh.
+ * The flat engine needs only the hash and the token's place in
+ * p->order, so its nodes end after the smaller flat member and are
+ * allocated that much shorter. Free arena nodes of either engine are
+ * chained through flat.next. Occurrence counts are kept by id, apart
+ * from the nodes.
+ */
+#define TOKEN_INLINE      16
+
+struct _flat_node {
+   struct _token *next;                          /* free arena nodes */
+   unsigned    hashv;
+   unsigned    order;                            /* index in p->order */
+};
+
 struct _token {
-   char       *text;
+   union {
+      char       *ptr;                           /* len >= TOKEN_INLINE */
+      char        bytes[TOKEN_INLINE];           /* len < TOKEN_INLINE, NUL included */
+   } text;
+   unsigned    len;
    unsigned    id;
-   UT_hash_handle hh;
+   union {
+      UT_hash_handle hh;                         /* the uthash engine */
+      struct _flat_node flat;                    /* TOKENSET_FLAT, and free nodes */
+   } link;                                       /* last: flat nodes end early */
+};
+
+#define TOKEN_IS_INLINE(s) ((s)->len < TOKEN_INLINE)
+#define TOKEN_TEXT(s)     (TOKEN_IS_INLINE(s) ? (s)->text.bytes : (s)->text.ptr)
+#define TOKEN_FLAT_SIZE   (offsetof(struct _token, link) + sizeof(struct _flat_node))
+
+/* A slab of memory handed out by _arena_alloc(); data follows the header */
+struct _chunk {
+   struct _chunk *next;
+   size_t      size;
+   size_t      used;
+};
+
+/*
+ * A node of the TOKENSET_ORDERED B+tree. Leaves hold tokens in order
+ * and are chained; inner nodes hold children with, as key[i], the
+ * least token under child[i]. Either way key[0] is the least token
+ * under the node. Inner nodes are a struct _btree_inner, of which the
+ * struct _btree is the first member.
+ */
+#define BT_MAX            32
+#define BT_MIN            (BT_MAX / 2)
+
+struct _btree {
+   int         leaf;
+   int         n;
+   struct _btree *next;                          /* leaves: the next leaf; spares: the next spare */
+   struct _token *key[BT_MAX + 1];               /* one over, split right after */
+};
+
+struct _btree_inner {
+   struct _btree base;
+   struct _btree *child[BT_MAX + 1];
 };
 
+#define BT_CHILD(t)       (((struct _btree_inner *) (t))->child)
+
 struct tokenset {
    size_t      size;
+   size_t      count;
+   unsigned    flags;
    struct _token *tokens;
+   struct _token **byid;                         /* byid[id] is the token, or NULL */
+   size_t      byid_cap;
+   unsigned   *counts;                           /* TOKENSET_COUNTS: adds, by id */
+   struct _chunk *text_chunks;                   /* TOKENSET_ARENA: token bytes */
+   struct _chunk *node_chunks;                   /* TOKENSET_ARENA: token nodes */
+   struct _token *free_nodes;                    /* TOKENSET_ARENA: linked by link.flat.next */
+   unsigned char *ctrl;                          /* TOKENSET_FLAT: control byte per slot */
+   unsigned   *slots;                            /* TOKENSET_FLAT: token id per slot */
+   size_t      nslots;
+   size_t      nused;                            /* TOKENSET_FLAT: full plus deleted slots */
+   unsigned   *order;                            /* TOKENSET_FLAT: listing order, by id */
+   size_t      norder;
+   size_t      order_cap;
+   unsigned   *free_ids;                         /* TOKENSET_REUSE_IDS: removed ids, a stack */
+   size_t      nfree_ids;
+   size_t      free_ids_cap;
+   struct _btree *tree;                          /* TOKENSET_ORDERED: root */
+   int         tree_depth;                       /* inner levels above the leaves */
+   struct _btree *tree_spare;                    /* inner nodes set aside for splits */
+   int         tree_nspare;
+   struct _btree *tree_spare_leaf;
+   int         sorted;                           /* listing order is lexicographic */
+   size_t      capacity;                         /* from tokenset_reserve() */
+   size_t      expansions;                       /* times the table grew */
+   uint32_t   *bloom;                            /* TOKENSET_BLOOM: BLOOM_WORDS per block */
+   size_t      bloom_blocks;
+   size_t      bloom_keys;                       /* tokens it was sized for */
+   size_t      bloom_stale;                      /* removes since it was built */
 };
 
+#define ARENA_MIN_CHUNK   4096
+#define ARENA_MAX_CHUNK   (16 * 1024 * 1024)
+#define ARENA_ALIGN       sizeof(void *)
+
+#define FLAT_GROUP        16
+#define FLAT_EMPTY        0x80
+#define FLAT_DELETED      0xFE
+#define FLAT_H2(h)        ((unsigned char) ((h) >> 25))
+#define ORDER_GONE        UINT_MAX               /* p->order entry of a removed token */
+#define ITER_TREE         3                      /* tokenset_iter.order walking the B+tree */
+
+#define BLOOM_WORDS       8                      /* 32-byte blocks, one bit set per word */
+#define BLOOM_KEY_BITS    16                     /* filter bits per expected token */
+#define BLOOM_MIN_KEYS    1024
+
+#define BATCH             16                     /* keys in flight in the _batch calls */
+
+#if defined(__GNUC__)
+#define PREFETCH(a)       __builtin_prefetch((a))
+#else
+#define PREFETCH(a)       ((void) (a))
+#endif
+
+/* Make room in the id index for at least need entries */
 static int
-_text_sort(struct _token *a, struct _token *b)
+_byid_reserve(struct tokenset *p, size_t need)
 {
-   return strcmp(a->text, b->text);
+   struct _token **t;
+   size_t      cap = IS_NULL(p->byid) ? 32 : p->byid_cap;
+
+   if (need <= p->byid_cap)
+      return 0;
+
+   while (cap < need)
+      cap *= 2;
+
+   if (p->flags & TOKENSET_COUNTS) {
+      unsigned   *c = (unsigned *) realloc(p->counts, cap * sizeof(unsigned));
+
+      if (IS_NULL(c))
+         return 1;
+      p->counts = c;
+   }
+
+   t = (struct _token **) realloc(p->byid, cap * sizeof(struct _token *));
+   if (IS_NULL(t))
+      return 1;
+
+   memset(t + p->byid_cap, 0, (cap - p->byid_cap) * sizeof(struct _token *));
+   p->byid = t;
+   p->byid_cap = cap;
+
+   return 0;
 }
 
-struct tokenset *
-tokenset_new(void)
+/* Carve n bytes out of the chunk list, starting a new, larger chunk if needed */
+static void *
+_arena_alloc(struct _chunk **head, size_t n, size_t align)
 {
-   struct tokenset *tp;
+   struct _chunk *c = *head;
+   size_t      off;
 
-   tp = (struct tokenset *) malloc(sizeof(struct tokenset));
-   if (IS_NULL(tp))
+   if (!IS_NULL(c)) {
+      off = (c->used + align - 1) & ~(align - 1);
+      if (off + n <= c->size) {
+         c->used = off + n;
+         return (char *) (c + 1) + off;
+      }
+   }
+
+   off = IS_NULL(c) ? ARENA_MIN_CHUNK : 2 * c->size;
+   if (off > ARENA_MAX_CHUNK)
+      off = ARENA_MAX_CHUNK;
+   if (off < n)
+      off = n;
+
+   c = (struct _chunk *) malloc(sizeof(struct _chunk) + off);
+   if (IS_NULL(c))
       return NULL;
 
-   tp->size = 0;
-   tp->tokens = NULL;                            /* required by uthash */
+   c->next = *head;
+   c->size = off;
+   c->used = n;
+   *head = c;
 
-   return tp;
+   return c + 1;
 }
 
-void
-tokenset_free(struct tokenset **pp)
+/* Make sure the current chunk has n more bytes free */
+static int
+_arena_reserve(struct _chunk **head, size_t n)
+{
+   struct _chunk *c = *head;
+
+   if (!IS_NULL(c) && c->size - c->used >= n + ARENA_ALIGN)
+      return 0;
+
+   c = (struct _chunk *) malloc(sizeof(struct _chunk) + n + ARENA_ALIGN);
+   if (IS_NULL(c))
+      return 1;
+
+   c->next = *head;
+   c->size = n + ARENA_ALIGN;
+   c->used = 0;
+   *head = c;
+
+   return 0;
+}
+
+static void
+_arena_free(struct _chunk **head)
+{
+   struct _chunk *c;
+
+   while (!IS_NULL(*head)) {
+      c = *head;
+      *head = c->next;
+      FREE(c);
+   }
+}
+
+/* Bytes held by a chunk list, headers included */
+static size_t
+_arena_bytes(struct _chunk *c)
+{
+   size_t      n = 0;
+
+   for (; !IS_NULL(c); c = c->next)
+      n += sizeof(struct _chunk) + c->size;
+
+   return n;
+}
+
+/* Bytes in one of p's nodes */
+static size_t
+_token_size(const struct tokenset *p)
+{
+   return p->flags & TOKENSET_FLAT ? TOKEN_FLAT_SIZE : sizeof(struct _token);
+}
+
+/* The hash s was linked under in p */
+static unsigned
+_token_hashv(const struct tokenset *p, const struct _token *s)
+{
+   return p->flags & TOKENSET_FLAT ? s->link.flat.hashv : s->link.hh.hashv;
+}
+
+/* Allocate a node with room for a token of len bytes, and set its len */
+static struct _token *
+_token_new(struct tokenset *p, size_t len)
 {
    struct _token *s;
-   struct _token *t;
 
-   if (IS_NULL(*pp))
-      return;
+   if (!(p->flags & TOKENSET_ARENA)) {
+      s = (struct _token *) malloc(_token_size(p));
+      if (IS_NULL(s))
+         return NULL;
+      s->len = (unsigned) len;
+      if (TOKEN_IS_INLINE(s))
+         return s;
+      s->text.ptr = (char *) malloc((1 + len) * sizeof(char));
+      if (IS_NULL(s->text.ptr)) {
+         FREE(s);
+         return NULL;
+      }
+      return s;
+   }
 
-   t = (*pp)->tokens;
+   if (!IS_NULL(p->free_nodes)) {
+      s = p->free_nodes;
+      p->free_nodes = s->link.flat.next;
+   }
+   else {
+      s = (struct _token *) _arena_alloc(&p->node_chunks, _token_size(p), ARENA_ALIGN);
+      if (IS_NULL(s))
+         return NULL;
+   }
 
-   while (!IS_NULL(t)) {
-      s = t;
-      t = s->hh.next;
-      FREE(s->text);
-      HASH_DEL((*pp)->tokens, s);
+   s->len = (unsigned) len;
+   if (TOKEN_IS_INLINE(s))
+      return s;
+
+   /* Token bytes are not reclaimed individually in arena mode */
+   s->text.ptr = (char *) _arena_alloc(&p->text_chunks, 1 + len, 1);
+   if (IS_NULL(s->text.ptr)) {
+      s->link.flat.next = p->free_nodes;
+      p->free_nodes = s;
+      return NULL;
+   }
+
+   return s;
+}
+
+static void
+_token_delete(struct tokenset *p, struct _token *s)
+{
+   if (!(p->flags & TOKENSET_ARENA)) {
+      if (!TOKEN_IS_INLINE(s))
+         FREE(s->text.ptr);
       FREE(s);
+      return;
    }
 
-   FREE(*pp);
-   *pp = NULL;
+   s->link.flat.next = p->free_nodes;
+   p->free_nodes = s;
 }
 
-const char *
-tokenset_version(void)
+/* Occurrences of live token id; 1 each without TOKENSET_COUNTS */
+static unsigned
+_count(const struct tokenset *p, unsigned id)
 {
-   return "1.4.0-dev0";
+   return p->flags & TOKENSET_COUNTS ? p->counts[id] : 1;
 }
 
-int
-tokenset_add(struct tokenset *p, char *n)
+/*
+ * Flat engine (TOKENSET_FLAT). Token ids live in an open-addressing
+ * table split into groups of FLAT_GROUP slots. Each slot has a control
+ * byte that is FLAT_EMPTY, FLAT_DELETED, or the top 7 bits of the hash
+ * of its token, so one probe compares a whole group of control bytes
+ * and only touches tokens whose tag matches. Groups are probed in
+ * triangular order, which visits every group of a power-of-2 table.
+ */
+
+/* Bit i is set when control byte i of the group equals c */
+static unsigned
+_flat_match(const unsigned char *g, unsigned char c)
 {
-   struct _token *s;
+#if defined(__SSE2__)
+   __m128i     v = _mm_loadu_si128((const __m128i *) g);
+
+   return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) c)));
+#else
+   unsigned    m = 0;
+   int         i;
 
-   HASH_FIND_STR(p->tokens, n, s);
+   for (i = 0; i < FLAT_GROUP; i++)
+      if (g[i] == c)
+         m |= 1u << i;
 
-   if (!IS_NULL(s))
-      return s->id;
+   return m;
+#endif
+}
+
+/* Bit i is set when slot i of the group is empty or deleted */
+static unsigned
+_flat_free(const unsigned char *g)
+{
+#if defined(__SSE2__)
+   return (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) g));
+#else
+   unsigned    m = 0;
+   int         i;
 
-   s = (struct _token *) malloc(sizeof(struct _token));
-   s->text = malloc((1 + strlen(n)) * sizeof(char));
-   strcpy(s->text, n);
+   for (i = 0; i < FLAT_GROUP; i++)
+      if (g[i] & 0x80)
+         m |= 1u << i;
 
-   s->id = p->size;
+   return m;
+#endif
+}
 
-#if 0
-   HASH_ADD_STR(p->tokens, text, s);
+static int
+_lowbit(unsigned m)
+{
+#if defined(__GNUC__)
+   return __builtin_ctz(m);
 #else
-   HASH_ADD_KEYPTR(hh, p->tokens, s->text, strlen(s->text), s);
+   int         i = 0;
+
+   while (!(m & 1u)) {
+      m >>= 1;
+      i++;
+   }
+
+   return i;
 #endif
+}
+
+/* Index of the highest bit set in m, which is not 0 */
+static int
+_highbit(unsigned m)
+{
+#if defined(__GNUC__)
+   return 31 - __builtin_clz(m);
+#else
+   int         i = 0;
 
-   p->size += 1;                                 /* ready to map next entry */
+   while (m >>= 1)
+      i++;
 
-   return s->id;
+   return i;
+#endif
 }
 
-int
-tokenset_count(struct tokenset *p)
+static struct _token *
+_flat_find(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   size_t      mask;
+   size_t      g;
+   size_t      step;
+
+   if (0 == p->nslots)
+      return NULL;
+
+   mask = p->nslots / FLAT_GROUP - 1;
+   g = hashv & mask;
+
+   for (step = 1;; step++) {
+      const unsigned char *ctrl = p->ctrl + g * FLAT_GROUP;
+      unsigned    m = _flat_match(ctrl, FLAT_H2(hashv));
+
+      while (m) {
+         struct _token *s = p->byid[p->slots[g * FLAT_GROUP + _lowbit(m)]];
+         if (s->len == len && 0 == memcmp(TOKEN_TEXT(s), n, len))
+            return s;
+         m &= m - 1;
+      }
+
+      if (_flat_match(ctrl, FLAT_EMPTY))
+         return NULL;
+
+      g = (g + step) & mask;
+   }
+}
+
+/* Place id in the first free slot on its probe sequence; no growth */
+static void
+_flat_place(struct tokenset *p, unsigned id, unsigned hashv)
 {
-   return HASH_COUNT(p->tokens);
+   size_t      mask = p->nslots / FLAT_GROUP - 1;
+   size_t      g = hashv & mask;
+   size_t      step;
+   size_t      i;
+
+   for (step = 1;; step++) {
+      unsigned    m = _flat_free(p->ctrl + g * FLAT_GROUP);
+
+      if (m) {
+         i = g * FLAT_GROUP + _lowbit(m);
+         if (FLAT_EMPTY == p->ctrl[i])
+            p->nused += 1;
+         p->ctrl[i] = FLAT_H2(hashv);
+         p->slots[i] = id;
+         return;
+      }
+
+      g = (g + step) & mask;
+   }
 }
 
-int
-tokenset_exists(struct tokenset *p, char *n)
+/* Rebuild the table with nslots slots, dropping deleted markers */
+static int
+_flat_rehash(struct tokenset *p, size_t nslots)
 {
-   struct _token *s;
+   unsigned char *ctrl = (unsigned char *) malloc(nslots);
+   unsigned   *slots = (unsigned *) malloc(nslots * sizeof(unsigned));
+   size_t      i;
 
-   HASH_FIND_STR(p->tokens, n, s);
+   if (IS_NULL(ctrl) || IS_NULL(slots)) {
+      FREE(ctrl);
+      FREE(slots);
+      return 1;
+   }
+
+   memset(ctrl, FLAT_EMPTY, nslots);
+   if (nslots > p->nslots && p->nslots > 0)
+      p->expansions++;
+   FREE(p->ctrl);
+   FREE(p->slots);
+   p->ctrl = ctrl;
+   p->slots = slots;
+   p->nslots = nslots;
+   p->nused = 0;
 
-   return IS_NULL(s) ? 0 : 1;
+   for (i = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i]))
+         _flat_place(p, (unsigned) i, p->byid[i]->link.flat.hashv);
+
+   return 0;
 }
 
-char      **
-tokenset_get(struct tokenset *p)
+static int
+_flat_insert(struct tokenset *p, unsigned id, unsigned hashv)
 {
-   struct _token *s = p->tokens;
-   int         last = tokenset_count(p);
-   char      **list = (char **) calloc(1 + last, sizeof(char *));
-   int         i;
+   /* Keep full plus deleted slots at or under 7/8 of the table */
+   if ((p->nused + 1) * 8 > p->nslots * 7) {
+      size_t      nslots = p->nslots < FLAT_GROUP ? FLAT_GROUP : p->nslots;
 
-   for (i = 0; i < last; i++) {
-      list[i] = (char *) calloc(1 + strlen(s->text), sizeof(char));
-      strcpy(list[i], s->text);
-      /* printf("REPORT: %s\n", list[i]); */
-      s = s->hh.next;
+      if ((p->count + 1) * 16 > nslots * 7)
+         nslots *= 2;
+      if (_flat_rehash(p, nslots))
+         return 1;
    }
 
-   list[last] = NULL;
+   _flat_place(p, id, hashv);
 
-   return list;
+   return 0;
 }
 
-const char *
-tokenset_get_by_id(struct tokenset *p, unsigned id)
+static void
+_flat_erase(struct tokenset *p, struct _token *s)
 {
+   size_t      mask = p->nslots / FLAT_GROUP - 1;
+   size_t      g = s->link.flat.hashv & mask;
+   size_t      step;
 
-   struct _token *s;
-   struct _token *t = p->tokens;
+   for (step = 1;; step++) {
+      unsigned char *ctrl = p->ctrl + g * FLAT_GROUP;
+      unsigned    m = _flat_match(ctrl, FLAT_H2(s->link.flat.hashv));
 
-   while (!IS_NULL(t)) {
+      while (m) {
+         int         i = _lowbit(m);
+         if (p->slots[g * FLAT_GROUP + i] == s->id) {
+            /* A group that still has an empty slot never overflowed */
+            if (_flat_match(ctrl, FLAT_EMPTY)) {
+               ctrl[i] = FLAT_EMPTY;
+               p->nused -= 1;
+            }
+            else
+               ctrl[i] = FLAT_DELETED;
+            return;
+         }
+         m &= m - 1;
+      }
 
-      s = t;
-      t = s->hh.next;
+      g = (g + step) & mask;
+   }
+}
 
-      if (s->id == id)
-         return (const char *) s->text;
+static int
+_order_reserve(struct tokenset *p, size_t cap)
+{
+   unsigned   *t;
+
+   if (cap <= p->order_cap)
+      return 0;
+
+   t = (unsigned *) realloc(p->order, cap * sizeof(unsigned));
+   if (IS_NULL(t))
+      return 1;
+   p->order = t;
+   p->order_cap = cap;
+
+   return 0;
+}
+
+/* Squeeze removed tokens out of the listing order */
+static void
+_order_squeeze(struct tokenset *p)
+{
+   size_t      i, j;
+
+   for (i = j = 0; i < p->norder; i++)
+      if (ORDER_GONE != p->order[i]) {
+         p->byid[p->order[i]]->link.flat.order = (unsigned) j;
+         p->order[j++] = p->order[i];
+      }
+   p->norder = j;
+}
+
+/* Append s to the listing order, squeezing out removed tokens when full */
+static int
+_order_append(struct tokenset *p, struct _token *s)
+{
+   if (p->norder == p->order_cap) {
+      _order_squeeze(p);
+
+      if (2 * p->norder > p->order_cap || 0 == p->order_cap) {
+         size_t      cap = 0 == p->order_cap ? 32 : 2 * p->order_cap;
+         unsigned   *t = (unsigned *) realloc(p->order, cap * sizeof(unsigned));
+
+         if (IS_NULL(t))
+            return 1;
+         p->order = t;
+         p->order_cap = cap;
+      }
    }
 
-   return NULL;
+   s->link.flat.order = (unsigned) p->norder;
+   p->order[p->norder++] = s->id;
+
+   return 0;
 }
 
-int
-tokenset_id(struct tokenset *p, char *n)
+/* Compare token s with the len bytes at k: byte-wise, a proper prefix first, as with strcmp() */
+static int
+_bt_cmp(const struct _token *s, const char *k, size_t len)
 {
-   struct _token *s;
+   int         c = memcmp(TOKEN_TEXT(s), k, s->len < len ? s->len : len);
 
-   HASH_FIND_STR(p->tokens, n, s);
+   if (c != 0)
+      return c;
 
-   return IS_NULL(s) ? -1 : (int) s->id;
+   return s->len < len ? -1 : s->len > len ? 1 : 0;
+}
 
-#if 0
-   return IS_NULL(s) ? 0 : 1;
-#endif
+/* Index of the first key of leaf t not below k */
+static int
+_bt_lower(const struct _btree *t, const char *k, size_t len)
+{
+   int         lo = 0, hi = t->n;
+
+   while (lo < hi) {
+      int         mid = (lo + hi) / 2;
+
+      if (_bt_cmp(t->key[mid], k, len) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
 }
 
-void
-tokenset_remove(struct tokenset *p, char *n)
+/* Index of the child of inner node t whose range holds k */
+static int
+_bt_child(const struct _btree *t, const char *k, size_t len)
 {
-   struct _token *s;
+   int         i = _bt_lower(t, k, len);
 
-   HASH_FIND_STR(p->tokens, n, s);
+   /* key[i] may be k itself; otherwise k belongs under the child before */
+   if (i < t->n && 0 == _bt_cmp(t->key[i], k, len))
+      return i;
 
-   if (IS_NULL(s))
+   return i > 0 ? i - 1 : 0;
+}
+
+static struct _btree *
+_bt_alloc(int leaf)
+{
+   struct _btree *t = (struct _btree *) malloc(leaf ? sizeof(struct _btree)
+                                               : sizeof(struct _btree_inner));
+
+   if (!IS_NULL(t)) {
+      t->leaf = leaf;
+      t->n = 0;
+      t->next = NULL;
+   }
+
+   return t;
+}
+
+static void
+_bt_free(struct _btree *t)
+{
+   int         i;
+
+   if (IS_NULL(t))
       return;
+   if (!t->leaf)
+      for (i = 0; i < t->n; i++)
+         _bt_free(BT_CHILD(t)[i]);
+   free(t);
+}
+
+static size_t
+_bt_bytes(struct _btree *t)
+{
+   size_t      n;
+   int         i;
 
-   FREE(s->text);
-   HASH_DEL(p->tokens, s);
+   if (IS_NULL(t))
+      return 0;
+   if (t->leaf)
+      return sizeof(struct _btree);
+   n = sizeof(struct _btree_inner);
+   for (i = 0; i < t->n; i++)
+      n += _bt_bytes(BT_CHILD(t)[i]);
 
-   FREE(s);
+   return n;
 }
 
-void
-tokenset_reset(struct tokenset *p)
+/* Set aside every node an insert could need, so it cannot fail halfway */
+static int
+_bt_reserve(struct tokenset *p)
 {
-   struct _token *s;
-   struct _token *t = p->tokens;
+   if (IS_NULL(p->tree) && IS_NULL(p->tree = _bt_alloc(1)))
+      return 1;
+   if (IS_NULL(p->tree_spare_leaf) && IS_NULL(p->tree_spare_leaf = _bt_alloc(1)))
+      return 1;
 
-   while (!IS_NULL(t)) {
-      s = t;
-      t = s->hh.next;
-      FREE(s->text);
-      HASH_DEL(p->tokens, s);
-      FREE(s);
+   while (p->tree_nspare < p->tree_depth + 1) {
+      struct _btree *t = _bt_alloc(0);
+
+      if (IS_NULL(t))
+         return 1;
+      t->next = p->tree_spare;
+      p->tree_spare = t;
+      p->tree_nspare += 1;
    }
 
-   p->size = 0;
+   return 0;
 }
 
-void
-tokenset_sort(struct tokenset *p)
+static struct _btree *
+_bt_spare(struct tokenset *p, int leaf)
+{
+   struct _btree *t;
+
+   if (leaf) {
+      t = p->tree_spare_leaf;
+      p->tree_spare_leaf = NULL;
+   }
+   else {
+      t = p->tree_spare;
+      p->tree_spare = t->next;
+      p->tree_nspare -= 1;
+   }
+   t->leaf = leaf;
+   t->next = NULL;
+
+   return t;
+}
+
+/* Insert s under t; returns the new right half if t split */
+static struct _btree *
+_bt_ins(struct tokenset *p, struct _btree *t, struct _token *s)
+{
+   struct _btree *r;
+   int         i, h;
+
+   if (t->leaf) {
+      i = _bt_lower(t, TOKEN_TEXT(s), s->len);
+      memmove(t->key + i + 1, t->key + i, (t->n - i) * sizeof(struct _token *));
+      t->key[i] = s;
+      t->n += 1;
+   }
+   else {
+      i = _bt_child(t, TOKEN_TEXT(s), s->len);
+      r = _bt_ins(p, BT_CHILD(t)[i], s);
+      t->key[i] = BT_CHILD(t)[i]->key[0];
+      if (IS_NULL(r))
+         return NULL;
+      i += 1;
+      memmove(t->key + i + 1, t->key + i, (t->n - i) * sizeof(struct _token *));
+      memmove(BT_CHILD(t) + i + 1, BT_CHILD(t) + i, (t->n - i) * sizeof(struct _btree *));
+      t->key[i] = r->key[0];
+      BT_CHILD(t)[i] = r;
+      t->n += 1;
+   }
+
+   if (t->n <= BT_MAX)
+      return NULL;
+
+   r = _bt_spare(p, t->leaf);
+   h = t->n / 2;
+   r->n = t->n - h;
+   memcpy(r->key, t->key + h, r->n * sizeof(struct _token *));
+   if (t->leaf) {
+      r->next = t->next;
+      t->next = r;
+   }
+   else
+      memcpy(BT_CHILD(r), BT_CHILD(t) + h, r->n * sizeof(struct _btree *));
+   t->n = h;
+
+   return r;
+}
+
+static int
+_bt_insert(struct tokenset *p, struct _token *s)
+{
+   struct _btree *r;
+
+   if (_bt_reserve(p))
+      return 1;
+
+   r = _bt_ins(p, p->tree, s);
+   if (!IS_NULL(r)) {
+      struct _btree *root = _bt_spare(p, 0);
+
+      root->n = 2;
+      root->key[0] = p->tree->key[0];
+      BT_CHILD(root)[0] = p->tree;
+      root->key[1] = r->key[0];
+      BT_CHILD(root)[1] = r;
+      p->tree = root;
+      p->tree_depth += 1;
+   }
+
+   return 0;
+}
+
+/* Child i of inner node t is under-full; merge it with a sibling or borrow from one */
+static void
+_bt_fix(struct _btree *t, int i)
 {
-   HASH_SORT(p->tokens, _text_sort);
+   int         li = i + 1 < t->n ? i : i - 1;
+   struct _btree *l = BT_CHILD(t)[li];
+   struct _btree *r = BT_CHILD(t)[li + 1];
+
+   if (l->n + r->n <= BT_MAX) {
+      memcpy(l->key + l->n, r->key, r->n * sizeof(struct _token *));
+      if (l->leaf)
+         l->next = r->next;
+      else
+         memcpy(BT_CHILD(l) + l->n, BT_CHILD(r), r->n * sizeof(struct _btree *));
+      l->n += r->n;
+      free(r);
+      memmove(t->key + li + 1, t->key + li + 2, (t->n - li - 2) * sizeof(struct _token *));
+      memmove(BT_CHILD(t) + li + 1, BT_CHILD(t) + li + 2,
+              (t->n - li - 2) * sizeof(struct _btree *));
+      t->n -= 1;
+   }
+   else if (l->n < r->n) {
+      l->key[l->n] = r->key[0];
+      memmove(r->key, r->key + 1, (r->n - 1) * sizeof(struct _token *));
+      if (!l->leaf) {
+         BT_CHILD(l)[l->n] = BT_CHILD(r)[0];
+         memmove(BT_CHILD(r), BT_CHILD(r) + 1, (r->n - 1) * sizeof(struct _btree *));
+      }
+      l->n += 1;
+      r->n -= 1;
+      t->key[li + 1] = r->key[0];
+   }
+   else {
+      memmove(r->key + 1, r->key, r->n * sizeof(struct _token *));
+      r->key[0] = l->key[l->n - 1];
+      if (!l->leaf) {
+         memmove(BT_CHILD(r) + 1, BT_CHILD(r), r->n * sizeof(struct _btree *));
+         BT_CHILD(r)[0] = BT_CHILD(l)[l->n - 1];
+      }
+      l->n -= 1;
+      r->n += 1;
+      t->key[li + 1] = r->key[0];
+   }
+}
+
+/* Remove s from under t; returns nonzero if t is left under-full */
+static int
+_bt_del(struct _btree *t, struct _token *s)
+{
+   int         i;
+
+   if (t->leaf) {
+      i = _bt_lower(t, TOKEN_TEXT(s), s->len);
+      memmove(t->key + i, t->key + i + 1, (t->n - i - 1) * sizeof(struct _token *));
+      t->n -= 1;
+      return t->n < BT_MIN;
+   }
+
+   i = _bt_child(t, TOKEN_TEXT(s), s->len);
+   if (_bt_del(BT_CHILD(t)[i], s))
+      _bt_fix(t, i);
+   if (i >= t->n)
+      i = t->n - 1;                              /* merged into the child before */
+   t->key[i] = BT_CHILD(t)[i]->key[0];
+
+   return t->n < BT_MIN;
+}
+
+static void
+_bt_erase(struct tokenset *p, struct _token *s)
+{
+   _bt_del(p->tree, s);
+
+   /* An inner root left with one child gives way to it */
+   while (!p->tree->leaf && 1 == p->tree->n) {
+      struct _btree *t = p->tree;
+
+      p->tree = BT_CHILD(t)[0];
+      p->tree_depth -= 1;
+      free(t);
+   }
+}
+
+/* Leaf holding the first token not below k, or the leftmost leaf if k is NULL; sets *pos */
+static struct _btree *
+_bt_seek(struct tokenset *p, const char *k, size_t len, size_t *pos)
+{
+   struct _btree *t = p->tree;
+
+   *pos = 0;
+   if (IS_NULL(t))
+      return NULL;
+
+   while (!t->leaf)
+      t = BT_CHILD(t)[IS_NULL(k) ? 0 : _bt_child(t, k, len)];
+   if (!IS_NULL(k))
+      *pos = (size_t) _bt_lower(t, k, len);
+
+   return t;
+}
+
+/*
+ * Grow a uthash table to at least 2^log2 buckets in one pass, as
+ * HASH_EXPAND_BUCKETS does one doubling at a time.
+ */
+static int
+_ut_resize(UT_hash_table *tbl, unsigned log2)
+{
+   unsigned    n = 1u << log2;
+   UT_hash_bucket *b;
+   unsigned    i;
+
+   if (n <= tbl->num_buckets)
+      return 0;
+
+   b = (UT_hash_bucket *) calloc(n, sizeof(UT_hash_bucket));
+   if (IS_NULL(b))
+      return 1;
+
+   tbl->ideal_chain_maxlen = (tbl->num_items >> log2) + ((tbl->num_items & (n - 1)) ? 1 : 0);
+   tbl->nonideal_items = 0;
+
+   for (i = 0; i < tbl->num_buckets; i++) {
+      UT_hash_handle *hh = tbl->buckets[i].hh_head;
+
+      while (!IS_NULL(hh)) {
+         UT_hash_handle *next = hh->hh_next;
+         UT_hash_bucket *nb = b + (hh->hashv & (n - 1));
+
+         if (++nb->count > tbl->ideal_chain_maxlen) {
+            tbl->nonideal_items++;
+            if (nb->count > nb->expand_mult * tbl->ideal_chain_maxlen)
+               nb->expand_mult++;
+         }
+         hh->hh_prev = NULL;
+         hh->hh_next = nb->hh_head;
+         if (!IS_NULL(nb->hh_head))
+            nb->hh_head->hh_prev = hh;
+         nb->hh_head = hh;
+         hh = next;
+      }
+   }
+
+   free(tbl->buckets);
+   tbl->buckets = b;
+   tbl->num_buckets = n;
+   tbl->log2_num_buckets = log2;
+
+   return 0;
+}
+
+/* Smallest log2 giving at least one uthash bucket per token */
+static unsigned
+_ut_log2(size_t n)
+{
+   unsigned    log2 = HASH_INITIAL_NUM_BUCKETS_LOG2;
+
+   while (((size_t) 1 << log2) < n && log2 < 31)
+      log2++;
+
+   return log2;
+}
+
+/*
+ * Blocked Bloom filter for TOKENSET_BLOOM. A token's hash picks one
+ * 32-byte block and sets one bit in each of its 8 words, the bit
+ * chosen by multiplying a remix of the hash by a per-word odd salt,
+ * as in the split block filters of Impala and Parquet. A test reads
+ * a single cache line, so a miss costs about one load instead of a
+ * bucket walk and a memcmp. At 16 bits per token about 1 in 1000
+ * absent tokens gets through. Removed tokens keep their bits until
+ * the filter is rebuilt, by growth or tokenset_compact().
+ */
+
+static const uint32_t _bloom_salt[BLOOM_WORDS] = {
+   0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+   0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+static uint32_t *
+_bloom_block(const struct tokenset *p, unsigned hashv)
+{
+   return p->bloom + (size_t) (((uint64_t) hashv * p->bloom_blocks) >> 32) * BLOOM_WORDS;
+}
+
+/* murmur3's finalizer, so the bits do not follow the block index */
+static uint32_t
+_bloom_remix(unsigned hashv)
+{
+   uint32_t    h = hashv;
+
+   h ^= h >> 16;
+   h *= 0x85ebca6bu;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35u;
+   h ^= h >> 16;
+
+   return h;
+}
+
+static void
+_bloom_set(struct tokenset *p, unsigned hashv)
+{
+   uint32_t   *b = _bloom_block(p, hashv);
+   uint32_t    h = _bloom_remix(hashv);
+   int         i;
+
+   for (i = 0; i < BLOOM_WORDS; i++)
+      b[i] |= (uint32_t) 1 << ((h * _bloom_salt[i]) >> 27);
+}
+
+/* 0 if hashv is surely absent; 1 if it may be present or there is no filter */
+static int
+_bloom_test(const struct tokenset *p, unsigned hashv)
+{
+   const uint32_t *b;
+   uint32_t    h, miss = 0;
+   int         i;
+
+   if (IS_NULL(p->bloom))
+      return 1;
+
+   b = _bloom_block(p, hashv);
+   h = _bloom_remix(hashv);
+   for (i = 0; i < BLOOM_WORDS; i++)
+      miss |= ~b[i] & ((uint32_t) 1 << ((h * _bloom_salt[i]) >> 27));
+
+   return 0 == miss;
+}
+
+/* Make a filter for n tokens and fill it from the tokens present */
+static int
+_bloom_build(struct tokenset *p, size_t n)
+{
+   size_t      blocks = 1;
+   void       *mem;
+   size_t      i;
+
+   if (n < BLOOM_MIN_KEYS)
+      n = BLOOM_MIN_KEYS;
+   while (blocks * BLOOM_WORDS * 32 < n * BLOOM_KEY_BITS)
+      blocks *= 2;
+
+   if (0 != posix_memalign(&mem, BLOOM_WORDS * sizeof(uint32_t),
+                           blocks * BLOOM_WORDS * sizeof(uint32_t)))
+      return 1;
+
+   FREE(p->bloom);
+   p->bloom = (uint32_t *) mem;
+   p->bloom_blocks = blocks;
+   p->bloom_keys = n;
+   p->bloom_stale = 0;
+   memset(p->bloom, 0, blocks * BLOOM_WORDS * sizeof(uint32_t));
+
+   for (i = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i]))
+         _bloom_set(p, _token_hashv(p, p->byid[i]));
+
+   return 0;
+}
+
+/* Record a new token, doubling the filter once it holds more than it was sized for */
+static void
+_bloom_add(struct tokenset *p, unsigned hashv)
+{
+   /* A filter that cannot grow still answers correctly, only less often "absent" */
+   if ((IS_NULL(p->bloom) || p->count > p->bloom_keys)
+       && 0 == _bloom_build(p, IS_NULL(p->bloom) ? p->capacity : 2 * p->bloom_keys))
+      return;                                    /* the build saw the new token */
+   if (!IS_NULL(p->bloom))
+      _bloom_set(p, hashv);
+}
+
+/*
+ * Engine dispatch. Every public lookup and update goes through these
+ * so that the uthash and flat engines share the rest of the code.
+ */
+
+static struct _token *
+_find(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   struct _token *s;
+
+   if ((p->flags & TOKENSET_BLOOM) && !_bloom_test(p, hashv))
+      return NULL;
+
+   if (p->flags & TOKENSET_FLAT)
+      return _flat_find(p, n, len, hashv);
+
+   HASH_FIND_BYHASHVALUE(link.hh, p->tokens, n, len, hashv, s);
+
+   return s;
+}
+
+/* Index s, whose id, text and len are set; it is not in byid[] yet */
+static int
+_link(struct tokenset *p, struct _token *s, unsigned hashv)
+{
+   unsigned    buckets;
+
+   if (p->flags & TOKENSET_FLAT) {
+      s->link.flat.hashv = hashv;
+      if (_flat_insert(p, s->id, hashv))
+         return 1;
+      if (_order_append(p, s)) {
+         _flat_erase(p, s);
+         return 1;
+      }
+      return 0;
+   }
+
+   buckets = IS_NULL(p->tokens) ? 0 : p->tokens->link.hh.tbl->num_buckets;
+   HASH_ADD_KEYPTR_BYHASHVALUE(link.hh, p->tokens, TOKEN_TEXT(s), s->len, hashv, s);
+   if (buckets > 0 && p->tokens->link.hh.tbl->num_buckets > buckets)
+      p->expansions++;
+
+   /* uthash made a fresh 32-bucket table; size it as reserved */
+   if (p->capacity > 0 && 1 == p->tokens->link.hh.tbl->num_items)
+      _ut_resize(p->tokens->link.hh.tbl, _ut_log2(p->capacity));
+
+   return 0;
+}
+
+/*
+ * Hash functions selectable with the TOKENSET_HASH_* flags. HASH_JEN
+ * is uthash's default and reads a byte at a time. The others read 4 or
+ * 8 bytes at a time; words are assembled little-endian so the values
+ * are the same on every platform.
+ */
+
+#define ROTL32(x, r)      (((x) << (r)) | ((x) >> (32 - (r))))
+
+#define XXH_P1            2654435761u
+#define XXH_P2            2246822519u
+#define XXH_P3            3266489917u
+#define XXH_P4            668265263u
+#define XXH_P5            374761393u
+
+static uint32_t
+_read32(const unsigned char *k)
+{
+   return (uint32_t) k[0] | ((uint32_t) k[1] << 8) | ((uint32_t) k[2] << 16)
+      | ((uint32_t) k[3] << 24);
+}
+
+static uint64_t
+_read64(const unsigned char *k)
+{
+   return (uint64_t) _read32(k) | ((uint64_t) _read32(k + 4) << 32);
+}
+
+/* xxHash32 with seed 0 */
+static unsigned
+_hash_xxh32(const char *key, size_t len)
+{
+   const unsigned char *k = (const unsigned char *) key;
+   const unsigned char *end = k + len;
+   uint32_t    h;
+
+   if (len >= 16) {
+      uint32_t    v1 = XXH_P1 + XXH_P2;
+      uint32_t    v2 = XXH_P2;
+      uint32_t    v3 = 0;
+      uint32_t    v4 = 0 - XXH_P1;
+
+      do {
+         v1 = ROTL32(v1 + _read32(k) * XXH_P2, 13) * XXH_P1;
+         v2 = ROTL32(v2 + _read32(k + 4) * XXH_P2, 13) * XXH_P1;
+         v3 = ROTL32(v3 + _read32(k + 8) * XXH_P2, 13) * XXH_P1;
+         v4 = ROTL32(v4 + _read32(k + 12) * XXH_P2, 13) * XXH_P1;
+         k += 16;
+      } while (k + 16 <= end);
+
+      h = ROTL32(v1, 1) + ROTL32(v2, 7) + ROTL32(v3, 12) + ROTL32(v4, 18);
+   }
+   else
+      h = XXH_P5;
+
+   h += (uint32_t) len;
+
+   for (; k + 4 <= end; k += 4)
+      h = ROTL32(h + _read32(k) * XXH_P3, 17) * XXH_P4;
+
+   for (; k < end; k++)
+      h = ROTL32(h + *k * XXH_P5, 11) * XXH_P1;
+
+   h ^= h >> 15;
+   h *= XXH_P2;
+   h ^= h >> 13;
+   h *= XXH_P3;
+   h ^= h >> 16;
+
+   return h;
+}
+
+/* Fold the 128-bit product of a and b into 64 bits */
+static uint64_t
+_mum(uint64_t a, uint64_t b)
+{
+#if defined(__GNUC__) && defined(__SIZEOF_INT128__)
+   __extension__ typedef unsigned __int128 u128;
+   u128        r = (u128) a * b;
+
+   return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+   uint64_t    ha = a >> 32, hb = b >> 32;
+   uint64_t    la = (uint32_t) a, lb = (uint32_t) b;
+   uint64_t    rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+   uint64_t    t = rl + (rm0 << 32);
+   uint64_t    c = t < rl;
+   uint64_t    lo = t + (rm1 << 32);
+
+   c += lo < t;
+
+   return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+#define WY_S0             ((uint64_t) 0xa0761d64u << 32 | 0x78bd642fu)
+#define WY_S1             ((uint64_t) 0xe7037ed1u << 32 | 0xa0b428dbu)
+#define WY_S2             ((uint64_t) 0x8ebc6af0u << 32 | 0x9c88c6e3u)
+
+/*
+ * 64-bit multiply-and-fold hash in the style of wyhash: 16 bytes per
+ * round, short keys read as overlapping words, no tail loop. Returns
+ * the two halves xored together.
+ */
+static uint64_t
+_hash_wy64(const char *key, size_t len, uint64_t seed)
+{
+   const unsigned char *k = (const unsigned char *) key;
+   uint64_t    a, b;
+
+   seed ^= _mum(seed ^ WY_S0, WY_S1);
+
+   if (len <= 16) {
+      if (len >= 4) {
+         size_t      off = (len >> 3) << 2;
+         a = ((uint64_t) _read32(k) << 32) | _read32(k + off);
+         b = ((uint64_t) _read32(k + len - 4) << 32) | _read32(k + len - 4 - off);
+      }
+      else if (len > 0) {
+         a = ((uint64_t) k[0] << 16) | ((uint64_t) k[len >> 1] << 8) | k[len - 1];
+         b = 0;
+      }
+      else
+         a = b = 0;
+   }
+   else {
+      size_t      i = len;
+
+      while (i > 16) {
+         seed = _mum(_read64(k) ^ WY_S1, _read64(k + 8) ^ seed);
+         k += 16;
+         i -= 16;
+      }
+      a = _read64(k + i - 16);
+      b = _read64(k + i - 8);
+   }
+
+   return _mum(WY_S2 ^ (uint64_t) len, _mum(a ^ WY_S1, b ^ seed));
+}
+
+static unsigned
+_hash_wy(const char *key, size_t len)
+{
+   uint64_t    h = _hash_wy64(key, len, 0);
+
+   return (unsigned) (h ^ (h >> 32));
+}
+
+/* Hash len bytes at n with the function selected by flags */
+static unsigned
+_hash_flags(unsigned flags, const char *n, size_t len)
+{
+   unsigned    hashv;
+
+   switch (flags & TOKENSET_HASH_MASK) {
+      case TOKENSET_HASH_XXH32:
+         return _hash_xxh32(n, len);
+      case TOKENSET_HASH_WY:
+         return _hash_wy(n, len);
+      default:
+         HASH_JEN(n, len, hashv);
+         return hashv;
+   }
+}
+
+#define _hash(p, n, len)  _hash_flags((p)->flags, (n), (len))
+
+/* Little-endian 32-bit word at k, as HASH_JEN reads it */
+#define JEN_WORD(k)       ((unsigned) (k)[0] + ((unsigned) (k)[1] << 8) \
+                           + ((unsigned) (k)[2] << 16) + ((unsigned) (k)[3] << 24))
+
+/* Tail of HASH_JEN: fold the last len % 12 bytes into a, b and c */
+static void
+_jen_tail(const unsigned char *k, size_t rem, unsigned *a, unsigned *b, unsigned *c)
+{
+   switch (rem) {
+      case 11: *c += ((unsigned) k[10] << 24);   /* FALLTHROUGH */
+      case 10: *c += ((unsigned) k[9] << 16);    /* FALLTHROUGH */
+      case 9:  *c += ((unsigned) k[8] << 8);     /* FALLTHROUGH */
+      case 8:  *b += ((unsigned) k[7] << 24);    /* FALLTHROUGH */
+      case 7:  *b += ((unsigned) k[6] << 16);    /* FALLTHROUGH */
+      case 6:  *b += ((unsigned) k[5] << 8);     /* FALLTHROUGH */
+      case 5:  *b += k[4];                       /* FALLTHROUGH */
+      case 4:  *a += ((unsigned) k[3] << 24);    /* FALLTHROUGH */
+      case 3:  *a += ((unsigned) k[2] << 16);    /* FALLTHROUGH */
+      case 2:  *a += ((unsigned) k[1] << 8);     /* FALLTHROUGH */
+      case 1:  *a += k[0];
+   }
+}
+
+#if defined(__SSE2__)
+#define JEN_MIX4(a, b, c, s1, s2, s3)                                     \
+do {                                                                      \
+   a = _mm_sub_epi32(_mm_sub_epi32(a, b), c);                             \
+   a = _mm_xor_si128(a, _mm_srli_epi32(c, s1));                           \
+   b = _mm_sub_epi32(_mm_sub_epi32(b, c), a);                             \
+   b = _mm_xor_si128(b, _mm_slli_epi32(a, s2));                           \
+   c = _mm_sub_epi32(_mm_sub_epi32(c, a), b);                             \
+   c = _mm_xor_si128(c, _mm_srli_epi32(b, s3));                           \
+} while (0)
+
+#define BLEND4(mask, x, y) \
+   _mm_or_si128(_mm_and_si128((mask), (x)), _mm_andnot_si128((mask), (y)))
+
+/*
+ * HASH_JEN over four keys at once, one per 32-bit SSE2 lane. Each
+ * 12-byte round is mixed in all lanes; lanes whose key has run out of
+ * full rounds keep their previous state. Gives the same values as
+ * HASH_JEN.
+ */
+static void
+_jen_hash4(const char **keys, const size_t *len, unsigned *hashv)
+{
+   unsigned    wa[4], wb[4], wc[4], on[4];
+   __m128i     a, b, c, na, nb, nc, mask;
+   size_t      r, rounds = 0;
+   int         i;
+
+   for (i = 0; i < 4; i++)
+      if (len[i] / 12 > rounds)
+         rounds = len[i] / 12;
+
+   a = b = _mm_set1_epi32((int) 0x9e3779b9u);
+   c = _mm_set1_epi32((int) 0xfeedbeefu);
+
+   for (r = 0; r < rounds; r++) {
+      for (i = 0; i < 4; i++) {
+         const unsigned char *k = (const unsigned char *) keys[i] + 12 * r;
+         on[i] = r < len[i] / 12 ? ~0u : 0u;
+         wa[i] = on[i] ? JEN_WORD(k) : 0;
+         wb[i] = on[i] ? JEN_WORD(k + 4) : 0;
+         wc[i] = on[i] ? JEN_WORD(k + 8) : 0;
+      }
+      na = _mm_add_epi32(a, _mm_loadu_si128((const __m128i *) wa));
+      nb = _mm_add_epi32(b, _mm_loadu_si128((const __m128i *) wb));
+      nc = _mm_add_epi32(c, _mm_loadu_si128((const __m128i *) wc));
+      JEN_MIX4(na, nb, nc, 13, 8, 13);
+      JEN_MIX4(na, nb, nc, 12, 16, 5);
+      JEN_MIX4(na, nb, nc, 3, 10, 15);
+      mask = _mm_loadu_si128((const __m128i *) on);
+      a = BLEND4(mask, na, a);
+      b = BLEND4(mask, nb, b);
+      c = BLEND4(mask, nc, c);
+   }
+
+   for (i = 0; i < 4; i++) {
+      wa[i] = wb[i] = 0;
+      wc[i] = (unsigned) len[i];
+      _jen_tail((const unsigned char *) keys[i] + 12 * (len[i] / 12), len[i] % 12,
+                wa + i, wb + i, wc + i);
+   }
+   a = _mm_add_epi32(a, _mm_loadu_si128((const __m128i *) wa));
+   b = _mm_add_epi32(b, _mm_loadu_si128((const __m128i *) wb));
+   c = _mm_add_epi32(c, _mm_loadu_si128((const __m128i *) wc));
+   JEN_MIX4(a, b, c, 13, 8, 13);
+   JEN_MIX4(a, b, c, 12, 16, 5);
+   JEN_MIX4(a, b, c, 3, 10, 15);
+
+   _mm_storeu_si128((__m128i *) hashv, c);
+}
+#endif
+
+/* Lengths and hashes of m <= BATCH keys; lens NULL means NUL-terminated */
+static void
+_hash_block(struct tokenset *p, const char **keys, const size_t *lens, size_t m,
+            size_t *len, unsigned *hashv)
+{
+   size_t      j;
+
+   for (j = 0; j < m; j++)
+      len[j] = IS_NULL(lens) ? strlen(keys[j]) : lens[j];
+
+   j = 0;
+#if defined(__SSE2__)
+   if (TOKENSET_HASH_JEN == (p->flags & TOKENSET_HASH_MASK))
+      for (; j + 4 <= m; j += 4)
+         _jen_hash4(keys + j, len + j, hashv + j);
+#endif
+   for (; j < m; j++)
+      hashv[j] = _hash(p, keys[j], len[j]);
+}
+
+/* Start pulling in the first cache lines a lookup of hashv will touch */
+static void
+_prefetch(struct tokenset *p, unsigned hashv)
+{
+   if (!IS_NULL(p->bloom))
+      PREFETCH(_bloom_block(p, hashv));
+
+   if (p->flags & TOKENSET_FLAT) {
+      size_t      g;
+
+      if (0 == p->nslots)
+         return;
+      g = hashv & (p->nslots / FLAT_GROUP - 1);
+      PREFETCH(p->ctrl + g * FLAT_GROUP);
+      PREFETCH(p->slots + g * FLAT_GROUP);
+   }
+   else if (!IS_NULL(p->tokens)) {
+      UT_hash_table *tbl = p->tokens->link.hh.tbl;
+      PREFETCH(tbl->buckets + (hashv & (tbl->num_buckets - 1)));
+   }
+}
+
+/* Second stage of _prefetch(): the first candidate, once its slot is in */
+static void
+_prefetch_candidate(struct tokenset *p, unsigned hashv)
+{
+   if (p->flags & TOKENSET_FLAT) {
+      size_t      g;
+      unsigned    m;
+
+      if (0 == p->nslots)
+         return;
+      g = hashv & (p->nslots / FLAT_GROUP - 1);
+      m = _flat_match(p->ctrl + g * FLAT_GROUP, FLAT_H2(hashv));
+      if (m)
+         PREFETCH(p->byid + p->slots[g * FLAT_GROUP + _lowbit(m)]);
+   }
+   else if (!IS_NULL(p->tokens)) {
+      UT_hash_table *tbl = p->tokens->link.hh.tbl;
+      UT_hash_handle *hh = tbl->buckets[hashv & (tbl->num_buckets - 1)].hh_head;
+      if (!IS_NULL(hh))
+         PREFETCH(hh);
+   }
+}
+
+static void
+_unlink(struct tokenset *p, struct _token *s)
+{
+   if (p->flags & TOKENSET_FLAT) {
+      p->order[s->link.flat.order] = ORDER_GONE;       /* so a reused id is not listed twice */
+      _flat_erase(p, s);
+   }
+   else
+      HASH_DELETE(link.hh, p->tokens, s);
+}
+
+/* Drop s from p altogether */
+static void
+_remove(struct tokenset *p, struct _token *s)
+{
+   if (p->flags & TOKENSET_ORDERED)
+      _bt_erase(p, s);
+   _unlink(p, s);
+   p->byid[s->id] = NULL;
+   p->count -= 1;
+   p->bloom_stale += 1;
+
+   if (p->flags & TOKENSET_REUSE_IDS) {
+      /* Out of memory only means the id is not reused */
+      if (p->nfree_ids == p->free_ids_cap) {
+         size_t      cap = 0 == p->free_ids_cap ? 32 : 2 * p->free_ids_cap;
+         unsigned   *t = (unsigned *) realloc(p->free_ids, cap * sizeof(unsigned));
+
+         if (!IS_NULL(t)) {
+            p->free_ids = t;
+            p->free_ids_cap = cap;
+         }
+      }
+      if (p->nfree_ids < p->free_ids_cap)
+         p->free_ids[p->nfree_ids++] = s->id;
+   }
+
+   _token_delete(p, s);
+}
+
+/* Add the len bytes at n, whose hash is hashv, knowing they are not present */
+static int
+_insert(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   struct _token *s;
+
+   /* Lengths are kept in 32 bits, as uthash keeps them */
+   if (len > UINT_MAX)
+      return -1;
+
+   if (0 == p->nfree_ids && _byid_reserve(p, p->size + 1))
+      return -1;
+
+   s = _token_new(p, len);
+   if (IS_NULL(s))
+      return -1;
+
+   memcpy(TOKEN_TEXT(s), n, len);
+   TOKEN_TEXT(s)[len] = '\0';                    /* keep get_by_id C-friendly */
+
+   s->id = p->nfree_ids > 0 ? p->free_ids[p->nfree_ids - 1] : p->size;
+
+   if (_link(p, s, hashv)) {
+      _token_delete(p, s);
+      return -1;
+   }
+
+   if ((p->flags & TOKENSET_ORDERED) && _bt_insert(p, s)) {
+      _unlink(p, s);
+      _token_delete(p, s);
+      return -1;
+   }
+
+   if (s->id == p->size)
+      p->size += 1;                              /* ready to map next entry */
+   else
+      p->nfree_ids -= 1;
+   p->byid[s->id] = s;
+   if (p->flags & TOKENSET_COUNTS)
+      p->counts[s->id] = 1;
+   p->count += 1;
+   p->sorted = 0;
+
+   if (p->flags & TOKENSET_BLOOM)
+      _bloom_add(p, hashv);
+
+   return s->id;
+}
+
+/* Add the len bytes at n, whose hash is hashv, unless already present */
+static int
+_add(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   struct _token *s = _find(p, n, len, hashv);
+
+   if (!IS_NULL(s)) {
+      if ((p->flags & TOKENSET_COUNTS) && p->counts[s->id] < UINT_MAX)
+         p->counts[s->id] += 1;
+      return s->id;
+   }
+
+   return _insert(p, n, len, hashv);
+}
+
+/* Drop every token and the hash table, leaving an empty tokenset */
+static void
+_clear(struct tokenset *p)
+{
+   struct _token *s;
+   struct _token *t = p->tokens;
+
+   if (p->flags & TOKENSET_ARENA) {
+      HASH_CLEAR(link.hh, p->tokens);
+      _arena_free(&p->text_chunks);
+      _arena_free(&p->node_chunks);
+      p->free_nodes = NULL;
+      t = NULL;
+   }
+   else if (p->flags & TOKENSET_FLAT) {
+      size_t      i;
+
+      for (i = 0; i < p->size; i++)
+         if (!IS_NULL(p->byid[i]))
+            _token_delete(p, p->byid[i]);
+   }
+
+   while (!IS_NULL(t)) {
+      s = t;
+      t = s->link.hh.next;
+      HASH_DELETE(link.hh, p->tokens, s);
+      _token_delete(p, s);
+   }
+
+   _bt_free(p->tree);
+   p->tree = NULL;
+   p->tree_depth = 0;
+
+   if (!IS_NULL(p->ctrl))
+      memset(p->ctrl, FLAT_EMPTY, p->nslots);
+
+   if (!IS_NULL(p->byid))
+      memset(p->byid, 0, p->size * sizeof(struct _token *));
+
+   if (!IS_NULL(p->bloom))
+      memset(p->bloom, 0, p->bloom_blocks * BLOOM_WORDS * sizeof(uint32_t));
+   p->bloom_stale = 0;
+
+   p->nused = 0;
+   p->norder = 0;
+   p->nfree_ids = 0;
+   p->sorted = 0;
+   p->count = 0;
+   p->size = 0;
+}
+
+struct tokenset *
+tokenset_new(void)
+{
+   return tokenset_new_with_flags(0);
+}
+
+struct tokenset *
+tokenset_new_with_capacity(size_t n)
+{
+   struct tokenset *tp = tokenset_new_with_flags(0);
+
+   if (!IS_NULL(tp) && tokenset_reserve(tp, n))
+      tokenset_free(&tp);
+
+   return tp;
+}
+
+struct tokenset *
+tokenset_new_with_flags(unsigned flags)
+{
+   struct tokenset *tp;
+
+   tp = (struct tokenset *) malloc(sizeof(struct tokenset));
+   if (IS_NULL(tp))
+      return NULL;
+
+   tp->size = 0;
+   tp->count = 0;
+   tp->flags = flags;
+   tp->tokens = NULL;                            /* required by uthash */
+   tp->byid = NULL;
+   tp->byid_cap = 0;
+   tp->counts = NULL;
+   tp->text_chunks = NULL;
+   tp->node_chunks = NULL;
+   tp->free_nodes = NULL;
+   tp->ctrl = NULL;
+   tp->slots = NULL;
+   tp->nslots = 0;
+   tp->nused = 0;
+   tp->order = NULL;
+   tp->norder = 0;
+   tp->order_cap = 0;
+   tp->free_ids = NULL;
+   tp->nfree_ids = 0;
+   tp->free_ids_cap = 0;
+   tp->tree = NULL;
+   tp->tree_depth = 0;
+   tp->tree_spare = NULL;
+   tp->tree_nspare = 0;
+   tp->tree_spare_leaf = NULL;
+   tp->sorted = 0;
+   tp->capacity = 0;
+   tp->expansions = 0;
+   tp->bloom = NULL;
+   tp->bloom_blocks = 0;
+   tp->bloom_keys = 0;
+   tp->bloom_stale = 0;
+
+   return tp;
+}
+
+void
+tokenset_free(struct tokenset **pp)
+{
+   if (IS_NULL(*pp))
+      return;
+
+   _clear(*pp);
+
+   while (!IS_NULL((*pp)->tree_spare)) {
+      struct _btree *t = (*pp)->tree_spare;
+
+      (*pp)->tree_spare = t->next;
+      free(t);
+   }
+   FREE((*pp)->tree_spare_leaf);
+
+   FREE((*pp)->ctrl);
+   FREE((*pp)->slots);
+   FREE((*pp)->order);
+   FREE((*pp)->free_ids);
+   FREE((*pp)->bloom);
+   FREE((*pp)->byid);
+   FREE((*pp)->counts);
+   FREE(*pp);
+   *pp = NULL;
+}
+
+int
+tokenset_reserve(struct tokenset *p, size_t n)
+{
+   size_t      more = n > p->count ? n - p->count : 0;
+
+   if (n > p->capacity)
+      p->capacity = n;
+
+   if (_byid_reserve(p, p->size + more))
+      return 1;
+
+   if (p->flags & TOKENSET_FLAT) {
+      size_t      nslots = FLAT_GROUP;
+
+      while (nslots / 8 * 7 < n)
+         nslots *= 2;
+      if (nslots > p->nslots && _flat_rehash(p, nslots))
+         return 1;
+      if (_order_reserve(p, p->norder + more))
+         return 1;
+   }
+   else if (!IS_NULL(p->tokens)) {
+      unsigned    buckets = p->tokens->link.hh.tbl->num_buckets;
+
+      if (_ut_resize(p->tokens->link.hh.tbl, _ut_log2(n)))
+         return 1;
+      if (p->tokens->link.hh.tbl->num_buckets > buckets)
+         p->expansions++;
+   }
+
+   if ((p->flags & TOKENSET_BLOOM) && n > p->bloom_keys && _bloom_build(p, n))
+      return 1;
+
+   /* Only tokens of TOKEN_INLINE bytes or more take arena text, so reserve none */
+   if ((p->flags & TOKENSET_ARENA) && more > 0
+       && _arena_reserve(&p->node_chunks, more * _token_size(p)))
+      return 1;
+
+   return 0;
+}
+
+int
+tokenset_bloom(struct tokenset *p, size_t n)
+{
+   if (0 == n) {
+      p->flags &= ~TOKENSET_BLOOM;
+      FREE(p->bloom);
+      p->bloom_blocks = 0;
+      p->bloom_keys = 0;
+      return 0;
+   }
+
+   if (n < p->count)
+      n = p->count;
+   if (_bloom_build(p, n))
+      return 1;
+   p->flags |= TOKENSET_BLOOM;
+
+   return 0;
+}
+
+const char *
+tokenset_version(void)
+{
+   return "1.4.0-dev0";
+}
+
+int
+tokenset_add(struct tokenset *p, char *n)
+{
+   return tokenset_add_n(p, n, strlen(n));
+}
+
+int
+tokenset_add_n(struct tokenset *p, const char *n, size_t len)
+{
+   unsigned    hashv;
+
+   hashv = _hash(p, n, len);
+
+   return _add(p, n, len, hashv);
+}
+
+int
+tokenset_add_hashed(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   return _add(p, n, len, hashv);
+}
+
+int
+tokenset_add_batch(struct tokenset *p, const char **keys, const size_t *lens, size_t n,
+                   int *ids_out)
+{
+   unsigned    hashv[BATCH];
+   size_t      len[BATCH];
+   size_t      i, j, m;
+   int         added = 0;
+   int         failed = 0;
+
+   for (i = 0; i < n; i += m) {
+      m = n - i < BATCH ? n - i : BATCH;
+
+      /* Hash the whole block first so the bucket loads overlap */
+      _hash_block(p, keys + i, IS_NULL(lens) ? NULL : lens + i, m, len, hashv);
+      for (j = 0; j < m; j++)
+         _prefetch(p, hashv[j]);
+
+      for (j = 0; j < m; j++)
+         _prefetch_candidate(p, hashv[j]);
+
+      for (j = 0; j < m; j++) {
+         size_t      before = p->count;
+         int         id = _add(p, keys[i + j], len[j], hashv[j]);
+
+         if (id < 0)
+            failed = 1;
+         else if (p->count != before)
+            added += 1;
+         if (!IS_NULL(ids_out))
+            ids_out[i + j] = id;
+      }
+   }
+
+   return failed ? -1 : added;
+}
+
+/* Shared body of tokenset_id_batch() and tokenset_exists_batch() */
+static size_t
+_lookup_batch(struct tokenset *p, const char **keys, const size_t *lens, size_t n,
+              int *out, int ids)
+{
+   unsigned    hashv[BATCH];
+   size_t      len[BATCH];
+   size_t      i, j, m;
+   size_t      found = 0;
+
+   for (i = 0; i < n; i += m) {
+      m = n - i < BATCH ? n - i : BATCH;
+
+      _hash_block(p, keys + i, IS_NULL(lens) ? NULL : lens + i, m, len, hashv);
+      for (j = 0; j < m; j++)
+         _prefetch(p, hashv[j]);
+      for (j = 0; j < m; j++)
+         _prefetch_candidate(p, hashv[j]);
+
+      for (j = 0; j < m; j++) {
+         struct _token *s = _find(p, keys[i + j], len[j], hashv[j]);
+
+         if (!IS_NULL(s))
+            found += 1;
+         if (ids)
+            out[i + j] = IS_NULL(s) ? -1 : (int) s->id;
+         else
+            out[i + j] = IS_NULL(s) ? 0 : 1;
+      }
+   }
+
+   return found;
+}
+
+size_t
+tokenset_id_batch(struct tokenset *p, const char **keys, const size_t *lens, size_t n,
+                  int *ids_out)
+{
+   return _lookup_batch(p, keys, lens, n, ids_out, 1);
+}
+
+size_t
+tokenset_exists_batch(struct tokenset *p, const char **keys, const size_t *lens, size_t n,
+                      int *out)
+{
+   return _lookup_batch(p, keys, lens, n, out, 0);
+}
+
+/*
+ * Ingestion. The delimiter set is kept as a byte table and, for SSE2,
+ * as at most DELIM_RANGES runs of consecutive byte values; a 16-byte
+ * block is classified with three instructions per run, so whitespace
+ * (two runs) or whitespace plus ASCII punctuation (five) scan a block
+ * at a time. Tokens are handed to tokenset_add_batch() as pointers
+ * into the input.
+ */
+
+#define DELIM_RANGES      16
+#define INGEST_BUFFER     (1 << 20)              /* bytes read at a time by tokenset_ingest_fd() */
+
+struct _delims {
+   unsigned char is[256];
+   int         nranges;                          /* -1 if too many runs to vectorize */
+#if defined(__SSE2__)
+   __m128i     lo[DELIM_RANGES];
+   __m128i     width[DELIM_RANGES];              /* hi - lo */
+#endif
+};
+
+static void
+_delims_init(struct _delims *d, const char *delims)
+{
+   const unsigned char *c;
+   int         i, j;
+
+   memset(d->is, 0, sizeof(d->is));
+   for (c = (const unsigned char *) (IS_NULL(delims) ? TOKENSET_DELIMS_SPACE : delims); *c; c++)
+      d->is[*c] = 1;
+
+   d->nranges = 0;
+   for (i = 0; i < 256; i = j) {
+      for (j = i + 1; j < 256 && d->is[j] == d->is[i]; j++)
+         ;
+      if (!d->is[i])
+         continue;
+      if (DELIM_RANGES == d->nranges) {
+         d->nranges = -1;
+         break;
+      }
+#if defined(__SSE2__)
+      d->lo[d->nranges] = _mm_set1_epi8((char) i);
+      d->width[d->nranges] = _mm_set1_epi8((char) (j - 1 - i));
+#endif
+      d->nranges += 1;
+   }
+}
+
+/* Index of the first byte at or after pos that is (stop = 1) or is not (stop = 0) a delimiter */
+static size_t
+_delims_scan(const struct _delims *d, const unsigned char *s, size_t pos, size_t len, int stop)
+{
+#if defined(__SSE2__)
+   if (d->nranges >= 0) {
+      while (pos + 16 <= len) {
+         __m128i     x = _mm_loadu_si128((const __m128i *) (s + pos));
+         __m128i     in = _mm_setzero_si128();
+         unsigned    m;
+         int         r;
+
+         for (r = 0; r < d->nranges; r++) {
+            __m128i     t = _mm_sub_epi8(x, d->lo[r]);
+
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(t, d->width[r]), t));
+         }
+         m = (unsigned) _mm_movemask_epi8(in);
+         if (!stop)
+            m ^= 0xFFFFu;
+         if (m)
+            return pos + _lowbit(m);
+         pos += 16;
+      }
+   }
+#endif
+
+   while (pos < len && d->is[s[pos]] != stop)
+      pos++;
+
+   return pos;
+}
+
+/* Add every token in buf; sets *failed if any could not be added */
+static size_t
+_ingest(struct tokenset *p, const struct _delims *d, const char *buf, size_t len,
+        int *ids_out, int *failed)
+{
+   const unsigned char *s = (const unsigned char *) buf;
+   const char *keys[BATCH];
+   size_t      lens[BATCH];
+   size_t      pos = 0, end, m = 0, n = 0;
+
+   for (;;) {
+      pos = _delims_scan(d, s, pos, len, 0);
+      if (pos < len) {
+         end = _delims_scan(d, s, pos, len, 1);
+         keys[m] = buf + pos;
+         lens[m] = end - pos;
+         m += 1;
+         pos = end;
+      }
+      if (m == BATCH || (pos == len && m > 0)) {
+         if (tokenset_add_batch(p, keys, lens, m, IS_NULL(ids_out) ? NULL : ids_out + n) < 0)
+            *failed = 1;
+         n += m;
+         m = 0;
+      }
+      if (pos == len)
+         return n;
+   }
+}
+
+size_t
+tokenset_ingest_buffer(struct tokenset *p, const char *buf, size_t len, const char *delims,
+                       int *ids_out)
+{
+   struct _delims d;
+   int         failed = 0;
+
+   _delims_init(&d, delims);
+
+   return _ingest(p, &d, buf, len, ids_out, &failed);
+}
+
+int
+tokenset_ingest_fd(struct tokenset *p, int fd, const char *delims,
+                   void (*cb) (void *arg, const int *ids, size_t n), void *arg)
+{
+   struct _delims d;
+   size_t      cap = INGEST_BUFFER, have = 0, n;
+   char       *buf = (char *) malloc(cap);
+   int        *ids = IS_NULL(cb) ? NULL : (int *) malloc((cap / 2 + 1) * sizeof(int));
+   int         failed = 0, eof = 0;
+
+   if (IS_NULL(buf) || (!IS_NULL(cb) && IS_NULL(ids))) {
+      FREE(buf);
+      FREE(ids);
+      return -1;
+   }
+
+   _delims_init(&d, delims);
+#if defined(POSIX_FADV_SEQUENTIAL)
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   while (!eof && !failed) {
+      size_t      done;
+      ssize_t     got = read(fd, buf + have, cap - have);
+
+      if (got < 0) {
+         if (EINTR == errno)
+            continue;
+         failed = 1;
+         break;
+      }
+      eof = 0 == got;
+      have += (size_t) got;
+      if (have < cap && !eof)
+         continue;                               /* fill the buffer before scanning */
+
+      /* Hold back a token the buffer may have cut in two */
+      done = have;
+      if (!eof)
+         while (done > 0 && !d.is[(unsigned char) buf[done - 1]])
+            done--;
+
+      if (0 == done && !eof) {
+         /* One token fills the whole buffer; make room for the rest of it */
+         char       *more = (char *) realloc(buf, 2 * cap);
+         int        *more_ids;
+
+         if (IS_NULL(more)) {
+            failed = 1;
+            break;
+         }
+         buf = more;
+         cap *= 2;
+         if (!IS_NULL(cb)) {
+            more_ids = (int *) realloc(ids, (cap / 2 + 1) * sizeof(int));
+            if (IS_NULL(more_ids)) {
+               failed = 1;
+               break;
+            }
+            ids = more_ids;
+         }
+         continue;
+      }
+
+      n = _ingest(p, &d, buf, done, ids, &failed);
+      if (!IS_NULL(cb) && n > 0)
+         cb(arg, ids, n);
+
+      memmove(buf, buf + done, have - done);
+      have -= done;
+   }
+
+   FREE(buf);
+   FREE(ids);
+
+   return failed ? -1 : 0;
+}
+
+int
+tokenset_count(struct tokenset *p)
+{
+   return (int) p->count;
+}
+
+int
+tokenset_exists(struct tokenset *p, char *n)
+{
+   return tokenset_exists_n(p, n, strlen(n));
+}
+
+int
+tokenset_exists_n(struct tokenset *p, const char *n, size_t len)
+{
+   unsigned    hashv;
+
+   hashv = _hash(p, n, len);
+
+   return IS_NULL(_find(p, n, len, hashv)) ? 0 : 1;
+}
+
+int
+tokenset_exists_hashed(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   return IS_NULL(_find(p, n, len, hashv)) ? 0 : 1;
+}
+
+char      **
+tokenset_get(struct tokenset *p)
+{
+   struct tokenset_iter it;
+   int         last = tokenset_count(p);
+   char      **list = (char **) calloc(1 + last, sizeof(char *));
+   const char *text;
+   size_t      len;
+   int         i = 0;
+
+   tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+
+   while (tokenset_iter_next(&it, &text, &len, NULL)) {
+      list[i] = (char *) calloc(1 + len, sizeof(char));
+      memcpy(list[i], text, len);
+      /* printf("REPORT: %s\n", list[i]); */
+      i++;
+   }
+
+   list[last] = NULL;
+
+   return list;
+}
+
+size_t
+tokenset_get_view(struct tokenset *p, const char **toks, size_t *lens, size_t max)
+{
+   struct tokenset_iter it;
+   size_t      i = 0;
+
+   tokenset_iter_init(p, &it, TOKENSET_ITER_LIST);
+
+   while (i < max && tokenset_iter_next(&it, toks + i, IS_NULL(lens) ? NULL : lens + i, NULL))
+      i++;
+
+   return i;
+}
+
+void
+tokenset_iter_init(struct tokenset *p, struct tokenset_iter *it, int order)
+{
+   if (TOKENSET_ITER_SORTED == order && (p->flags & TOKENSET_ORDERED)) {
+      it->p = p;
+      it->order = ITER_TREE;
+      it->node = _bt_seek(p, NULL, 0, &it->pos);
+      it->hi = NULL;
+      it->hilen = 0;
+      return;
+   }
+
+   if (TOKENSET_ITER_SORTED == order) {
+      if (!p->sorted)
+         tokenset_sort(p);
+      order = TOKENSET_ITER_LIST;
+   }
+
+   it->p = p;
+   it->order = order;
+   it->pos = 0;
+   it->node = p->tokens;
+   it->hi = NULL;
+   it->hilen = 0;
+}
+
+void
+tokenset_iter_range(struct tokenset *p, struct tokenset_iter *it, const char *lo,
+                    size_t lolen, const char *hi, size_t hilen)
+{
+   tokenset_iter_init(p, it, TOKENSET_ITER_SORTED);
+   it->hi = hi;
+   it->hilen = hilen;
+
+   if (IS_NULL(lo))
+      return;
+
+   if (ITER_TREE == it->order) {
+      it->node = _bt_seek(p, lo, lolen, &it->pos);
+      return;
+   }
+
+   /* Without the index the listing is now sorted: search the flat order, walk uthash's list */
+   if (p->flags & TOKENSET_FLAT) {
+      size_t      a = 0, b = p->norder;
+
+      while (a < b) {
+         size_t      mid = a + (b - a) / 2, m = mid;
+
+         while (m < b && ORDER_GONE == p->order[m])
+            m++;
+         if (m < b && _bt_cmp(p->byid[p->order[m]], lo, lolen) < 0)
+            a = m + 1;
+         else
+            b = mid;
+      }
+      it->pos = a;
+   }
+   else {
+      struct _token *s = (struct _token *) it->node;
+
+      while (!IS_NULL(s) && _bt_cmp(s, lo, lolen) < 0)
+         s = s->link.hh.next;
+      it->node = s;
+   }
+}
+
+void
+tokenset_lower_bound(struct tokenset *p, struct tokenset_iter *it, const char *key,
+                     size_t len)
+{
+   tokenset_iter_range(p, it, key, len, NULL, 0);
+}
+
+int
+tokenset_iter_next(struct tokenset_iter *it, const char **tok, size_t *len, unsigned *id)
+{
+   struct tokenset *p = it->p;
+   struct _token *s = NULL;
+
+   if (TOKENSET_ITER_ID == it->order) {
+      while (it->pos < p->size && IS_NULL(s = p->byid[it->pos]))
+         it->pos++;
+      it->pos++;
+   }
+   else if (ITER_TREE == it->order) {
+      struct _btree *t = (struct _btree *) it->node;
+
+      while (!IS_NULL(t) && it->pos >= (size_t) t->n) {
+         t = t->next;
+         it->pos = 0;
+      }
+      it->node = t;
+      if (!IS_NULL(t))
+         s = t->key[it->pos++];
+   }
+   else if (p->flags & TOKENSET_FLAT) {
+      while (it->pos < p->norder && ORDER_GONE == p->order[it->pos])
+         it->pos++;
+      if (it->pos < p->norder)
+         s = p->byid[p->order[it->pos]];
+      it->pos++;
+   }
+   else {
+      s = (struct _token *) it->node;
+      if (!IS_NULL(s))
+         it->node = s->link.hh.next;
+   }
+
+   if (IS_NULL(s))
+      return 0;
+
+   if (!IS_NULL(it->hi) && _bt_cmp(s, it->hi, it->hilen) >= 0)
+      return 0;                                  /* past the end of a range */
+
+   if (!IS_NULL(tok))
+      *tok = TOKEN_TEXT(s);
+   if (!IS_NULL(len))
+      *len = s->len;
+   if (!IS_NULL(id))
+      *id = s->id;
+
+   return 1;
+}
+
+const char *
+tokenset_get_by_id(struct tokenset *p, unsigned id)
+{
+   return tokenset_get_by_id_n(p, id, NULL);
+}
+
+const char *
+tokenset_get_by_id_n(struct tokenset *p, unsigned id, size_t *len)
+{
+   struct _token *s = (id < p->size) ? p->byid[id] : NULL;
+
+   if (!IS_NULL(len))
+      *len = IS_NULL(s) ? 0 : s->len;
+
+   return IS_NULL(s) ? NULL : (const char *) TOKEN_TEXT(s);
+}
+
+size_t
+tokenset_get_range(struct tokenset *p, unsigned first, size_t count,
+                   const char **toks, size_t *lens)
+{
+   size_t      i;
+
+   if (first >= p->size)
+      return 0;
+
+   if (count > p->size - first)
+      count = p->size - first;
+
+   for (i = 0; i < count; i++) {
+      struct _token *s = p->byid[first + i];
+      toks[i] = IS_NULL(s) ? NULL : (const char *) TOKEN_TEXT(s);
+      if (!IS_NULL(lens))
+         lens[i] = IS_NULL(s) ? 0 : s->len;
+   }
+
+   return count;
+}
+
+unsigned
+tokenset_id_limit(struct tokenset *p)
+{
+   return (unsigned) p->size;
+}
+
+int
+tokenset_id(struct tokenset *p, char *n)
+{
+   return tokenset_id_n(p, n, strlen(n));
+}
+
+int
+tokenset_id_n(struct tokenset *p, const char *n, size_t len)
+{
+   struct _token *s;
+   unsigned    hashv;
+
+   hashv = _hash(p, n, len);
+   s = _find(p, n, len, hashv);
+
+   return IS_NULL(s) ? -1 : (int) s->id;
+}
+
+int
+tokenset_id_hashed(struct tokenset *p, const char *n, size_t len, unsigned hashv)
+{
+   struct _token *s = _find(p, n, len, hashv);
+
+   return IS_NULL(s) ? -1 : (int) s->id;
+}
+
+void
+tokenset_remove(struct tokenset *p, char *n)
+{
+   tokenset_remove_n(p, n, strlen(n));
+}
+
+void
+tokenset_remove_n(struct tokenset *p, const char *n, size_t len)
+{
+   struct _token *s;
+   unsigned    hashv;
+
+   hashv = _hash(p, n, len);
+   s = _find(p, n, len, hashv);
+
+   if (IS_NULL(s))
+      return;
+
+   _remove(p, s);
+}
+
+unsigned
+tokenset_freq(struct tokenset *p, unsigned id)
+{
+   return id < p->size && !IS_NULL(p->byid[id]) ? _count(p, id) : 0;
+}
+
+/* Does a rank below b: a smaller count, or the same count and a larger id */
+#define TOPK_BELOW(p, a, b) (_count(p, (a)->id) < _count(p, (b)->id) \
+                           || (_count(p, (a)->id) == _count(p, (b)->id) && (a)->id > (b)->id))
+
+/* Restore the min-heap of n entries below position i */
+static void
+_topk_sift(const struct tokenset *p, struct _token **h, size_t n, size_t i)
+{
+   for (;;) {
+      size_t      low = i, l = 2 * i + 1, r = l + 1;
+      struct _token *t;
+
+      if (l < n && TOPK_BELOW(p, h[l], h[low]))
+         low = l;
+      if (r < n && TOPK_BELOW(p, h[r], h[low]))
+         low = r;
+      if (low == i)
+         return;
+      t = h[i];
+      h[i] = h[low];
+      h[low] = t;
+      i = low;
+   }
+}
+
+size_t
+tokenset_top_k(struct tokenset *p, size_t k, unsigned *ids_out)
+{
+   struct _token **h;
+   size_t      n = 0, i;
+
+   if (k > p->count)
+      k = p->count;
+   if (0 == k)
+      return 0;
+
+   h = (struct _token **) malloc(k * sizeof(struct _token *));
+   if (IS_NULL(h))
+      return 0;
+
+   /* The heap's root is the weakest of the best k so far */
+   for (i = 0; i < p->size; i++) {
+      struct _token *s = p->byid[i];
+
+      if (IS_NULL(s))
+         continue;
+      if (n < k) {
+         size_t      j = n++;
+
+         h[j] = s;
+         while (j > 0 && TOPK_BELOW(p, h[j], h[(j - 1) / 2])) {
+            struct _token *t = h[j];
+
+            h[j] = h[(j - 1) / 2];
+            h[(j - 1) / 2] = t;
+            j = (j - 1) / 2;
+         }
+      }
+      else if (TOPK_BELOW(p, h[0], s)) {
+         h[0] = s;
+         _topk_sift(p, h, n, 0);
+      }
+   }
+
+   /* Popping the minimum fills the output from the back */
+   for (i = n; i > 0; i--) {
+      ids_out[i - 1] = h[0]->id;
+      h[0] = h[i - 1];
+      _topk_sift(p, h, i - 1, 0);
+   }
+
+   free(h);
+
+   return n;
+}
+
+#undef  TOPK_BELOW
+
+size_t
+tokenset_prune(struct tokenset *p, unsigned min_count)
+{
+   size_t      i, removed = 0;
+
+   for (i = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i]) && _count(p, (unsigned) i) < min_count) {
+         _remove(p, p->byid[i]);
+         removed += 1;
+      }
+
+   return removed;
+}
+
+size_t
+tokenset_compact(struct tokenset *p, unsigned *remap_out)
+{
+   size_t      i, j;
+
+   /* Stash each live token's new id in its node while byid still has the old ones */
+   for (i = j = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i]))
+         p->byid[i]->id = (unsigned) j++;
+
+   if (p->flags & TOKENSET_FLAT) {
+      for (i = 0; i < p->nslots; i++)
+         if (!(p->ctrl[i] & 0x80))               /* a full slot */
+            p->slots[i] = p->byid[p->slots[i]]->id;
+      for (i = 0; i < p->norder; i++)
+         if (ORDER_GONE != p->order[i])
+            p->order[i] = p->byid[p->order[i]]->id;
+   }
+
+   /* New ids never exceed old ones, so moving up the table is safe */
+   for (i = 0; i < p->size; i++) {
+      struct _token *s = p->byid[i];
+
+      if (!IS_NULL(remap_out))
+         remap_out[i] = IS_NULL(s) ? (unsigned) -1 : s->id;
+      p->byid[i] = NULL;
+      if (!IS_NULL(s)) {
+         p->byid[s->id] = s;
+         if (p->flags & TOKENSET_COUNTS)
+            p->counts[s->id] = p->counts[i];
+      }
+   }
+
+   p->size = j;
+   p->nfree_ids = 0;
+   if (p->flags & TOKENSET_FLAT)
+      _order_squeeze(p);
+
+   /* Drop the bits of removed tokens; keeping the old filter is still correct */
+   if ((p->flags & TOKENSET_BLOOM) && p->bloom_stale > 0)
+      _bloom_build(p, p->capacity > j ? p->capacity : j);
+
+   return j;
+}
+
+void
+tokenset_reset(struct tokenset *p)
+{
+   _clear(p);
+}
+
+/* Rewrite the listing order from the ordered index, in linear time */
+static void
+_bt_relist(struct tokenset *p)
+{
+   struct _token *prev = NULL;
+   struct _btree *t;
+   size_t      i = 0;
+   int         k;
+
+   for (t = _bt_seek(p, NULL, 0, &i); !IS_NULL(t); t = t->next)
+      for (k = 0; k < t->n; k++) {
+         struct _token *s = t->key[k];
+
+         if (p->flags & TOKENSET_FLAT) {
+            p->order[i] = s->id;
+            s->link.flat.order = (unsigned) i++;
+         }
+         else {
+            s->link.hh.prev = prev;
+            if (IS_NULL(prev))
+               p->tokens = s;
+            else
+               prev->link.hh.next = s;
+            prev = s;
+         }
+      }
+
+   if (p->flags & TOKENSET_FLAT)
+      p->norder = i;
+   else if (!IS_NULL(prev)) {
+      prev->link.hh.next = NULL;
+      p->tokens->link.hh.tbl->tail = &prev->link.hh;
+   }
+}
+
+/*
+ * Sorting. Each token is paired with the next 8 bytes of its text as a
+ * big-endian integer, zero padded, so almost every comparison is on
+ * the cached key and never touches the text. The pairs are put in order
+ * by an MSD radix sort, a byte of the key per pass; tokens whose keys
+ * agree in all 8 bytes either end within them, and go first, shorter
+ * before longer, or get the next 8 bytes as their key and carry on.
+ * Small groups are finished by insertion sort. The largest bucket of
+ * each pass is continued in place and only the others recursed into,
+ * so the stack stays shallow even for tokens with long shared prefixes.
+ * The parallel sort makes the first pass that splits the tokens itself
+ * and deals its buckets out to threads.
+ */
+
+#define SORT_SMALL        24                     /* insertion sort below this */
+#define SORT_PARALLEL     65536                  /* fewer tokens are sorted on one thread */
+#define SORT_THREADS      64
+
+struct _sort_item {
+   uint64_t    key;                              /* text[depth .. depth + 8), big-endian */
+   struct _token *s;
+};
+
+static uint64_t
+_sort_key(const struct _token *s, size_t depth)
+{
+   const unsigned char *k = (const unsigned char *) TOKEN_TEXT(s) + depth;
+   size_t      n = s->len - depth;
+   uint64_t    key = 0;
+   size_t      i;
+
+   if (n >= 8)
+      return ((uint64_t) k[0] << 56) | ((uint64_t) k[1] << 48) | ((uint64_t) k[2] << 40)
+         | ((uint64_t) k[3] << 32) | ((uint64_t) k[4] << 24) | ((uint64_t) k[5] << 16)
+         | ((uint64_t) k[6] << 8) | (uint64_t) k[7];
+
+   for (i = 0; i < n; i++)
+      key |= (uint64_t) k[i] << (56 - 8 * i);
+
+   return key;
+}
+
+/* Items all share their first depth bytes; compare from there */
+static int
+_sort_cmp(const struct _sort_item *a, const struct _sort_item *b, size_t depth)
+{
+   size_t      la, lb;
+   int         c;
+
+   if (a->key != b->key)
+      return a->key < b->key ? -1 : 1;
+
+   la = a->s->len - depth;
+   lb = b->s->len - depth;
+   if (la <= 8 || lb <= 8)
+      return la < lb ? -1 : la > lb ? 1 : 0;
+
+   c = memcmp(TOKEN_TEXT(a->s) + depth + 8, TOKEN_TEXT(b->s) + depth + 8,
+              (la < lb ? la : lb) - 8);
+   if (c != 0)
+      return c;
+
+   return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static void
+_sort_small(struct _sort_item *v, size_t n, size_t depth)
+{
+   size_t      i, j;
+
+   for (i = 1; i < n; i++) {
+      struct _sort_item x = v[i];
+
+      for (j = i; j > 0 && _sort_cmp(&x, &v[j - 1], depth) < 0; j--)
+         v[j] = v[j - 1];
+      v[j] = x;
+   }
+}
+
+/* Counts of byte b of the keys of v */
+static void
+_sort_count(const struct _sort_item *v, size_t n, int b, size_t *count)
+{
+   int         shift = 56 - 8 * b;
+   size_t      i;
+
+   memset(count, 0, 256 * sizeof(size_t));
+   for (i = 0; i < n; i++)
+      count[(v[i].key >> shift) & 0xFF]++;
+}
+
+/* Stable scatter of v by byte b into tmp and back; start[c] is where bucket c begins */
+static void
+_sort_scatter(struct _sort_item *v, struct _sort_item *tmp, size_t n, int b,
+              const size_t *count, size_t *start)
+{
+   int         shift = 56 - 8 * b;
+   size_t      next[256];
+   size_t      i;
+   int         c;
+
+   for (c = 0, i = 0; c < 256; c++) {
+      start[c] = next[c] = i;
+      i += count[c];
+   }
+   for (i = 0; i < n; i++)
+      tmp[next[(v[i].key >> shift) & 0xFF]++] = v[i];
+   memcpy(v, tmp, n * sizeof(struct _sort_item));
+}
+
+/* Sort v, whose items share their first depth bytes and key bytes 0 .. b - 1 */
+static void
+_sort_msd(struct _sort_item *v, struct _sort_item *tmp, size_t n, size_t depth, int b)
+{
+   size_t      count[256], start[256];
+   size_t      i, e;
+   int         c, big;
+
+   for (;;) {
+      if (n < SORT_SMALL) {
+         _sort_small(v, n, depth);
+         return;
+      }
+
+      if (8 == b) {
+         /* Equal keys: those ending here first, by length, then on to the next 8 bytes */
+         for (i = e = 0; i < n; i++)
+            if (v[i].s->len - depth <= 8)
+               tmp[e++] = v[i];
+         for (i = 0; i < n; i++)
+            if (v[i].s->len - depth > 8)
+               tmp[e++] = v[i];
+         memcpy(v, tmp, n * sizeof(struct _sort_item));
+         for (e = 0; e < n && v[e].s->len - depth <= 8; e++)
+            ;
+         _sort_small(v, e, depth);               /* at most 9 lengths, mostly one */
+         v += e;
+         n -= e;
+         tmp += e;
+         depth += 8;
+         for (i = 0; i < n; i++)
+            v[i].key = _sort_key(v[i].s, depth);
+         b = 0;
+         continue;
+      }
+
+      _sort_count(v, n, b, count);
+      for (big = 0, c = 1; c < 256; c++)
+         if (count[c] > count[big])
+            big = c;
+      if (count[big] == n) {
+         b++;
+         continue;
+      }
+
+      _sort_scatter(v, tmp, n, b, count, start);
+      for (c = 0; c < 256; c++)
+         if (c != big && count[c] > 1)
+            _sort_msd(v + start[c], tmp + start[c], count[c], depth, b + 1);
+
+      v += start[big];
+      tmp += start[big];
+      n = count[big];
+      b++;
+   }
+}
+
+struct _sort_worker {
+   struct _sort_item *v;
+   struct _sort_item *tmp;
+   const size_t *count;
+   const size_t *start;
+   int         b;                                /* the key byte after the one split on */
+   unsigned char buckets[256];                   /* values of that byte dealt to this thread */
+   int         nbuckets;
+};
+
+static void *
+_sort_work(void *arg)
+{
+   struct _sort_worker *w = (struct _sort_worker *) arg;
+   int         i;
+
+   for (i = 0; i < w->nbuckets; i++) {
+      int         c = w->buckets[i];
+
+      if (w->count[c] > 1)
+         _sort_msd(w->v + w->start[c], w->tmp + w->start[c], w->count[c], 0, w->b);
+   }
+
+   return NULL;
+}
+
+/*
+ * Split on the first key byte that differs, then deal the buckets out,
+ * largest first, each to the least loaded thread
+ */
+static void
+_sort_parallel(struct _sort_item *v, struct _sort_item *tmp, size_t n, unsigned nthreads)
+{
+   struct _sort_worker w[SORT_THREADS];
+   pthread_t   th[SORT_THREADS];
+   size_t      count[256], start[256], load[SORT_THREADS];
+   int         started[SORT_THREADS];
+   unsigned char byload[256];
+   unsigned    t, least;
+   int         i, j, b;
+
+   for (b = 0; b < 8; b++) {
+      _sort_count(v, n, b, count);
+      for (i = 0; i < 256 && count[i] < n; i++)
+         ;
+      if (256 == i)
+         break;
+   }
+   if (8 == b) {
+      _sort_msd(v, tmp, n, 0, 8);
+      return;
+   }
+   _sort_scatter(v, tmp, n, b, count, start);
+
+   for (i = 0; i < 256; i++) {
+      for (j = i; j > 0 && count[byload[j - 1]] < count[i]; j--)
+         byload[j] = byload[j - 1];
+      byload[j] = (unsigned char) i;
+   }
+
+   for (t = 0; t < nthreads; t++) {
+      w[t].v = v;
+      w[t].tmp = tmp;
+      w[t].count = count;
+      w[t].start = start;
+      w[t].b = b + 1;
+      w[t].nbuckets = 0;
+      load[t] = 0;
+   }
+   for (i = 0; i < 256 && count[byload[i]] > 1; i++) {
+      for (least = 0, t = 1; t < nthreads; t++)
+         if (load[t] < load[least])
+            least = t;
+      w[least].buckets[w[least].nbuckets++] = byload[i];
+      load[least] += count[byload[i]];
+   }
+
+   for (t = 1; t < nthreads; t++)
+      started[t] = 0 == pthread_create(&th[t], NULL, _sort_work, &w[t]);
+   _sort_work(&w[0]);
+   for (t = 1; t < nthreads; t++) {
+      if (started[t])
+         pthread_join(th[t], NULL);
+      else
+         _sort_work(&w[t]);
+   }
+}
+
+/* Make the listing order that of v */
+static void
+_sort_relist(struct tokenset *p, const struct _sort_item *v, size_t n)
+{
+   size_t      i;
+
+   if (p->flags & TOKENSET_FLAT) {
+      for (i = 0; i < n; i++) {
+         p->order[i] = v[i].s->id;
+         v[i].s->link.flat.order = (unsigned) i;
+      }
+      p->norder = n;
+      return;
+   }
+
+   if (0 == n)
+      return;
+
+   p->tokens = v[0].s;
+   for (i = 0; i < n; i++) {
+      v[i].s->link.hh.prev = 0 == i ? NULL : v[i - 1].s;
+      v[i].s->link.hh.next = i + 1 == n ? NULL : v[i + 1].s;
+   }
+   p->tokens->link.hh.tbl->tail = &v[n - 1].s->link.hh;
+}
+
+/* For HASH_SRT: tokens in the order of _bt_cmp() */
+static int
+_sort_node_cmp(const struct _token *a, const struct _token *b)
+{
+   return _bt_cmp(a, TOKEN_TEXT(b), b->len);
+}
+
+/* Sift order[i] down the max-heap of the first n entries of the flat listing order */
+static void
+_sort_sift(struct tokenset *p, size_t i, size_t n)
+{
+   unsigned    id = p->order[i];
+   size_t      c;
+
+   while ((c = 2 * i + 1) < n) {
+      if (c + 1 < n && _sort_node_cmp(p->byid[p->order[c]], p->byid[p->order[c + 1]]) < 0)
+         c++;
+      if (_sort_node_cmp(p->byid[id], p->byid[p->order[c]]) >= 0)
+         break;
+      p->order[i] = p->order[c];
+      i = c;
+   }
+   p->order[i] = id;
+}
+
+/*
+ * Fallback for when the sort items cannot be allocated: slower, but it
+ * needs no memory, so sorting never fails. uthash's merge sort relinks
+ * the listing in place; the flat listing order is heapsorted.
+ */
+static void
+_sort_in_place(struct tokenset *p)
+{
+   size_t      i, n;
+
+   if (!(p->flags & TOKENSET_FLAT)) {
+      HASH_SRT(link.hh, p->tokens, _sort_node_cmp);
+      return;
+   }
+
+   _order_squeeze(p);
+   n = p->norder;
+   for (i = n / 2; i > 0; i--)
+      _sort_sift(p, i - 1, n);
+   while (n > 1) {
+      unsigned    top = p->order[0];
+
+      p->order[0] = p->order[--n];
+      p->order[n] = top;
+      _sort_sift(p, 0, n);
+   }
+   for (i = 0; i < p->norder; i++)
+      p->byid[p->order[i]]->link.flat.order = (unsigned) i;
+}
+
+void
+tokenset_sort_parallel(struct tokenset *p, unsigned nthreads)
+{
+   struct _sort_item *v, *tmp;
+   size_t      i, n = 0;
+
+   if (p->flags & TOKENSET_ORDERED) {
+      _bt_relist(p);
+      p->sorted = 1;
+      return;
+   }
+
+   v = (struct _sort_item *) malloc((p->count + 1) * sizeof(struct _sort_item));
+   tmp = (struct _sort_item *) malloc((p->count + 1) * sizeof(struct _sort_item));
+   if (IS_NULL(v) || IS_NULL(tmp)) {
+      FREE(v);
+      FREE(tmp);
+      _sort_in_place(p);
+      p->sorted = 1;
+      return;
+   }
+
+   for (i = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i])) {
+         v[n].s = p->byid[i];
+         v[n].key = _sort_key(p->byid[i], 0);
+         n++;
+      }
+
+   if (0 == nthreads) {
+      long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+      nthreads = ncpu > 0 ? (unsigned) ncpu : 1;
+   }
+   if (nthreads > SORT_THREADS)
+      nthreads = SORT_THREADS;
+
+   if (nthreads > 1 && n >= SORT_PARALLEL)
+      _sort_parallel(v, tmp, n, nthreads);
+   else
+      _sort_msd(v, tmp, n, 0, 0);
+
+   _sort_relist(p, v, n);
+   p->sorted = 1;
+
+   FREE(v);
+   FREE(tmp);
+}
+
+void
+tokenset_sort(struct tokenset *p)
+{
+   tokenset_sort_parallel(p, 1);
+}
+
+unsigned
+tokenset_hash_with(unsigned flags, const char *key, size_t len)
+{
+   return _hash_flags(flags, key, len);
+}
+
+unsigned
+tokenset_hash(const char *key, size_t len)
+{
+   return _hash_flags(TOKENSET_HASH_JEN, key, len);
+}
+
+/* Number of groups probed before the flat engine finds s */
+static size_t
+_flat_distance(struct tokenset *p, struct _token *s)
+{
+   size_t      mask = p->nslots / FLAT_GROUP - 1;
+   size_t      g = s->link.flat.hashv & mask;
+   size_t      step;
+
+   for (step = 1;; step++) {
+      unsigned    m = _flat_match(p->ctrl + g * FLAT_GROUP, FLAT_H2(s->link.flat.hashv));
+
+      while (m) {
+         if (p->slots[g * FLAT_GROUP + _lowbit(m)] == s->id)
+            return step - 1;
+         m &= m - 1;
+      }
+
+      g = (g + step) & mask;
+   }
+}
+
+void
+tokenset_stats(struct tokenset *p, struct tokenset_stats *out)
+{
+   size_t      i, c;
+   struct _btree *t;
+
+   memset(out, 0, sizeof(*out));
+   out->flags = p->flags;
+   out->count = p->count;
+   out->expansions = p->expansions;
+
+   switch (p->flags & TOKENSET_HASH_MASK) {
+      case TOKENSET_HASH_XXH32:
+         out->hash = "xxh32";
+         break;
+      case TOKENSET_HASH_WY:
+         out->hash = "wy";
+         break;
+      default:
+         out->hash = "jen";
+         break;
+   }
+
+   /* Nodes and out-of-line text; short tokens live in their node */
+   if (p->flags & TOKENSET_ARENA) {
+      out->node_bytes = _arena_bytes(p->node_chunks);
+      out->text_bytes = _arena_bytes(p->text_chunks);
+   }
+   else {
+      out->node_bytes = p->count * _token_size(p);
+      for (i = 0; i < p->size; i++)
+         if (!IS_NULL(p->byid[i]) && !TOKEN_IS_INLINE(p->byid[i]))
+            out->text_bytes += p->byid[i]->len + 1;
+   }
+
+   out->index_bytes = p->byid_cap * sizeof(struct _token *)
+      + (p->order_cap + p->free_ids_cap) * sizeof(unsigned) + _bt_bytes(p->tree);
+   if (!IS_NULL(p->counts))
+      out->index_bytes += p->byid_cap * sizeof(unsigned);
+   if (!IS_NULL(p->tree_spare_leaf))
+      out->index_bytes += sizeof(struct _btree);
+   for (t = p->tree_spare; !IS_NULL(t); t = t->next)
+      out->index_bytes += sizeof(struct _btree_inner);
+
+   if (p->flags & TOKENSET_FLAT) {
+      out->engine = "flat";
+      out->buckets = p->nslots;
+      out->deleted = p->nused - p->count;
+      out->table_bytes = p->nslots * (1 + sizeof(unsigned));
+      for (i = 0; i < p->size; i++) {
+         if (IS_NULL(p->byid[i]))
+            continue;
+         c = _flat_distance(p, p->byid[i]);
+         if (c > out->max_chain)
+            out->max_chain = c;
+         out->chains[c < TOKENSET_STATS_CHAINS ? c : TOKENSET_STATS_CHAINS - 1] += 1;
+      }
+   }
+   else {
+      out->engine = "uthash";
+      if (!IS_NULL(p->tokens)) {
+         UT_hash_table *tbl = p->tokens->link.hh.tbl;
+
+         out->buckets = tbl->num_buckets;
+         out->ideal_chain_maxlen = tbl->ideal_chain_maxlen;
+         out->nonideal_items = tbl->nonideal_items;
+         out->ineff_expands = tbl->ineff_expands;
+         out->noexpand = tbl->noexpand;
+         /* HASH_OVERHEAD less the handles, which node_bytes already holds */
+         out->table_bytes = sizeof(UT_hash_table) + tbl->num_buckets * sizeof(UT_hash_bucket);
+         for (i = 0; i < out->buckets; i++) {
+            c = tbl->buckets[i].count;
+            if (c > out->max_chain)
+               out->max_chain = c;
+            out->chains[c < TOKENSET_STATS_CHAINS ? c : TOKENSET_STATS_CHAINS - 1] += 1;
+         }
+      }
+   }
+
+   if (out->buckets > 0)
+      out->load_factor = (double) p->count / out->buckets;
+   out->bloom_bytes = p->bloom_blocks * BLOOM_WORDS * sizeof(uint32_t);
+   out->total_bytes = sizeof(struct tokenset) + out->node_bytes + out->text_bytes
+      + out->table_bytes + out->index_bytes + out->bloom_bytes;
+}
+
+/*
+ * Concurrent tokensets. The hash picks one of nshards plain tokensets,
+ * each behind its own rwlock, so lookups share a shard and adds only
+ * contend with adds to the same shard. Shared ids come from one counter
+ * and are taken only after a token is linked, which keeps them dense.
+ * Each shard maps its local ids to shared ones; a directory of pages
+ * maps shared ids back to the token nodes, which never move, so
+ * tokenset_concurrent_get_by_id_n() takes no lock. Page k holds
+ * CC_FIRST << k ids and is allocated on first use, so a set's pages
+ * stay within twice its ids and the directory fits in the set.
+ */
+
+#define CC_FIRST_BITS     6
+#define CC_FIRST          ((unsigned) 1 << CC_FIRST_BITS)  /* ids on page 0 */
+#define CC_PAGES          (32 - CC_FIRST_BITS)
+#define CC_IDS            ((unsigned) INT_MAX + 1)  /* ids fit an int */
+#define CC_SHARDS         64                     /* default for nshards == 0 */
+
+struct _shard {
+   pthread_rwlock_t lock;
+   struct tokenset *set;
+   unsigned   *gid;                              /* gid[local id] is the shared id */
+   size_t      gid_cap;
+};
+
+struct tokenset_concurrent {
+   struct _shard *shards;
+   unsigned    nshards;                          /* a power of two */
+   unsigned    shift;                            /* 32 - log2(nshards) */
+   unsigned    flags;
+   unsigned    next;                             /* next shared id */
+   struct _token **pages[CC_PAGES];              /* page k: CC_FIRST << k nodes */
+   pthread_mutex_t idlock;                       /* without GCC atomics */
+};
+
+static struct _shard *
+_cc_shard(struct tokenset_concurrent *c, unsigned hashv)
+{
+   /* Fibonacci hashing, so the shard leaves the low bits the tables use free */
+   return c->shards + (c->shift < 32 ? (unsigned) ((hashv * 2654435769u) >> c->shift) : 0);
+}
+
+/* Page and slot of shared id */
+static void
+_cc_where(unsigned id, int *k, size_t *i)
+{
+   unsigned    x = id + CC_FIRST;
+
+   *k = _highbit(x) - CC_FIRST_BITS;
+   *i = x - (CC_FIRST << *k);
+}
+
+/* Page k as other threads may be installing it, or NULL */
+static struct _token **
+_cc_page_get(struct tokenset_concurrent *c, int k)
+{
+   struct _token **page;
+
+#if defined(__GNUC__)
+   page = __sync_val_compare_and_swap(&c->pages[k], NULL, NULL);
+#else
+   pthread_mutex_lock(&c->idlock);
+   page = c->pages[k];
+   pthread_mutex_unlock(&c->idlock);
+#endif
+
+   return page;
+}
+
+/* Node in slot i of page as other threads may be publishing it, or NULL */
+static struct _token *
+_cc_node_get(struct tokenset_concurrent *c, struct _token **page, size_t i)
+{
+   struct _token *s;
+
+#if defined(__GNUC__)
+   (void) c;
+   s = __sync_val_compare_and_swap(&page[i], NULL, NULL);
+#else
+   pthread_mutex_lock(&c->idlock);
+   s = page[i];
+   pthread_mutex_unlock(&c->idlock);
+#endif
+
+   return s;
+}
+
+/* Page k, installed by whoever gets there first; NULL if out of memory */
+static struct _token **
+_cc_page(struct tokenset_concurrent *c, int k)
+{
+   struct _token **page, **mine;
+
+   page = _cc_page_get(c, k);
+   if (!IS_NULL(page))
+      return page;
+
+   mine = (struct _token **) calloc((size_t) CC_FIRST << k, sizeof(struct _token *));
+   if (IS_NULL(mine))
+      return NULL;
+#if defined(__GNUC__)
+   page = __sync_val_compare_and_swap(&c->pages[k], NULL, mine);
+#else
+   pthread_mutex_lock(&c->idlock);
+   page = c->pages[k];
+   if (IS_NULL(page))
+      c->pages[k] = mine;
+   pthread_mutex_unlock(&c->idlock);
+#endif
+   if (IS_NULL(page))
+      return mine;
+   free(mine);
+
+   return page;
+}
+
+/*
+ * Take the next shared id, or -1 if all are taken or its page cannot
+ * be allocated. The page, returned in *page, is in place before the id
+ * is taken, so an id once handed out is always published and never
+ * left as a hole.
+ */
+static int
+_cc_take_id(struct tokenset_concurrent *c, struct _token ***page)
+{
+   unsigned    id;
+   size_t      i;
+   int         k;
+
+   for (;;) {
+#if defined(__GNUC__)
+      id = __sync_fetch_and_add(&c->next, 0);
+#else
+      pthread_mutex_lock(&c->idlock);
+      id = c->next;
+      pthread_mutex_unlock(&c->idlock);
+#endif
+      if (id >= CC_IDS)
+         return -1;
+      _cc_where(id, &k, &i);
+      if (IS_NULL(*page = _cc_page(c, k)))
+         return -1;
+#if defined(__GNUC__)
+      if (__sync_bool_compare_and_swap(&c->next, id, id + 1))
+         return (int) id;
+#else
+      pthread_mutex_lock(&c->idlock);
+      if (c->next == id) {
+         c->next = id + 1;
+         pthread_mutex_unlock(&c->idlock);
+         return (int) id;
+      }
+      pthread_mutex_unlock(&c->idlock);
+#endif
+   }
+}
+
+/* Make node s reachable as shared id, on the page _cc_take_id() gave */
+static void
+_cc_publish(struct tokenset_concurrent *c, struct _token **page, unsigned id,
+            struct _token *s)
+{
+   size_t      i;
+   int         k;
+
+   _cc_where(id, &k, &i);
+#if defined(__GNUC__)
+   (void) c;
+   (void) __sync_bool_compare_and_swap(&page[i], NULL, s);  /* the node before its pointer */
+#else
+   pthread_mutex_lock(&c->idlock);
+   page[i] = s;
+   pthread_mutex_unlock(&c->idlock);
+#endif
+}
+
+static int
+_cc_gid_reserve(struct _shard *sh, size_t need)
+{
+   unsigned   *gid;
+   size_t      cap;
+
+   if (need <= sh->gid_cap)
+      return 0;
+
+   cap = sh->gid_cap < 16 ? 16 : sh->gid_cap * 2;
+   while (cap < need)
+      cap *= 2;
+
+   gid = (unsigned *) realloc(sh->gid, cap * sizeof(unsigned));
+   if (IS_NULL(gid))
+      return 1;
+
+   sh->gid = gid;
+   sh->gid_cap = cap;
+
+   return 0;
+}
+
+/* Shared id of the len bytes at n, or -1; the caller holds the shard's lock */
+static int
+_cc_find(struct _shard *sh, const char *n, size_t len, unsigned hashv)
+{
+   struct _token *s = _find(sh->set, n, len, hashv);
+
+   return IS_NULL(s) ? -1 : (int) sh->gid[s->id];
+}
+
+/* Add under the shard's write lock */
+static int
+_cc_add(struct tokenset_concurrent *c, struct _shard *sh, const char *n, size_t len,
+        unsigned hashv)
+{
+   size_t      local = sh->set->size;
+   struct _token **page;
+   int         id, lid;
+
+   if (_cc_gid_reserve(sh, local + 1))
+      return -1;
+
+   lid = _add(sh->set, n, len, hashv);
+   if (lid < 0)
+      return -1;
+   if ((size_t) lid < local)
+      return (int) sh->gid[lid];                 /* another thread got here first */
+
+   /* The node exists; without an id for it, take it out again */
+   id = _cc_take_id(c, &page);
+   if (id < 0) {
+      _remove(sh->set, sh->set->byid[lid]);
+      return -1;
+   }
+   sh->gid[lid] = (unsigned) id;
+   _cc_publish(c, page, (unsigned) id, sh->set->byid[lid]);
+
+   return id;
+}
+
+struct tokenset_concurrent *
+tokenset_concurrent_new(unsigned nshards, unsigned flags)
+{
+   struct tokenset_concurrent *c;
+   unsigned    i;
+
+   if (0 == nshards)
+      nshards = CC_SHARDS;
+
+   c = (struct tokenset_concurrent *) malloc(sizeof(struct tokenset_concurrent));
+   if (IS_NULL(c))
+      return NULL;
+
+   c->nshards = 1;
+   c->shift = 32;
+   while (c->nshards < nshards) {
+      c->nshards *= 2;
+      c->shift -= 1;
+   }
+   /* Hits take only the read lock, and nothing is ever removed */
+   c->flags = flags & ~(TOKENSET_COUNTS | TOKENSET_REUSE_IDS);
+   c->next = 0;
+   memset(c->pages, 0, sizeof(c->pages));
+   c->shards = (struct _shard *) calloc(c->nshards, sizeof(struct _shard));
+   if (IS_NULL(c->shards)) {
+      FREE(c);
+      return NULL;
+   }
+
+   pthread_mutex_init(&c->idlock, NULL);
+
+   for (i = 0; i < c->nshards; i++) {
+      c->shards[i].set = tokenset_new_with_flags(c->flags);
+      pthread_rwlock_init(&c->shards[i].lock, NULL);
+      if (IS_NULL(c->shards[i].set)) {
+         c->nshards = i + 1;                     /* tear down what was built */
+         tokenset_concurrent_free(&c);
+         return NULL;
+      }
+   }
+
+   return c;
+}
+
+void
+tokenset_concurrent_free(struct tokenset_concurrent **cp)
+{
+   struct tokenset_concurrent *c = *cp;
+   size_t      i;
+
+   if (IS_NULL(c))
+      return;
+
+   for (i = 0; i < c->nshards; i++) {
+      pthread_rwlock_destroy(&c->shards[i].lock);
+      tokenset_free(&c->shards[i].set);
+      FREE(c->shards[i].gid);
+   }
+   for (i = 0; i < CC_PAGES; i++)
+      FREE(c->pages[i]);
+
+   pthread_mutex_destroy(&c->idlock);
+   FREE(c->shards);
+   FREE(*cp);
+}
+
+int
+tokenset_concurrent_add_n(struct tokenset_concurrent *c, const char *n, size_t len)
+{
+   unsigned    hashv = _hash_flags(c->flags, n, len);
+   struct _shard *sh = _cc_shard(c, hashv);
+   int         id;
+
+   /* Most adds of a lexer's stream are hits, so try under the read lock first */
+   pthread_rwlock_rdlock(&sh->lock);
+   id = _cc_find(sh, n, len, hashv);
+   pthread_rwlock_unlock(&sh->lock);
+   if (id >= 0)
+      return id;
+
+   pthread_rwlock_wrlock(&sh->lock);
+   id = _cc_add(c, sh, n, len, hashv);
+   pthread_rwlock_unlock(&sh->lock);
+
+   return id;
+}
+
+int
+tokenset_concurrent_id_n(struct tokenset_concurrent *c, const char *n, size_t len)
+{
+   unsigned    hashv = _hash_flags(c->flags, n, len);
+   struct _shard *sh = _cc_shard(c, hashv);
+   int         id;
+
+   pthread_rwlock_rdlock(&sh->lock);
+   id = _cc_find(sh, n, len, hashv);
+   pthread_rwlock_unlock(&sh->lock);
+
+   return id;
+}
+
+int
+tokenset_concurrent_exists_n(struct tokenset_concurrent *c, const char *n, size_t len)
+{
+   return tokenset_concurrent_id_n(c, n, len) >= 0 ? 1 : 0;
+}
+
+const char *
+tokenset_concurrent_get_by_id_n(struct tokenset_concurrent *c, unsigned id, size_t *len)
+{
+   struct _token **page;
+   struct _token *s = NULL;
+   size_t      i;
+   int         k;
+
+   if (id < CC_IDS) {
+      _cc_where(id, &k, &i);
+      page = _cc_page_get(c, k);
+      if (!IS_NULL(page))
+         s = _cc_node_get(c, page, i);
+   }
+   if (IS_NULL(s))
+      return NULL;
+
+   if (!IS_NULL(len))
+      *len = s->len;
+
+   return TOKEN_TEXT(s);
+}
+
+size_t
+tokenset_concurrent_count(struct tokenset_concurrent *c)
+{
+#if defined(__GNUC__)
+   return __sync_fetch_and_add(&c->next, 0);
+#else
+   size_t      n;
+
+   pthread_mutex_lock(&c->idlock);
+   n = c->next;
+   pthread_mutex_unlock(&c->idlock);
+   return n;
+#endif
+}
+
+/*
+ * Merging. Tokens go into the destination with the hash they already
+ * carry whenever both sets hash alike, so merging costs no hashing. The
+ * parallel merge splits the tokens of all sources into MERGE_PARTS
+ * partitions by hash, deduplicates each partition in a private set on
+ * its own thread, appends the partitions to the result one after the
+ * other, and finally turns partition-local ids into result ids. The
+ * partitions do not depend on the number of threads, so neither do
+ * the ids.
+ */
+
+#define MERGE_PART_BITS   6
+#define MERGE_PARTS       (1 << MERGE_PART_BITS)
+#define MERGE_PART(h)     ((unsigned) (((h) * 2654435769u) & 0xFFFFFFFFu) >> (32 - MERGE_PART_BITS))
+
+/* Add src's token s to dst under hashv; with TOKENSET_COUNTS its count is added too */
+static int
+_merge_add(struct tokenset *dst, const struct tokenset *src, const struct _token *s,
+           unsigned hashv)
+{
+   size_t      before = dst->count;
+   int         id = _add(dst, TOKEN_TEXT(s), s->len, hashv);
+
+   if (id >= 0 && (dst->flags & TOKENSET_COUNTS)) {
+      unsigned   *d = dst->counts + id;
+      unsigned    c = _count(src, s->id);
+
+      if (dst->count > before)
+         *d = c;
+      else                                       /* _add() has counted one already */
+         *d = *d - 1 > UINT_MAX - c ? UINT_MAX : *d - 1 + c;
+   }
+
+   return id;
+}
+
+int
+tokenset_merge(struct tokenset *dst, struct tokenset *src, unsigned *remap_out)
+{
+   int         same = (dst->flags & TOKENSET_HASH_MASK) == (src->flags & TOKENSET_HASH_MASK);
+   size_t      id, size = src->size;
+   int         rc = 0;
+
+   if (tokenset_reserve(dst, dst->count + src->count))
+      return -1;
+
+   for (id = 0; id < size; id++) {
+      const struct _token *s = src->byid[id];
+      int         d = -1;
+
+      if (!IS_NULL(s)) {
+         d = _merge_add(dst, src, s, same ? _token_hashv(src, s)
+                        : _hash(dst, TOKEN_TEXT(s), s->len));
+         if (d < 0)
+            rc = -1;
+      }
+      if (!IS_NULL(remap_out))
+         remap_out[id] = d < 0 ? (unsigned) -1 : (unsigned) d;
+   }
+
+   return rc;
+}
+
+struct _merge {
+   struct tokenset **srcs;
+   size_t      nsrcs;
+   unsigned    flags;                            /* of the partitions */
+   unsigned    nthreads;
+   unsigned  **remaps;
+   unsigned  **hashv;                            /* hashv[i][id]: src i's token's hash for flags */
+   unsigned  **byp;                              /* byp[i]: src i's ids grouped by partition */
+   size_t    (*start)[MERGE_PARTS + 1];          /* start[i][q]: where partition q begins in byp[i] */
+   struct tokenset *part[MERGE_PARTS];
+   size_t      offset[MERGE_PARTS];              /* result id of each partition's id 0 */
+   int         failed[MERGE_PARTS];              /* by thread */
+   int         phase;
+};
+
+struct _merge_worker {
+   struct _merge *m;
+   unsigned    t;
+};
+
+/* Hash the tokens of source i and group its ids by partition */
+static int
+_merge_split(struct _merge *m, size_t i)
+{
+   struct tokenset *src = m->srcs[i];
+   int         same = (m->flags & TOKENSET_HASH_MASK) == (src->flags & TOKENSET_HASH_MASK);
+   size_t     *start = m->start[i];
+   size_t      id, q;
+
+   m->hashv[i] = (unsigned *) malloc((src->size + 1) * sizeof(unsigned));
+   m->byp[i] = (unsigned *) malloc((src->count + 1) * sizeof(unsigned));
+   if (IS_NULL(m->hashv[i]) || IS_NULL(m->byp[i]))
+      return 1;
+
+   memset(start, 0, (MERGE_PARTS + 1) * sizeof(size_t));
+   for (id = 0; id < src->size; id++) {
+      const struct _token *s = src->byid[id];
+
+      if (IS_NULL(s))
+         continue;
+      m->hashv[i][id] = same ? _token_hashv(src, s)
+         : _hash_flags(m->flags, TOKEN_TEXT(s), s->len);
+      start[MERGE_PART(m->hashv[i][id]) + 1]++;
+   }
+   for (q = 0; q < MERGE_PARTS; q++)
+      start[q + 1] += start[q];
+
+   /* A stable counting sort, so each partition lists ids in order */
+   for (id = 0; id < src->size; id++)
+      if (!IS_NULL(src->byid[id]))
+         m->byp[i][start[MERGE_PART(m->hashv[i][id])]++] = (unsigned) id;
+   for (q = MERGE_PARTS; q > 0; q--)
+      start[q] = start[q - 1];
+   start[0] = 0;
+
+   return 0;
+}
+
+/* Deduplicate partition q of every source into a private set */
+static int
+_merge_part(struct _merge *m, unsigned q)
+{
+   struct tokenset *part = tokenset_new_with_flags(m->flags);
+   size_t      i, k;
+
+   m->part[q] = part;
+   if (IS_NULL(part))
+      return 1;
+
+   for (i = 0; i < m->nsrcs; i++) {
+      struct tokenset *src = m->srcs[i];
+      unsigned   *remap = IS_NULL(m->remaps) ? NULL : m->remaps[i];
+
+      for (k = m->start[i][q]; k < m->start[i][q + 1]; k++) {
+         unsigned    id = m->byp[i][k];
+         int         d = _merge_add(part, src, src->byid[id], m->hashv[i][id]);
+
+         if (d < 0)
+            return 1;
+         if (!IS_NULL(remap))
+            remap[id] = (unsigned) d;
+      }
+   }
+
+   return 0;
+}
+
+/* Turn the partition ids in source i's remap into result ids */
+static void
+_merge_remap(struct _merge *m, size_t i)
+{
+   struct tokenset *src = m->srcs[i];
+   unsigned   *remap = m->remaps[i];
+   size_t      id;
+
+   for (id = 0; id < src->size; id++)
+      remap[id] = IS_NULL(src->byid[id]) ? (unsigned) -1
+         : remap[id] + (unsigned) m->offset[MERGE_PART(m->hashv[i][id])];
+}
+
+/* Thread t's share of the current phase: sources or partitions t, t + nthreads, ... */
+static void *
+_merge_work(void *arg)
+{
+   struct _merge_worker *w = (struct _merge_worker *) arg;
+   struct _merge *m = w->m;
+   size_t      i;
+
+   if (0 == m->phase) {
+      for (i = w->t; i < m->nsrcs; i += m->nthreads)
+         if (_merge_split(m, i))
+            m->failed[w->t] = 1;
+   }
+   else if (1 == m->phase) {
+      for (i = w->t; i < MERGE_PARTS; i += m->nthreads)
+         if (_merge_part(m, (unsigned) i))
+            m->failed[w->t] = 1;
+   }
+   else {
+      for (i = w->t; i < m->nsrcs; i += m->nthreads)
+         if (!IS_NULL(m->remaps[i]))
+            _merge_remap(m, i);
+   }
+
+   return NULL;
+}
+
+/* Run a phase on every thread; a thread that cannot be started has its share done here */
+static int
+_merge_phase(struct _merge *m, int phase, struct _merge_worker *w, pthread_t *th)
+{
+   unsigned    t;
+
+   m->phase = phase;
+   for (t = 0; t < m->nthreads; t++) {
+      w[t].m = m;
+      w[t].t = t;
+   }
+   for (t = 1; t < m->nthreads; t++)
+      if (0 != pthread_create(&th[t], NULL, _merge_work, &w[t]))
+         w[t].m = NULL;
+   _merge_work(&w[0]);
+   for (t = 1; t < m->nthreads; t++) {
+      if (IS_NULL(w[t].m)) {
+         w[t].m = m;
+         _merge_work(&w[t]);
+      }
+      else
+         pthread_join(th[t], NULL);
+   }
+
+   for (t = 0; t < m->nthreads; t++)
+      if (m->failed[t])
+         return 1;
+
+   return 0;
+}
+
+struct tokenset *
+tokenset_merge_parallel(struct tokenset **srcs, size_t n, unsigned flags, unsigned nthreads,
+                        unsigned **remaps)
+{
+   struct _merge m;
+   struct _merge_worker *w = NULL;
+   pthread_t  *th = NULL;
+   struct tokenset *dst = NULL;
+   size_t      i, id, total = 0;
+   unsigned    q;
+   int         failed = 1;
+
+   if (0 == nthreads) {
+      long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+      nthreads = ncpu > 0 ? (unsigned) ncpu : 1;
+   }
+   if (nthreads > MERGE_PARTS)
+      nthreads = MERGE_PARTS;
+
+   memset(&m, 0, sizeof(m));
+   m.srcs = srcs;
+   m.nsrcs = n;
+   m.flags = (flags & TOKENSET_HASH_MASK) | TOKENSET_FLAT | TOKENSET_ARENA | (flags & TOKENSET_COUNTS);
+   m.nthreads = nthreads;
+   m.remaps = remaps;
+   m.hashv = (unsigned **) calloc(n + 1, sizeof(unsigned *));
+   m.byp = (unsigned **) calloc(n + 1, sizeof(unsigned *));
+   m.start = (size_t (*)[MERGE_PARTS + 1]) malloc((n + 1) * sizeof(*m.start));
+   w = (struct _merge_worker *) malloc(nthreads * sizeof(struct _merge_worker));
+   th = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+   if (IS_NULL(m.hashv) || IS_NULL(m.byp) || IS_NULL(m.start) || IS_NULL(w) || IS_NULL(th))
+      goto done;
+
+   if (_merge_phase(&m, 0, w, th) || _merge_phase(&m, 1, w, th))
+      goto done;
+
+   /*
+    * The result is the partitions one after another; only this part is
+    * serial. Partitions are disjoint and each is free of duplicates, so
+    * their tokens go in with the hash they carry and no lookup.
+    */
+   for (q = 0; q < MERGE_PARTS; q++)
+      total += m.part[q]->count;
+   dst = tokenset_new_with_flags(flags);
+   if (IS_NULL(dst) || tokenset_reserve(dst, total))
+      goto done;
+   for (q = 0; q < MERGE_PARTS; q++) {
+      struct tokenset *part = m.part[q];
+
+      m.offset[q] = dst->size;
+      for (id = 0; id < part->size; id++) {
+         const struct _token *s = part->byid[id];
+         int         d = _insert(dst, TOKEN_TEXT(s), s->len, _token_hashv(part, s));
+
+         if (d < 0)
+            goto done;
+         if (dst->flags & TOKENSET_COUNTS)
+            dst->counts[d] = _count(part, (unsigned) id);
+      }
+      tokenset_free(&m.part[q]);
+   }
+
+   failed = !IS_NULL(remaps) && _merge_phase(&m, 2, w, th);
+
+ done:
+   for (q = 0; q < MERGE_PARTS; q++)
+      tokenset_free(&m.part[q]);
+   for (i = 0; i < n && !IS_NULL(m.hashv); i++)
+      FREE(m.hashv[i]);
+   for (i = 0; i < n && !IS_NULL(m.byp); i++)
+      FREE(m.byp[i]);
+   FREE(m.hashv);
+   FREE(m.byp);
+   FREE(m.start);
+   FREE(w);
+   FREE(th);
+   if (failed)
+      tokenset_free(&dst);
+
+   return dst;
+}
+
+/*
+ * Frozen tokensets. A minimal perfect hash in the style of PTHash: the
+ * 64-bit hash of each token picks a bucket of about FROZEN_LAMBDA keys,
+ * and each bucket stores the first pilot value that sends all of its
+ * keys to free slots of a table with exactly one slot per token. The
+ * slot holds the id and one fingerprint byte, so most non-members are
+ * turned away without touching the token bytes. Everything lives in one
+ * contiguous image, header first, that is never written after it is
+ * built.
+ */
+
+#define FROZEN_MAGIC      0x46534b54u            /* "TKSF" read little-endian */
+#define FROZEN_VERSION    1
+#define FROZEN_LAMBDA     4                      /* keys per bucket, on average */
+#define FROZEN_SEEDS      16                     /* construction attempts */
+
+struct _frozen_head {
+   uint32_t    magic;
+   uint32_t    version;
+   uint64_t    seed;
+   uint32_t    count;                            /* tokens, and slots */
+   uint32_t    nbuckets;
+   uint32_t    id_limit;
+   uint32_t    blob_len;
+};
+
+/* The image is the header, pilots[nbuckets], slot_id[count], offsets[id_limit + 1], fp[count], blob */
+struct tokenset_frozen {
+   unsigned char *image;
+   size_t      bytes;
+   int         mapped;                           /* image is a read-only file mapping */
+   const struct _frozen_head *head;
+   const uint32_t *pilots;
+   const uint32_t *slot_id;
+   const uint32_t *offsets;                      /* token id at blob + offsets[id], NUL-terminated */
+   const unsigned char *fp;
+   const char *blob;
+};
+
+static size_t
+_frozen_bytes(size_t count, size_t nbuckets, size_t id_limit, size_t blob_len)
+{
+   return sizeof(struct _frozen_head) + (nbuckets + count + id_limit + 1) * sizeof(uint32_t)
+      + count + blob_len;
+}
+
+/* Point the section pointers of f into f->image */
+static void
+_frozen_bind(struct tokenset_frozen *f)
+{
+   const struct _frozen_head *h = (const struct _frozen_head *) f->image;
+
+   f->head = h;
+   f->pilots = (const uint32_t *) (f->image + sizeof(struct _frozen_head));
+   f->slot_id = f->pilots + h->nbuckets;
+   f->offsets = f->slot_id + h->count;
+   f->fp = (const unsigned char *) (f->offsets + h->id_limit + 1);
+   f->blob = (const char *) (f->fp + h->count);
+}
+
+static unsigned
+_frozen_bucket(uint64_t h, uint32_t nbuckets)
+{
+   return (unsigned) (((h >> 32) * nbuckets) >> 32);
+}
+
+static unsigned
+_frozen_slot(uint64_t h, uint32_t pilot, uint32_t count)
+{
+   uint64_t    x = h ^ ((uint64_t) pilot * WY_S1);
+
+   x ^= x >> 33;                                 /* murmur3 finalizer */
+   x *= (uint64_t) 0xff51afd7u << 32 | 0xed558ccdu;
+   x ^= x >> 33;
+
+   return (unsigned) (((x >> 32) * count) >> 32);
+}
+
+#define FROZEN_FP(h)      ((unsigned char) (h))
+
+/*
+ * Search pilots for every bucket, largest buckets first; key k has
+ * hash hv[k] and keys are listed by bucket in byb, bucket b starting at
+ * start[b]. Returns 0 on success, 1 if some bucket found no pilot.
+ */
+static int
+_frozen_place(struct tokenset_frozen *f, const uint64_t *hv, const uint32_t *ids,
+              const uint32_t *byb, const uint32_t *start, unsigned char *taken,
+              unsigned *pos)
+{
+   uint32_t    count = f->head->count;
+   uint32_t    nbuckets = f->head->nbuckets;
+   uint32_t   *pilots = (uint32_t *) f->pilots;
+   uint32_t   *slot_id = (uint32_t *) f->slot_id;
+   unsigned char *fp = (unsigned char *) f->fp;
+   uint64_t    cap = 16 * (uint64_t) count + 65536;
+   uint32_t    size, b;
+
+   if (cap > 0xFFFFFFFFu)
+      cap = 0xFFFFFFFFu;
+
+   memset(taken, 0, count);
+
+   /* Largest first: big buckets are hard to place once the table fills */
+   for (size = 0, b = 0; b < nbuckets; b++)
+      if (start[b + 1] - start[b] > size)
+         size = start[b + 1] - start[b];
+
+   for (; size > 0; size--) {
+      for (b = 0; b < nbuckets; b++) {
+         uint32_t    first = start[b];
+         uint64_t    pilot;
+         uint32_t    i, j;
+
+         if (start[b + 1] - first != size)
+            continue;
+
+         for (pilot = 0; pilot < cap; pilot++) {
+            for (i = 0; i < size; i++) {
+               pos[i] = _frozen_slot(hv[byb[first + i]], (uint32_t) pilot, count);
+               if (taken[pos[i]])
+                  break;
+               for (j = 0; j < i && pos[j] != pos[i]; j++)
+                  ;
+               if (j < i)
+                  break;
+            }
+            if (i == size)
+               break;
+         }
+         if (pilot == cap)
+            return 1;
+
+         pilots[b] = (uint32_t) pilot;
+         for (i = 0; i < size; i++) {
+            taken[pos[i]] = 1;
+            slot_id[pos[i]] = ids[byb[first + i]];
+            fp[pos[i]] = FROZEN_FP(hv[byb[first + i]]);
+         }
+      }
+   }
+
+   return 0;
+}
+
+/* Fill the image of f from p, with scratch space sized for p->count keys */
+static int
+_frozen_build(struct tokenset_frozen *f, struct tokenset *p, uint64_t *hv, uint32_t *ids,
+              uint32_t *byb, uint32_t *start, unsigned char *taken, unsigned *pos)
+{
+   struct _frozen_head *head = (struct _frozen_head *) f->image;
+   uint32_t   *offsets;
+   size_t      count = p->count, nbuckets = count / FROZEN_LAMBDA + 1;
+   size_t      blob_len, i, k;
+   char       *blob;
+   int         attempt;
+
+   head->magic = FROZEN_MAGIC;
+   head->version = FROZEN_VERSION;
+   head->count = (uint32_t) count;
+   head->nbuckets = (uint32_t) nbuckets;
+   head->id_limit = (uint32_t) p->size;
+   _frozen_bind(f);
+
+   /* The blob and id table, in id order */
+   offsets = (uint32_t *) f->offsets;
+   blob = (char *) f->blob;
+   for (i = 0, k = 0, blob_len = 0; i < p->size; i++) {
+      struct _token *s = p->byid[i];
+
+      offsets[i] = (uint32_t) blob_len;
+      if (IS_NULL(s))
+         continue;                               /* a dead id spans no bytes */
+      memcpy(blob + blob_len, TOKEN_TEXT(s), s->len + 1);
+      blob_len += s->len + 1;
+      ids[k++] = (uint32_t) i;
+   }
+   offsets[p->size] = (uint32_t) blob_len;
+   head->blob_len = (uint32_t) blob_len;
+
+   for (attempt = 0; attempt < FROZEN_SEEDS; attempt++) {
+      head->seed = WY_S2 * (uint64_t) (attempt + 1);
+
+      /* Bucket the keys with a counting sort */
+      memset(start, 0, (nbuckets + 1) * sizeof(uint32_t));
+      for (k = 0; k < count; k++) {
+         struct _token *s = p->byid[ids[k]];
+
+         hv[k] = _hash_wy64(TOKEN_TEXT(s), s->len, head->seed);
+         start[_frozen_bucket(hv[k], head->nbuckets) + 1] += 1;
+      }
+      for (i = 0; i < nbuckets; i++)
+         start[i + 1] += start[i];
+      for (k = 0; k < count; k++)
+         byb[start[_frozen_bucket(hv[k], head->nbuckets)]++] = (uint32_t) k;
+      for (i = nbuckets; i > 0; i--)
+         start[i] = start[i - 1];
+      start[0] = 0;
+
+      if (0 == _frozen_place(f, hv, ids, byb, start, taken, pos))
+         return 0;
+   }
+
+   return 1;
+}
+
+struct tokenset_frozen *
+tokenset_freeze(struct tokenset *p)
+{
+   struct tokenset_frozen *f;
+   size_t      count = p->count, nbuckets = count / FROZEN_LAMBDA + 1;
+   uint64_t    blob_len = 0;
+   uint64_t   *hv;
+   uint32_t   *ids, *byb, *start;
+   unsigned char *taken;
+   unsigned   *pos;
+   size_t      i;
+   int         rc = 1;
+
+   for (i = 0; i < p->size; i++)
+      if (!IS_NULL(p->byid[i]))
+         blob_len += p->byid[i]->len + 1;
+   if (blob_len > 0xFFFFFFFFu || p->size >= 0xFFFFFFFFu)
+      return NULL;                               /* offsets are 32-bit */
+
+   f = (struct tokenset_frozen *) malloc(sizeof(struct tokenset_frozen));
+   if (IS_NULL(f))
+      return NULL;
+   f->bytes = _frozen_bytes(count, nbuckets, p->size, (size_t) blob_len);
+   f->image = (unsigned char *) calloc(f->bytes, 1);
+   f->mapped = 0;
+
+   hv = (uint64_t *) malloc((count + 1) * sizeof(uint64_t));
+   ids = (uint32_t *) malloc((count + 1) * sizeof(uint32_t));
+   byb = (uint32_t *) malloc((count + 1) * sizeof(uint32_t));
+   start = (uint32_t *) malloc((nbuckets + 1) * sizeof(uint32_t));
+   taken = (unsigned char *) malloc(count + 1);
+   pos = (unsigned *) malloc((count + 1) * sizeof(unsigned));
+
+   if (!IS_NULL(f->image) && !IS_NULL(hv) && !IS_NULL(ids) && !IS_NULL(byb)
+       && !IS_NULL(start) && !IS_NULL(taken) && !IS_NULL(pos))
+      rc = _frozen_build(f, p, hv, ids, byb, start, taken, pos);
+
+   free(hv);
+   free(ids);
+   free(byb);
+   free(start);
+   free(taken);
+   free(pos);
+
+   if (rc)
+      tokenset_frozen_free(&f);
+
+   return f;
+}
+
+void
+tokenset_frozen_free(struct tokenset_frozen **fp)
+{
+   if (IS_NULL(*fp))
+      return;
+
+   if ((*fp)->mapped)
+      munmap((*fp)->image, (*fp)->bytes);
+   else
+      FREE((*fp)->image);
+   FREE(*fp);
+}
+
+int
+tokenset_frozen_id_n(const struct tokenset_frozen *f, const char *n, size_t len)
+{
+   const struct _frozen_head *h = f->head;
+   uint64_t    hv;
+   uint32_t    id;
+   unsigned    slot;
+
+   if (0 == h->count)
+      return -1;
+
+   hv = _hash_wy64(n, len, h->seed);
+   slot = _frozen_slot(hv, f->pilots[_frozen_bucket(hv, h->nbuckets)], h->count);
+   if (f->fp[slot] != FROZEN_FP(hv))
+      return -1;
+
+   id = f->slot_id[slot];
+   if (id >= h->id_limit || f->offsets[id + 1] > h->blob_len     /* a damaged file */
+       || f->offsets[id] >= f->offsets[id + 1]
+       || f->offsets[id + 1] - f->offsets[id] != len + 1
+       || 0 != memcmp(f->blob + f->offsets[id], n, len))
+      return -1;
+
+   return (int) id;
+}
+
+int
+tokenset_frozen_id(const struct tokenset_frozen *f, const char *n)
+{
+   return tokenset_frozen_id_n(f, n, strlen(n));
+}
+
+int
+tokenset_frozen_exists_n(const struct tokenset_frozen *f, const char *n, size_t len)
+{
+   return tokenset_frozen_id_n(f, n, len) >= 0 ? 1 : 0;
+}
+
+const char *
+tokenset_frozen_get_by_id_n(const struct tokenset_frozen *f, unsigned id, size_t *len)
+{
+   size_t      span = 0;
+
+   /* Offsets out of order or past the blob can only come from a damaged file */
+   if (id < f->head->id_limit && f->offsets[id + 1] <= f->head->blob_len
+       && f->offsets[id] < f->offsets[id + 1])
+      span = f->offsets[id + 1] - f->offsets[id];
+
+   if (!IS_NULL(len))
+      *len = span > 0 ? span - 1 : 0;
+
+   return span > 0 ? f->blob + f->offsets[id] : NULL;
+}
+
+size_t
+tokenset_frozen_count(const struct tokenset_frozen *f)
+{
+   return f->head->count;
+}
+
+unsigned
+tokenset_frozen_id_limit(const struct tokenset_frozen *f)
+{
+   return f->head->id_limit;
+}
+
+size_t
+tokenset_frozen_bytes(const struct tokenset_frozen *f)
+{
+   return f->bytes;
+}
+
+/*
+ * On disk a frozen tokenset is its image, byte for byte, so loading is
+ * a mapping plus a look at the header; the pages are shared with every
+ * other process mapping the same file. Files are in host byte order,
+ * and the magic number turns away those that are not.
+ */
+
+int
+tokenset_frozen_save(const struct tokenset_frozen *f, const char *path)
+{
+   size_t      plen = strlen(path);
+   char       *tmp = (char *) malloc(plen + 8);
+   FILE       *out = NULL;
+   int         fd, rc = 1;
+
+   if (IS_NULL(tmp))
+      return 1;
+
+   /*
+    * Readers never see a partial file: write alongside, then rename over.
+    * The temporary name is unique, so concurrent savers of one path
+    * cannot write into each other's file; the last rename wins.
+    */
+   memcpy(tmp, path, plen);
+   memcpy(tmp + plen, ".XXXXXX", 8);
+
+   fd = mkstemp(tmp);
+   if (fd >= 0 && (0 != fchmod(fd, 0644) || IS_NULL(out = fdopen(fd, "wb")))) {
+      close(fd);
+      remove(tmp);
+   }
+   if (!IS_NULL(out)) {
+      rc = fwrite(f->image, 1, f->bytes, out) != f->bytes;
+      rc |= 0 != fclose(out);
+      rc = rc || 0 != rename(tmp, path);
+      if (rc)
+         remove(tmp);
+   }
+
+   free(tmp);
+
+   return rc;
+}
+
+int
+tokenset_save(struct tokenset *p, const char *path)
+{
+   struct tokenset_frozen *f = tokenset_freeze(p);
+   int         rc;
+
+   if (IS_NULL(f))
+      return 1;
+
+   rc = tokenset_frozen_save(f, path);
+   tokenset_frozen_free(&f);
+
+   return rc;
+}
+
+/* Does the header of the bytes-long image h describe exactly that image */
+static int
+_frozen_valid(const struct _frozen_head *h, size_t bytes)
+{
+   if (bytes < sizeof(struct _frozen_head))
+      return 0;
+   if (FROZEN_MAGIC != h->magic || FROZEN_VERSION != h->version)
+      return 0;
+   if (h->nbuckets != h->count / FROZEN_LAMBDA + 1 || h->count > h->id_limit)
+      return 0;
+
+   return bytes == _frozen_bytes(h->count, h->nbuckets, h->id_limit, h->blob_len);
+}
+
+struct tokenset_frozen *
+tokenset_open_mmap(const char *path)
+{
+   struct tokenset_frozen *f;
+   struct stat st;
+   void       *image;
+   int         fd;
+
+   fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return NULL;
+
+   if (0 != fstat(fd, &st) || st.st_size < (off_t) sizeof(struct _frozen_head)) {
+      close(fd);
+      return NULL;
+   }
+
+   image = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);                                    /* the mapping holds its own reference */
+   if (MAP_FAILED == image)
+      return NULL;
+
+   f = (struct tokenset_frozen *) malloc(sizeof(struct tokenset_frozen));
+   if (IS_NULL(f) || !_frozen_valid((const struct _frozen_head *) image, (size_t) st.st_size)) {
+      munmap(image, (size_t) st.st_size);
+      FREE(f);
+      return NULL;
+   }
+
+   f->image = (unsigned char *) image;
+   f->bytes = (size_t) st.st_size;
+   f->mapped = 1;
+   _frozen_bind(f);
+
+   return f;
+}
+
+/*
+ * Dictionary matchers. An Aho-Corasick trie whose failure links are
+ * folded into the transitions, leaving a DFA that takes exactly one
+ * lookup per byte of text. Bytes no token uses share class 0, so a
+ * row has one entry per byte value in use rather than 256. Entries
+ * are premultiplied by the row length, and the states at which some
+ * token ends are numbered last, so the scan loop is a load, an add
+ * and a compare.
+ */
+
+#define MATCH_NONE        UINT32_MAX
+
+struct tokenset_matcher {
+   uint32_t   *delta;                            /* delta[s + cls[c]] is the state after s reads c */
+   uint32_t    ncls;
+   uint32_t    first;                            /* states from here on end a token */
+   uint32_t    nstates;
+   uint32_t    nmatch;
+   uint32_t    maxlen;                           /* of the longest token */
+   uint32_t   *tok;                              /* by (s - first) / ncls: its token, or MATCH_NONE */
+   uint32_t   *len;                              /* ... that token's length */
+   uint32_t   *next;                             /* ... the next state down its suffixes ending a token, or 0 */
+   unsigned char cls[256];
+};
+
+/* The trie under construction; unpremultiplied, with 0 for no child */
+struct _ac_build {
+   uint32_t   *delta;
+   uint32_t   *tok;
+   uint32_t   *depth;
+   size_t      n;
+   size_t      cap;
+   uint32_t    ncls;
+};
+
+static int
+_ac_grow(struct _ac_build *b)
+{
+   size_t      cap = 2 * b->cap;
+   uint32_t   *delta, *tok, *depth;
+
+   if ((uint64_t) cap * b->ncls > UINT32_MAX)
+      return 0;
+
+   delta = (uint32_t *) realloc(b->delta, cap * b->ncls * sizeof(uint32_t));
+   if (IS_NULL(delta))
+      return 0;
+   b->delta = delta;
+   memset(delta + b->cap * b->ncls, 0, (cap - b->cap) * b->ncls * sizeof(uint32_t));
+
+   tok = (uint32_t *) realloc(b->tok, cap * sizeof(uint32_t));
+   if (IS_NULL(tok))
+      return 0;
+   b->tok = tok;
+
+   depth = (uint32_t *) realloc(b->depth, cap * sizeof(uint32_t));
+   if (IS_NULL(depth))
+      return 0;
+   b->depth = depth;
+
+   b->cap = cap;
+
+   return 1;
+}
+
+/* Thread token s into the trie */
+static int
+_ac_insert(struct _ac_build *b, const unsigned char *cls, const struct _token *s)
+{
+   const unsigned char *k = (const unsigned char *) TOKEN_TEXT(s);
+   uint32_t    q = 0;
+   size_t      i;
+
+   for (i = 0; i < s->len; i++) {
+      uint32_t   *e = b->delta + (size_t) q * b->ncls + cls[k[i]];
+
+      if (0 == *e) {
+         if (b->n == b->cap) {
+            if (!_ac_grow(b))
+               return 0;
+            e = b->delta + (size_t) q * b->ncls + cls[k[i]];
+         }
+         b->tok[b->n] = MATCH_NONE;
+         b->depth[b->n] = b->depth[q] + 1;
+         *e = (uint32_t) b->n++;
+      }
+      q = *e;
+   }
+   b->tok[q] = s->id;
+
+   return 1;
+}
+
+/*
+ * Breadth first, each state's failure link is the state its parent's
+ * link reaches on the same byte, and each missing transition is taken
+ * from the failure link's row, which is already complete. out[s] is
+ * the nearest state down the failure chain at which a token ends.
+ */
+static void
+_ac_links(struct _ac_build *b, uint32_t *fail, uint32_t *out, uint32_t *queue)
+{
+   uint32_t    ncls = b->ncls;
+   size_t      head = 0, tail = 0;
+   uint32_t    c;
+
+   fail[0] = out[0] = 0;
+   for (c = 0; c < ncls; c++) {
+      uint32_t    t = b->delta[c];
+
+      if (0 != t) {
+         fail[t] = out[t] = 0;
+         queue[tail++] = t;
+      }
+   }
+
+   while (head < tail) {
+      uint32_t    s = queue[head++];
+      uint32_t   *row = b->delta + (size_t) s * ncls;
+      const uint32_t *frow = b->delta + (size_t) fail[s] * ncls;
+
+      for (c = 0; c < ncls; c++) {
+         uint32_t    t = row[c];
+
+         if (0 == t) {
+            row[c] = frow[c];
+         } else {
+            fail[t] = frow[c];
+            out[t] = MATCH_NONE != b->tok[frow[c]] ? frow[c] : out[frow[c]];
+            queue[tail++] = t;
+         }
+      }
+   }
+}
+
+/* Renumber the states with those ending a token last, premultiply, and fill in m */
+static int
+_ac_finish(struct tokenset_matcher *m, struct _ac_build *b, const uint32_t *out,
+           uint32_t *renum)
+{
+   uint32_t    ncls = b->ncls;
+   size_t      s, c, lo = 0, hi;
+
+   m->nmatch = 0;
+   for (s = 0; s < b->n; s++)
+      if (MATCH_NONE != b->tok[s] || 0 != out[s])
+         m->nmatch++;
+
+   hi = b->n - m->nmatch;
+   for (s = 0; s < b->n; s++)
+      renum[s] = (uint32_t) ((MATCH_NONE != b->tok[s] || 0 != out[s] ? hi++ : lo++) * ncls);
+
+   m->nstates = (uint32_t) b->n;
+   m->ncls = ncls;
+   m->first = (uint32_t) (lo * ncls);
+   m->delta = (uint32_t *) malloc(b->n * ncls * sizeof(uint32_t));
+   m->tok = (uint32_t *) malloc((m->nmatch + 1) * 3 * sizeof(uint32_t));
+   if (IS_NULL(m->delta) || IS_NULL(m->tok))
+      return 0;
+   m->len = m->tok + m->nmatch + 1;
+   m->next = m->len + m->nmatch + 1;
+
+   for (s = 0; s < b->n; s++) {
+      const uint32_t *row = b->delta + s * ncls;
+      uint32_t   *to = m->delta + renum[s];
+
+      for (c = 0; c < ncls; c++)
+         to[c] = renum[row[c]];
+
+      if (renum[s] >= m->first) {
+         size_t      j = (renum[s] - m->first) / ncls;
+
+         m->tok[j] = b->tok[s];
+         m->len[j] = b->depth[s];
+         if (b->depth[s] > m->maxlen)
+            m->maxlen = b->depth[s];
+         m->next[j] = 0 == out[s] ? 0 : renum[out[s]];
+      }
+   }
+
+   return 1;
+}
+
+struct tokenset_matcher *
+tokenset_build_matcher(struct tokenset *p)
+{
+   struct tokenset_matcher *m;
+   struct _ac_build b;
+   uint32_t   *work = NULL;
+   unsigned char used[256];
+   size_t      id, i;
+   int         ok = 1;
+
+   m = (struct tokenset_matcher *) calloc(1, sizeof(struct tokenset_matcher));
+   if (IS_NULL(m))
+      return NULL;
+
+   /* Byte classes: one per byte value some token uses, 0 for the rest */
+   memset(used, 0, sizeof(used));
+   for (id = 0; id < p->size; id++) {
+      const struct _token *s = p->byid[id];
+
+      if (!IS_NULL(s))
+         for (i = 0; i < s->len; i++)
+            used[(unsigned char) TOKEN_TEXT(s)[i]] = 1;
+   }
+   b.ncls = 1;
+   for (i = 0; i < 256; i++)
+      m->cls[i] = used[i] ? (unsigned char) b.ncls++ : 0;
+   if (b.ncls > 256) {
+      /* Every byte value in use: the byte is its own class, no room for 0 */
+      b.ncls = 256;
+      for (i = 0; i < 256; i++)
+         m->cls[i] = (unsigned char) i;
+   }
+
+   b.cap = 128;
+   b.n = 1;
+   b.delta = (uint32_t *) calloc(b.cap * b.ncls, sizeof(uint32_t));
+   b.tok = (uint32_t *) malloc(b.cap * sizeof(uint32_t));
+   b.depth = (uint32_t *) malloc(b.cap * sizeof(uint32_t));
+   ok = !IS_NULL(b.delta) && !IS_NULL(b.tok) && !IS_NULL(b.depth);
+   if (ok) {
+      b.tok[0] = MATCH_NONE;
+      b.depth[0] = 0;
+   }
+
+   for (id = 0; ok && id < p->size; id++) {
+      const struct _token *s = p->byid[id];
+
+      if (!IS_NULL(s) && s->len > 0)
+         ok = s->len < UINT32_MAX && _ac_insert(&b, m->cls, s);
+   }
+
+   /* fail, out and the BFS queue, then reused for the new numbering */
+   if (ok) {
+      work = (uint32_t *) malloc(3 * b.n * sizeof(uint32_t));
+      ok = !IS_NULL(work);
+   }
+   if (ok) {
+      _ac_links(&b, work, work + b.n, work + 2 * b.n);
+      ok = _ac_finish(m, &b, work + b.n, work + 2 * b.n);
+   }
+
+   FREE(work);
+   FREE(b.delta);
+   FREE(b.tok);
+   FREE(b.depth);
+   if (!ok)
+      tokenset_matcher_free(&m);
+
+   return m;
+}
+
+void
+tokenset_matcher_free(struct tokenset_matcher **mp)
+{
+   struct tokenset_matcher *m = *mp;
+
+   if (IS_NULL(m))
+      return;
+
+   FREE(m->delta);
+   FREE(m->tok);
+   FREE(*mp);
+}
+
+size_t
+tokenset_matcher_bytes(const struct tokenset_matcher *m)
+{
+   return sizeof(struct tokenset_matcher) + (size_t) m->nstates * m->ncls * sizeof(uint32_t)
+      + ((size_t) m->nmatch + 1) * 3 * sizeof(uint32_t);
+}
+
+/* Where matches go: cb, a batch at a time, or just the count if there is no cb */
+struct _match_out {
+   void        (*cb) (void *arg, const struct tokenset_match *ms, size_t n);
+   void       *arg;
+   size_t      base;                             /* offset of s[0] in the text */
+   size_t      total;
+   size_t      nh;
+   struct tokenset_match hits[BATCH];
+};
+
+/* Report every token ending at s[at], where m reached match state q */
+static void
+_match_report(const struct tokenset_matcher *m, struct _match_out *out, uint32_t q, size_t at)
+{
+   do {
+      size_t      j = (q - m->first) / m->ncls;
+
+      if (MATCH_NONE != m->tok[j]) {
+         out->total++;
+         if (!IS_NULL(out->cb)) {
+            out->hits[out->nh].offset = out->base + at + 1 - m->len[j];
+            out->hits[out->nh].len = m->len[j];
+            out->hits[out->nh].id = m->tok[j];
+            if (++out->nh == BATCH) {
+               out->cb(out->arg, out->hits, out->nh);
+               out->nh = 0;
+            }
+         }
+      }
+      q = m->next[j];
+   } while (0 != q);
+}
+
+/* Run m over s[from .. to) from state *q, reporting the tokens that end at or after s[report] */
+static void
+_match_run(const struct tokenset_matcher *m, const unsigned char *s, size_t from, size_t to,
+           size_t report, uint32_t *q, struct _match_out *out)
+{
+   const uint32_t *delta = m->delta;
+   const unsigned char *cls = m->cls;
+   uint32_t    first = m->first;
+   uint32_t    k = *q;
+   size_t      i;
+
+   for (i = from; i < to; i++) {
+      k = delta[k + cls[s[i]]];
+      if (k >= first && i >= report)
+         _match_report(m, out, k, i);
+   }
+   *q = k;
+}
+
+/*
+ * One lookup per byte makes a single scan a chain of dependent loads.
+ * Long buffers are taken a block at a time, and each block is cut into
+ * MATCH_LANES lanes stepped together, so the loads of different lanes
+ * overlap. A DFA state only depends on the last maxlen bytes read, so
+ * every lane but the first starts from the root maxlen - 1 bytes early
+ * and is exact by its first byte. The first lane carries on from the
+ * state the block before ended in and reports as it goes; the others
+ * note where they reached a match state, and the notes are reported in
+ * order once the lanes before them are done. If a lane's notes fill
+ * up, the lanes of that block finish one after the other instead.
+ */
+
+#define MATCH_LANES       4
+#define MATCH_LANE        4096                   /* bytes per lane per block */
+#define MATCH_NOTES       512                    /* match states a lane can hold over */
+
+struct _match_note {
+   size_t      at;
+   uint32_t    q;
+};
+
+static void
+_match_block(const struct tokenset_matcher *m, const unsigned char *s, size_t from, size_t warm,
+             uint32_t *state, struct _match_out *out, struct _match_note notes[][MATCH_NOTES])
+{
+   const uint32_t *delta = m->delta;
+   const unsigned char *cls = m->cls;
+   uint32_t    first = m->first;
+   const unsigned char *s0 = s + from;
+   const unsigned char *s1 = s0 + MATCH_LANE - warm;
+   const unsigned char *s2 = s1 + MATCH_LANE;
+   const unsigned char *s3 = s2 + MATCH_LANE;
+   uint32_t    q0 = *state, q1 = 0, q2 = 0, q3 = 0;
+   size_t      nnotes[MATCH_LANES];
+   size_t      i, j, lane, at;
+   uint32_t    q[MATCH_LANES];
+   int         full = 0;
+
+   nnotes[1] = nnotes[2] = nnotes[3] = 0;
+
+   /* Lanes 1 to 3 start warm bytes early, so lane 0 waits that long */
+   for (i = 0; i < warm; i++) {
+      q1 = delta[q1 + cls[s1[i]]];
+      q2 = delta[q2 + cls[s2[i]]];
+      q3 = delta[q3 + cls[s3[i]]];
+   }
+
+   for (; i < MATCH_LANE + warm; i++) {
+      q0 = delta[q0 + cls[s0[i - warm]]];
+      q1 = delta[q1 + cls[s1[i]]];
+      q2 = delta[q2 + cls[s2[i]]];
+      q3 = delta[q3 + cls[s3[i]]];
+      if (q0 < first && q1 < first && q2 < first && q3 < first)
+         continue;
+
+      if (q0 >= first)
+         _match_report(m, out, q0, from + i - warm);
+      q[1] = q1;
+      q[2] = q2;
+      q[3] = q3;
+      for (lane = 1; lane < MATCH_LANES; lane++) {
+         if (q[lane] < first)
+            continue;
+         notes[lane][nnotes[lane]].at = from + lane * MATCH_LANE - warm + i;
+         notes[lane][nnotes[lane]].q = q[lane];
+         full |= ++nnotes[lane] == MATCH_NOTES;
+      }
+      if (full)
+         goto one_by_one;
+   }
+
+   for (lane = 1; lane < MATCH_LANES; lane++)
+      for (j = 0; j < nnotes[lane]; j++)
+         _match_report(m, out, notes[lane][j].q, notes[lane][j].at);
+   *state = q3;
+   return;
+
+ one_by_one:
+   /* Too many matches to hold: finish each lane in turn */
+   at = i + 1 - warm;                            /* the bytes of each lane done so far */
+   q[0] = q0;
+   _match_run(m, s, from + at, from + MATCH_LANE, 0, &q[0], out);
+   for (lane = 1; lane < MATCH_LANES; lane++) {
+      for (j = 0; j < nnotes[lane]; j++)
+         _match_report(m, out, notes[lane][j].q, notes[lane][j].at);
+      _match_run(m, s, from + lane * MATCH_LANE + at, from + (lane + 1) * MATCH_LANE, 0,
+                 &q[lane], out);
+   }
+   *state = q[3];
+}
+
+static size_t
+_match(const struct tokenset_matcher *m, const unsigned char *s, size_t len, size_t base,
+       uint32_t *state, void (*cb) (void *arg, const struct tokenset_match *ms, size_t n),
+       void *arg)
+{
+   struct _match_out out;
+   struct _match_note notes[MATCH_LANES][MATCH_NOTES];
+   size_t      warm = m->maxlen > 0 ? m->maxlen - 1 : 0;
+   size_t      pos = 0;
+
+   out.cb = cb;
+   out.arg = arg;
+   out.base = base;
+   out.total = 0;
+   out.nh = 0;
+
+   if (warm < MATCH_LANE / 4)
+      for (; len - pos >= MATCH_LANES * MATCH_LANE; pos += MATCH_LANES * MATCH_LANE)
+         _match_block(m, s, pos, warm, state, &out, notes);
+   _match_run(m, s, pos, len, 0, state, &out);
+
+   if (out.nh > 0)
+      cb(arg, out.hits, out.nh);
+
+   return out.total;
+}
+
+size_t
+tokenset_match_buffer(const struct tokenset_matcher *m, const char *buf, size_t len,
+                      void (*cb) (void *arg, const struct tokenset_match *ms, size_t n),
+                      void *arg)
+{
+   uint32_t    state = 0;
+
+   return _match(m, (const unsigned char *) buf, len, 0, &state, cb, arg);
+}
+
+int
+tokenset_match_fd(const struct tokenset_matcher *m, int fd,
+                  void (*cb) (void *arg, const struct tokenset_match *ms, size_t n),
+                  void *arg, size_t *nmatches)
+{
+   unsigned char *buf = (unsigned char *) malloc(INGEST_BUFFER);
+   uint32_t    state = 0;
+   size_t      base = 0, total = 0;
+   int         rc = 0;
+
+   if (IS_NULL(buf))
+      return -1;
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   for (;;) {
+      ssize_t     got = read(fd, buf, INGEST_BUFFER);
+
+      if (got < 0) {
+         if (EINTR == errno)
+            continue;
+         rc = -1;
+         break;
+      }
+      if (0 == got)
+         break;
+
+      total += _match(m, buf, (size_t) got, base, &state, cb, arg);
+      base += (size_t) got;
+   }
+
+   free(buf);
+   if (!IS_NULL(nmatches))
+      *nmatches = total;
+
+   return rc;
+}
+
+/*
+ * Packed tokensets. The tokens sit back to back in one heap, each
+ * NUL-terminated, in id order, so offs[id] and offs[id + 1] give both
+ * where token id starts and how long it is, as in a frozen tokenset.
+ * The index is a flat table of 32-bit ids with a control byte per
+ * slot, probed a group at a time like the flat engine's. Unlike it the
+ * table may have any number of groups, so it grows by half rather than
+ * doubling, and no hashes are kept: growing hashes every token again.
+ * The home group comes from the top bits of the hash and the control
+ * byte from the low 7. Apart from the token bytes that is 4 bytes of
+ * offset, a NUL and 5 bytes for each of 8/7 to 12/7 slots per token,
+ * under 15 bytes once the first allocations are filled. The offsets
+ * and the heap grow by an eighth, which tokenset_packed_shrink() gives
+ * back.
+ */
+
+#define PACKED_H2(h)      ((unsigned char) ((h) & 0x7F))
+#define PACKED_MIN        1024                   /* bytes, first offsets and heap allocation */
+
+struct tokenset_packed {
+   unsigned    flags;                            /* TOKENSET_HASH_* */
+   size_t      count;
+   uint32_t   *offs;                             /* count + 1 entries */
+   size_t      offs_cap;
+   char       *heap;
+   size_t      heap_cap;
+   unsigned char *ctrl;                          /* control byte per slot */
+   uint32_t   *slots;                            /* token id per slot */
+   size_t      ngroups;
+};
+
+static size_t
+_packed_home(const struct tokenset_packed *k, unsigned hashv)
+{
+   return (size_t) (((uint64_t) hashv * k->ngroups) >> 32);
+}
+
+static int
+_packed_find(const struct tokenset_packed *k, const char *n, size_t len, unsigned hashv)
+{
+   size_t      g;
+
+   if (0 == k->ngroups)
+      return -1;
+
+   g = _packed_home(k, hashv);
+   for (;;) {
+      const unsigned char *ctrl = k->ctrl + g * FLAT_GROUP;
+      unsigned    m = _flat_match(ctrl, PACKED_H2(hashv));
+
+      while (m) {
+         uint32_t    id = k->slots[g * FLAT_GROUP + _lowbit(m)];
+
+         if (k->offs[id + 1] - k->offs[id] - 1 == len
+             && 0 == memcmp(k->heap + k->offs[id], n, len))
+            return (int) id;
+         m &= m - 1;
+      }
+
+      /* Nothing is ever deleted, so a free slot ends the probe */
+      if (_flat_free(ctrl))
+         return -1;
+      if (++g == k->ngroups)
+         g = 0;
+   }
+}
+
+/* Put id in the first free slot from its home group on; no growth */
+static void
+_packed_place(struct tokenset_packed *k, uint32_t id, unsigned hashv)
+{
+   size_t      g = _packed_home(k, hashv);
+   size_t      i;
+
+   for (;;) {
+      unsigned    m = _flat_free(k->ctrl + g * FLAT_GROUP);
+
+      if (m) {
+         i = g * FLAT_GROUP + _lowbit(m);
+         k->ctrl[i] = PACKED_H2(hashv);
+         k->slots[i] = id;
+         return;
+      }
+      if (++g == k->ngroups)
+         g = 0;
+   }
+}
+
+/* Rebuild the table with ngroups groups, hashing every token again */
+static int
+_packed_rehash(struct tokenset_packed *k, size_t ngroups)
+{
+   unsigned char *ctrl = (unsigned char *) malloc(ngroups * FLAT_GROUP);
+   uint32_t   *slots = (uint32_t *) malloc(ngroups * FLAT_GROUP * sizeof(uint32_t));
+   size_t      id;
+
+   if (IS_NULL(ctrl) || IS_NULL(slots)) {
+      FREE(ctrl);
+      FREE(slots);
+      return 1;
+   }
+
+   memset(ctrl, FLAT_EMPTY, ngroups * FLAT_GROUP);
+   FREE(k->ctrl);
+   FREE(k->slots);
+   k->ctrl = ctrl;
+   k->slots = slots;
+   k->ngroups = ngroups;
+
+   for (id = 0; id < k->count; id++)
+      _packed_place(k, (uint32_t) id, _hash_flags(k->flags, k->heap + k->offs[id],
+                                                  k->offs[id + 1] - k->offs[id] - 1));
+
+   return 0;
+}
+
+/*
+ * Room for need items of size bytes at p, growing by an eighth. Returns
+ * p or where it moved to, or NULL, leaving p as it was, if memory runs
+ * out.
+ */
+static void *
+_packed_grow(void *p, size_t *cap, size_t need, size_t size)
+{
+   size_t      c = *cap + *cap / 8;
+   void       *t;
+
+   if (need <= *cap)
+      return p;
+   if (c < need)
+      c = need;
+   if (c < PACKED_MIN / size)
+      c = PACKED_MIN / size;
+
+   t = realloc(p, c * size);
+   if (!IS_NULL(t))
+      *cap = c;
+
+   return t;
+}
+
+struct tokenset_packed *
+tokenset_packed_new(unsigned flags)
+{
+   struct tokenset_packed *k;
+
+   k = (struct tokenset_packed *) calloc(1, sizeof(struct tokenset_packed));
+
+   if (IS_NULL(k))
+      return NULL;
+
+   k->flags = flags & TOKENSET_HASH_MASK;
+   k->offs = (uint32_t *) _packed_grow(NULL, &k->offs_cap, 1, sizeof(uint32_t));
+   if (IS_NULL(k->offs)) {
+      FREE(k);
+      return NULL;
+   }
+   k->offs[0] = 0;
+
+   return k;
+}
+
+void
+tokenset_packed_free(struct tokenset_packed **kp)
+{
+   if (IS_NULL(*kp))
+      return;
+
+   FREE((*kp)->offs);
+   FREE((*kp)->heap);
+   FREE((*kp)->ctrl);
+   FREE((*kp)->slots);
+   FREE(*kp);
+   *kp = NULL;
+}
+
+int
+tokenset_packed_reserve(struct tokenset_packed *k, size_t n, size_t text_bytes)
+{
+   size_t      ngroups = n / (FLAT_GROUP * 7 / 8) + 1;
+   void       *t;
+
+   if (IS_NULL(t = _packed_grow(k->offs, &k->offs_cap, n + 1, sizeof(uint32_t))))
+      return 1;
+   k->offs = (uint32_t *) t;
+   if (text_bytes + n > 0) {
+      if (IS_NULL(t = _packed_grow(k->heap, &k->heap_cap, text_bytes + n, 1)))
+         return 1;
+      k->heap = (char *) t;
+   }
+   if (ngroups > k->ngroups && _packed_rehash(k, ngroups))
+      return 1;
+
+   return 0;
+}
+
+int
+tokenset_packed_add_n(struct tokenset_packed *k, const char *n, size_t len)
+{
+   unsigned    hashv = _hash_flags(k->flags, n, len);
+   int         id = _packed_find(k, n, len, hashv);
+   size_t      off = k->offs[k->count];
+   void       *t;
+
+   if (id >= 0)
+      return id;
+
+   /* Offsets and ids are 32 bits, and ids are returned as int */
+   if (len >= UINT32_MAX - off || k->count >= INT_MAX)
+      return -1;
+
+   if ((k->count + 1) * 8 > k->ngroups * FLAT_GROUP * 7
+       && _packed_rehash(k, k->ngroups + k->ngroups / 2 + 1))
+      return -1;
+   if (IS_NULL(t = _packed_grow(k->offs, &k->offs_cap, k->count + 2, sizeof(uint32_t))))
+      return -1;
+   k->offs = (uint32_t *) t;
+   if (IS_NULL(t = _packed_grow(k->heap, &k->heap_cap, off + len + 1, 1)))
+      return -1;
+   k->heap = (char *) t;
+
+   memcpy(k->heap + off, n, len);
+   k->heap[off + len] = '\0';
+   k->offs[k->count + 1] = (uint32_t) (off + len + 1);
+   _packed_place(k, (uint32_t) k->count, hashv);
+
+   return (int) k->count++;
+}
+
+int
+tokenset_packed_id_n(const struct tokenset_packed *k, const char *n, size_t len)
+{
+   return _packed_find(k, n, len, _hash_flags(k->flags, n, len));
+}
+
+int
+tokenset_packed_exists_n(const struct tokenset_packed *k, const char *n, size_t len)
+{
+   return _packed_find(k, n, len, _hash_flags(k->flags, n, len)) >= 0;
+}
+
+const char *
+tokenset_packed_get_by_id_n(const struct tokenset_packed *k, unsigned id, size_t *len)
+{
+   if (id >= k->count) {
+      if (!IS_NULL(len))
+         *len = 0;
+      return NULL;
+   }
+
+   if (!IS_NULL(len))
+      *len = k->offs[id + 1] - k->offs[id] - 1;
+
+   return k->heap + k->offs[id];
+}
+
+size_t
+tokenset_packed_count(const struct tokenset_packed *k)
+{
+   return k->count;
+}
+
+size_t
+tokenset_packed_bytes(const struct tokenset_packed *k)
+{
+   return sizeof(*k) + k->offs_cap * sizeof(uint32_t) + k->heap_cap
+      + k->ngroups * FLAT_GROUP * (1 + sizeof(uint32_t));
+}
+
+void
+tokenset_packed_shrink(struct tokenset_packed *k)
+{
+   size_t      used = k->offs[k->count];
+   void       *t;
+
+   if (k->offs_cap > k->count + 1
+       && !IS_NULL(t = realloc(k->offs, (k->count + 1) * sizeof(uint32_t)))) {
+      k->offs = (uint32_t *) t;
+      k->offs_cap = k->count + 1;
+   }
+   if (used > 0 && k->heap_cap > used && !IS_NULL(t = realloc(k->heap, used))) {
+      k->heap = (char *) t;
+      k->heap_cap = used;
+   }
 }
 
 #undef  IS_NULL
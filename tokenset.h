@@ -9,6 +9,8 @@
 #ifndef TOKENSET_H
 #define TOKENSET_H
 
+#include <stddef.h>
+
 /**
  *  @brief Tokenset.
  *  @details A tokenset is a collection of unique strings (tokens).
@@ -28,6 +30,131 @@ struct tokenset;
  */
 struct tokenset *tokenset_new(void);
 
+/**
+ *  @brief Allocation mode flag for tokenset_new_with_flags().
+ *  @details Token nodes and token bytes are carved out of large
+ *  chunks instead of being malloc()ed one at a time. Memory for a
+ *  removed token's bytes is not reused until tokenset_reset() or
+ *  tokenset_free(), which release whole chunks at once.
+ */
+#define TOKENSET_ARENA         0x0001u
+
+/**
+ *  @brief Engine flag for tokenset_new_with_flags().
+ *  @details Index tokens in a flat open-addressing table of ids with
+ *  one control byte per slot, probed a group of slots at a time,
+ *  instead of the default chained uthash table. Lookups touch fewer
+ *  cache lines; the public interface behaves the same.
+ */
+#define TOKENSET_FLAT          0x0002u
+
+/**
+ *  @brief Counting flag for tokenset_new_with_flags().
+ *  @details Every add of a token already present bumps its
+ *  occurrence count, read back with tokenset_freq() and used by
+ *  tokenset_top_k() and tokenset_prune(). Without it every token
+ *  counts once. The counts are kept by id, 4 bytes per id, and only
+ *  with this flag. Ignored by tokenset_concurrent_new().
+ */
+#define TOKENSET_COUNTS        0x0004u
+
+/**
+ *  @brief Id reuse flag for tokenset_new_with_flags().
+ *  @details Ids of removed tokens are handed to later new tokens,
+ *  most recently freed first, before any fresh id is used, so
+ *  tokenset_id_limit() stays near the largest number of tokens ever
+ *  held at once. Without it ids are never reused and leave gaps; see
+ *  also tokenset_compact().
+ */
+#define TOKENSET_REUSE_IDS     0x0008u
+
+/**
+ *  @brief Ordered index flag for tokenset_new_with_flags().
+ *  @details Also keep the tokens in a B+tree ordered as by
+ *  tokenset_sort(), updated by every add and remove in O(log n).
+ *  TOKENSET_ITER_SORTED then walks the tree with no sorting at all,
+ *  tokenset_lower_bound() and tokenset_iter_range() find their start
+ *  in O(log n), and tokenset_sort() rewrites the listing order from
+ *  the tree in linear time. Costs about 12 bytes per token.
+ */
+#define TOKENSET_ORDERED       0x0010u
+
+/**
+ *  @brief Bloom filter flag for tokenset_new_with_flags().
+ *  @details Put a blocked Bloom filter in front of the hash table, so
+ *  that most lookups of absent tokens are answered from one cache
+ *  line without walking a chain or comparing text. It takes 2 bytes
+ *  per token, is sized by tokenset_reserve() or doubles as the
+ *  tokenset grows, and lets about 1 in 1000 absent tokens through to
+ *  the table. Removed tokens stay in the filter until
+ *  tokenset_compact(). Lookups of present tokens read one more cache
+ *  line, so it only pays when most lookups miss; see also
+ *  tokenset_bloom().
+ */
+#define TOKENSET_BLOOM         0x0020u
+
+/**
+ *  @brief Hash function flags for tokenset_new_with_flags().
+ *  @details At most one may be given. TOKENSET_HASH_JEN, the default,
+ *  is uthash's Jenkins hash, which reads a byte at a time.
+ *  TOKENSET_HASH_XXH32 is xxHash32, which reads 4 bytes at a time.
+ *  TOKENSET_HASH_WY is a 64-bit multiply-and-fold hash in the style
+ *  of wyhash that reads 8 bytes at a time and is usually the fastest
+ *  on tokens longer than a few bytes. All produce the same values on
+ *  every platform.
+ */
+#define TOKENSET_HASH_JEN      0x0000u
+#define TOKENSET_HASH_XXH32    0x0100u
+#define TOKENSET_HASH_WY       0x0200u
+#define TOKENSET_HASH_MASK     0x0F00u
+
+/**
+ *  @brief Constructor with options.
+ *  @details Like tokenset_new(), but the tokenset behavior is
+ *  selected by flags, a bitwise OR of the TOKENSET_* flags. Passing
+ *  0 is the same as calling tokenset_new().
+ *  @param flags Bitwise OR of TOKENSET_* flags.
+ *  @returns On success a pointer to the new tokenset object, the
+ *  NULL pointer otherwise.
+ */
+struct tokenset *tokenset_new_with_flags(unsigned flags);
+
+/**
+ *  @brief Constructor with room for a known number of tokens.
+ *  @details Same as tokenset_new() followed by tokenset_reserve().
+ *  @param n Number of tokens to make room for.
+ *  @returns On success a pointer to the new tokenset object, the
+ *  NULL pointer otherwise.
+ */
+struct tokenset *tokenset_new_with_capacity(size_t n);
+
+/**
+ *  @brief Make room for a known number of tokens.
+ *  @details Sizes the hash table and the id index so that the tokenset
+ *  can grow to n tokens without rehashing or reallocating them. With
+ *  TOKENSET_ARENA, node storage for the extra tokens is also
+ *  allocated; tokens under 16 bytes are kept in their nodes, longer
+ *  ones still take token byte storage as they come. The uthash table
+ *  still doubles if a bucket chain grows unusually long. Never shrinks
+ *  anything.
+ *  @param p Pointer to a tokenset object
+ *  @param n Number of tokens to make room for.
+ *  @returns 0 on success, nonzero if memory could not be allocated.
+ */
+int         tokenset_reserve(struct tokenset *p, size_t n);
+
+/**
+ *  @brief Turn the TOKENSET_BLOOM filter on, resize it or turn it off.
+ *  @details Builds a filter for n tokens, or for the tokens present if
+ *  there are more, from the tokens present, and keeps it up to date
+ *  from then on. An n of 0 drops the filter.
+ *  @param p Pointer to a tokenset object
+ *  @param n Number of tokens to size the filter for, or 0.
+ *  @returns 0 on success, nonzero if memory could not be allocated,
+ *  in which case the tokenset is unchanged.
+ */
+int         tokenset_bloom(struct tokenset *p, size_t n);
+
 /**
  *  @brief Destructor.
  *  @details Clean up a tokenset structure, freeing allocated
@@ -43,10 +170,96 @@ void        tokenset_free(struct tokenset **pp);
  *  @param[in] p Pointer to a tokenset object
  *  @param[in] n Pointer to a string to add.
  *  @returns Whether added or not the unsigned integer id associated
- *  with the token is returned.
+ *  with the token is returned, or -1 if memory could not be allocated.
  */
 int         tokenset_add(struct tokenset *p, char *n);
 
+/**
+ *  @brief Adds a token of known length to the tokenset.
+ *  @details Like tokenset_add(), but the token is the len bytes at n,
+ *  which need not be NUL-terminated and may contain NUL bytes. The
+ *  bytes are copied; n can point straight into a read buffer.
+ *  Tokens may be at most UINT_MAX bytes long.
+ *  @param[in] p Pointer to a tokenset object
+ *  @param[in] n Pointer to the token bytes.
+ *  @param[in] len Number of bytes in the token.
+ *  @returns Id of the token, or -1 if memory could not be allocated
+ *  or the token is too long.
+ */
+int         tokenset_add_n(struct tokenset *p, const char *n, size_t len);
+
+/**
+ *  @brief Adds many tokens in one call.
+ *  @details Equivalent to calling tokenset_add_n() on each key in
+ *  turn, but keys are hashed a block at a time and the table slots
+ *  they map to are prefetched before any of the block is resolved,
+ *  so memory latency for different keys overlaps. A key repeated in
+ *  the batch gets the same id each time.
+ *  @param[in] p Pointer to a tokenset object
+ *  @param[in] keys Array of n pointers to token bytes.
+ *  @param[in] lens Array of n token lengths, or NULL if the keys are
+ *  NUL-terminated strings.
+ *  @param[in] n Number of keys.
+ *  @param[out] ids_out If not NULL, array of n entries receiving the
+ *  id of each key in input order, or -1 where allocation failed.
+ *  @returns Number of tokens newly added, or -1 if any key could not
+ *  be added.
+ */
+int         tokenset_add_batch(struct tokenset *p, const char **keys, const size_t *lens,
+                               size_t n, int *ids_out);
+
+/**
+ *  @brief Delimiters for tokenset_ingest_buffer(): ASCII whitespace.
+ */
+#define TOKENSET_DELIMS_SPACE  " \t\n\v\f\r"
+
+/**
+ *  @brief Delimiters for tokenset_ingest_buffer(): ASCII whitespace
+ *  and punctuation.
+ */
+#define TOKENSET_DELIMS_PUNCT  TOKENSET_DELIMS_SPACE "!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~"
+
+/**
+ *  @brief Split a buffer into tokens and add them all.
+ *  @details Tokens are the maximal runs of bytes not in delims. They
+ *  are added straight from buf, as by tokenset_add_batch(), without
+ *  being copied first. The delimiter scan handles 16 bytes at a time
+ *  when the delimiters form at most 16 runs of consecutive byte
+ *  values, as both TOKENSET_DELIMS_* sets do.
+ *  @param[in] p Pointer to a tokenset object.
+ *  @param[in] buf Text to split; need not be NUL-terminated.
+ *  @param[in] len Number of bytes in buf.
+ *  @param[in] delims Delimiter bytes as a C string, or NULL for
+ *  TOKENSET_DELIMS_SPACE.
+ *  @param[out] ids_out If not NULL, receives the id of each token in
+ *  the order found, or -1 where allocation failed. At most
+ *  len / 2 + 1 ids are written.
+ *  @returns Number of tokens found, repeats included.
+ */
+size_t      tokenset_ingest_buffer(struct tokenset *p, const char *buf, size_t len,
+                                   const char *delims, int *ids_out);
+
+/**
+ *  @brief Split everything read from a file descriptor into tokens
+ *  and add them all.
+ *  @details Reads fd to end of file through a buffer of about 1 MB,
+ *  so inputs of any size use bounded memory; only a single token
+ *  longer than the buffer makes it grow. A token cut by the end of a
+ *  read is carried over to the next. Tokens are as for
+ *  tokenset_ingest_buffer().
+ *  @param[in] p Pointer to a tokenset object.
+ *  @param[in] fd File descriptor open for reading.
+ *  @param[in] delims Delimiter bytes as a C string, or NULL for
+ *  TOKENSET_DELIMS_SPACE.
+ *  @param[in] cb If not NULL, called after each buffer with the ids
+ *  of its n tokens in the order found; ids is only valid during the
+ *  call.
+ *  @param[in] arg Passed through to cb.
+ *  @returns 0 on success, -1 on a read error or if memory runs out.
+ */
+int         tokenset_ingest_fd(struct tokenset *p, int fd, const char *delims,
+                               void (*cb) (void *arg, const int *ids, size_t n), void *arg);
+
 /**
  *  @brief Number of tokens added to the tokenset.
  *  @details This provides the count of the FIXME
@@ -64,6 +277,32 @@ int         tokenset_count(struct tokenset *p);
  */
 int         tokenset_exists(struct tokenset *p, char *n);
 
+/**
+ *  @brief Checks if a token of known length is in the tokenset.
+ *  @details Like tokenset_exists(), for the len bytes at n.
+ *  @param p Pointer to a tokenset object.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns Nonzero if the token exists, zero otherwise.
+ */
+int         tokenset_exists_n(struct tokenset *p, const char *n, size_t len);
+
+/**
+ *  @brief Checks many tokens in one call.
+ *  @details Sets out[i] to what tokenset_exists_n() would return for
+ *  keys[i]. Keys are hashed a block at a time, four per SIMD lane
+ *  group where SSE2 is available, and their probes are interleaved.
+ *  @param p Pointer to a tokenset object.
+ *  @param keys Array of n pointers to token bytes.
+ *  @param lens Array of n token lengths, or NULL if the keys are
+ *  NUL-terminated strings.
+ *  @param n Number of keys.
+ *  @param out Array of n entries receiving 1 or 0.
+ *  @returns Number of keys found.
+ */
+size_t      tokenset_exists_batch(struct tokenset *p, const char **keys,
+                                  const size_t *lens, size_t n, int *out);
+
 /**
  *  @brief Return the list of tokens in a tokenset.
  *  @details Returns a NULL-terminated list of tokens in the tokenset.
@@ -72,6 +311,105 @@ int         tokenset_exists(struct tokenset *p, char *n);
  */
 char      **tokenset_get(struct tokenset *p);
 
+/**
+ *  @brief Borrowed view of the tokens in a tokenset.
+ *  @details Fills toks (and lens, if not NULL) with up to max tokens
+ *  in the order tokenset_get() would list them, without copying. The
+ *  pointers refer to the tokenset's own storage and stay valid until
+ *  the tokenset is next changed; they must not be freed.
+ *  @param p Pointer to a tokenset object.
+ *  @param toks Array of at least max entries to fill.
+ *  @param lens Array of at least max entries to fill, or NULL.
+ *  @param max Capacity of the arrays; tokenset_count() suffices.
+ *  @returns Number of entries filled.
+ */
+size_t      tokenset_get_view(struct tokenset *p, const char **toks, size_t *lens,
+                              size_t max);
+
+/**
+ *  @brief Iteration orders for tokenset_iter_init().
+ *  @details TOKENSET_ITER_LIST follows the listing order of
+ *  tokenset_get(): insertion order, or lexicographic order after
+ *  tokenset_sort(). TOKENSET_ITER_ID visits tokens by increasing id,
+ *  which is also insertion order. TOKENSET_ITER_SORTED visits tokens
+ *  in lexicographic order, calling tokenset_sort() first if the
+ *  tokenset has changed since it was last sorted.
+ */
+#define TOKENSET_ITER_LIST     0
+#define TOKENSET_ITER_ID       1
+#define TOKENSET_ITER_SORTED   2
+
+/**
+ *  @brief Iterator over the tokens of a tokenset.
+ *  @details Lives wherever the caller puts it, usually on the stack;
+ *  iterating never allocates. The members are private. An iterator
+ *  is invalidated by any change to the tokenset, including sorting.
+ */
+struct tokenset_iter {
+   struct tokenset *p;
+   void       *node;
+   size_t      pos;
+   int         order;
+   const char *hi;
+   size_t      hilen;
+};
+
+/**
+ *  @brief Start an iteration.
+ *  @details Positions it before the first token in the given order.
+ *  @param p Pointer to a tokenset object.
+ *  @param it Iterator to initialize.
+ *  @param order One of the TOKENSET_ITER_* orders.
+ */
+void        tokenset_iter_init(struct tokenset *p, struct tokenset_iter *it, int order);
+
+/**
+ *  @brief Step an iteration.
+ *  @details Reports the next token. Any of tok, len and id may be
+ *  NULL if not wanted. The token is borrowed from the tokenset as
+ *  with tokenset_get_view().
+ *  @param it Iterator set up by tokenset_iter_init().
+ *  @param tok Receives a pointer to the token.
+ *  @param len Receives the length of the token.
+ *  @param id Receives the id of the token.
+ *  @returns 1 if a token was reported, 0 at the end.
+ */
+int         tokenset_iter_next(struct tokenset_iter *it, const char **tok, size_t *len,
+                               unsigned *id);
+
+/**
+ *  @brief Start a lexicographic iteration at a key.
+ *  @details Positions it before the first token that is not less
+ *  than key, comparing bytes as unsigned and a prefix as less. The
+ *  iteration then runs in TOKENSET_ITER_SORTED order to the end.
+ *  With TOKENSET_ORDERED this is O(log n); otherwise the tokenset is
+ *  sorted as needed and the flat engine binary-searches its listing
+ *  while the uthash engine walks it.
+ *  @param p Pointer to a tokenset object.
+ *  @param it Iterator to initialize.
+ *  @param key Pointer to the key bytes.
+ *  @param len Number of bytes in the key.
+ */
+void        tokenset_lower_bound(struct tokenset *p, struct tokenset_iter *it,
+                                 const char *key, size_t len);
+
+/**
+ *  @brief Start a lexicographic iteration over a range of tokens.
+ *  @details Visits the tokens t with lo <= t < hi in order, as
+ *  tokenset_lower_bound() from lo, stopping at the first token not
+ *  less than hi. With TOKENSET_ORDERED a scan of k tokens costs
+ *  O(log n + k).
+ *  @param p Pointer to a tokenset object.
+ *  @param it Iterator to initialize.
+ *  @param lo Pointer to the lower bound's bytes, or NULL for none.
+ *  @param lolen Number of bytes in lo.
+ *  @param hi Pointer to the upper bound's bytes, or NULL for none.
+ *  Must stay valid while iterating.
+ *  @param hilen Number of bytes in hi.
+ */
+void        tokenset_iter_range(struct tokenset *p, struct tokenset_iter *it, const char *lo,
+                                size_t lolen, const char *hi, size_t hilen);
+
 /**
  *  @brief Return the token associated with an id.
  *  @details Each token is associated with a unique id. Return the
@@ -82,6 +420,44 @@ char      **tokenset_get(struct tokenset *p);
  */
 const char *tokenset_get_by_id(struct tokenset *p, unsigned id);
 
+/**
+ *  @brief Return the token associated with an id, and its length.
+ *  @details Like tokenset_get_by_id(), but also reports the stored
+ *  length of the token so the caller need not call strlen(). The
+ *  lookup is a single index into an id-ordered table.
+ *  @param p Pointer to a tokenset object.
+ *  @param id Identifier.
+ *  @param len If not NULL, receives the length of the token, or 0
+ *  if there is no token with this id.
+ *  @returns String associated with id, NULL if there is none.
+ */
+const char *tokenset_get_by_id_n(struct tokenset *p, unsigned id, size_t *len);
+
+/**
+ *  @brief Return the tokens for a consecutive range of ids.
+ *  @details Fills toks[i] (and lens[i], if lens is not NULL) with
+ *  the token having id first + i, for i < count. Ids that were
+ *  removed are reported as NULL with length 0. The range is clipped
+ *  to tokenset_id_limit(). The pointers are owned by the tokenset.
+ *  @param p Pointer to a tokenset object.
+ *  @param first First id of the range.
+ *  @param count Number of ids requested.
+ *  @param toks Array of at least count entries to fill.
+ *  @param lens Array of at least count entries to fill, or NULL.
+ *  @returns Number of entries filled.
+ */
+size_t      tokenset_get_range(struct tokenset *p, unsigned first, size_t count,
+                               const char **toks, size_t *lens);
+
+/**
+ *  @brief Upper bound on the ids in use.
+ *  @details Every id handed out so far is less than the returned
+ *  value. Useful for sizing id-indexed arrays.
+ *  @param p Pointer to a tokenset object.
+ *  @returns One more than the largest id assigned.
+ */
+unsigned    tokenset_id_limit(struct tokenset *p);
+
 /**
  *  @brief Removes a token from the tokenset.
  *  @details If the specified token (string) is found in the tokenset,
@@ -91,6 +467,106 @@ const char *tokenset_get_by_id(struct tokenset *p, unsigned id);
  */
 void        tokenset_remove(struct tokenset *p, char *n);
 
+/**
+ *  @brief Removes a token of known length from the tokenset.
+ *  @details Like tokenset_remove(), for the len bytes at n.
+ *  @param p Pointer to a tokenset object
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ */
+void        tokenset_remove_n(struct tokenset *p, const char *n, size_t len);
+
+/**
+ *  @brief How many times a token has been added.
+ *  @details Counts adds since the token was last added afresh, by
+ *  any of the add and ingest calls; saturates at UINT_MAX. Needs
+ *  TOKENSET_COUNTS, else it is 1 for every token.
+ *  @param p Pointer to a tokenset object.
+ *  @param id Identifier.
+ *  @returns The count, or 0 if there is no token with this id.
+ */
+unsigned    tokenset_freq(struct tokenset *p, unsigned id);
+
+/**
+ *  @brief The most frequent tokens.
+ *  @details Keeps a heap of the best k while walking the tokens
+ *  once, so costs O(n log k) rather than a full sort. Ties go to the
+ *  smaller id.
+ *  @param p Pointer to a tokenset object.
+ *  @param k Number of tokens wanted.
+ *  @param ids_out Array of at least k entries, receiving the ids by
+ *  decreasing count.
+ *  @returns Number of ids written, the smaller of k and the number
+ *  of tokens, or 0 if memory runs out.
+ */
+size_t      tokenset_top_k(struct tokenset *p, size_t k, unsigned *ids_out);
+
+/**
+ *  @brief Remove every token added fewer than min_count times.
+ *  @details One pass over the tokens. Ids of the tokens kept do not
+ *  change.
+ *  @param p Pointer to a tokenset object.
+ *  @param min_count Smallest count to keep.
+ *  @returns Number of tokens removed.
+ */
+size_t      tokenset_prune(struct tokenset *p, unsigned min_count);
+
+/**
+ *  @brief Renumber the tokens densely.
+ *  @details Gives the live tokens the ids 0 to tokenset_count() - 1
+ *  in one pass, keeping their relative order, so the id limit drops
+ *  to the count. Ids of removed tokens waiting to be reused are
+ *  forgotten.
+ *  @param p Pointer to a tokenset object.
+ *  @param remap_out If not NULL, an array of tokenset_id_limit()
+ *  entries, as it was before the call, receiving the new id of each
+ *  old id, or (unsigned) -1 for ids with no token. Use it to compact
+ *  arrays indexed by id.
+ *  @returns The new id limit, the number of tokens.
+ */
+size_t      tokenset_compact(struct tokenset *p, unsigned *remap_out);
+
+/**
+ *  @brief Add every token of one tokenset to another.
+ *  @details Tokens new to dst get ids after its existing ones, in the
+ *  order of their ids in src. When both tokensets use the same
+ *  TOKENSET_HASH_* function the hashes src already holds are reused.
+ *  With TOKENSET_COUNTS on dst, the count of each token in src is
+ *  added to its count in dst. src is not changed.
+ *  @param dst Pointer to the tokenset to add to.
+ *  @param src Pointer to the tokenset to add from.
+ *  @param remap_out If not NULL, an array of tokenset_id_limit(src)
+ *  entries receiving the dst id of each src id, or (unsigned) -1 for
+ *  ids with no token.
+ *  @returns 0 on success, -1 if memory ran out; tokens added before
+ *  that stay added.
+ */
+int         tokenset_merge(struct tokenset *dst, struct tokenset *src, unsigned *remap_out);
+
+/**
+ *  @brief Merge many tokensets into a new one using several threads.
+ *  @details Tokens are split into 64 partitions by hash, and each
+ *  partition is deduplicated across all sources on its own thread;
+ *  only appending the unique tokens to the result is serial. Ids in
+ *  the result are grouped by partition and, within one, follow the
+ *  sources in order and their ids in order. They depend only on the
+ *  sources and the hash function, never on the number of threads.
+ *  Counts add up as for tokenset_merge(). The sources are not changed
+ *  and must not be changed during the call.
+ *  @param srcs Array of n pointers to tokensets.
+ *  @param n Number of tokensets.
+ *  @param flags Flags for the new tokenset, as for
+ *  tokenset_new_with_flags().
+ *  @param nthreads Number of threads to use, or 0 for one per
+ *  online CPU; at most 64 are used.
+ *  @param remaps If not NULL, an array of n pointers, each NULL or an
+ *  array of tokenset_id_limit(srcs[i]) entries receiving the new id
+ *  of each id of srcs[i], or (unsigned) -1 for ids with no token.
+ *  @returns The merged tokenset, or NULL if memory runs out.
+ */
+struct tokenset *tokenset_merge_parallel(struct tokenset **srcs, size_t n, unsigned flags,
+                                         unsigned nthreads, unsigned **remaps);
+
 /**
  *  @brief Returns the id associated with a token.
  *  @details Returns the id associated with a token/string.
@@ -100,6 +576,33 @@ void        tokenset_remove(struct tokenset *p, char *n);
  */
 int         tokenset_id(struct tokenset *p, char *n);
 
+/**
+ *  @brief Returns the id associated with a token of known length.
+ *  @details Like tokenset_id(), for the len bytes at n.
+ *  @param p Pointer to a tokenset object
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns id of the token, if found, -1 otherwise.
+ */
+int         tokenset_id_n(struct tokenset *p, const char *n, size_t len);
+
+/**
+ *  @brief Returns the ids of many tokens in one call.
+ *  @details Sets ids_out[i] to what tokenset_id_n() would return for
+ *  keys[i], -1 for keys not in the tokenset. Keys are hashed a block
+ *  at a time, four per SIMD lane group where SSE2 is available, and
+ *  their probes are interleaved.
+ *  @param p Pointer to a tokenset object
+ *  @param keys Array of n pointers to token bytes.
+ *  @param lens Array of n token lengths, or NULL if the keys are
+ *  NUL-terminated strings.
+ *  @param n Number of keys.
+ *  @param ids_out Array of n entries receiving the ids.
+ *  @returns Number of keys found.
+ */
+size_t      tokenset_id_batch(struct tokenset *p, const char **keys, const size_t *lens,
+                              size_t n, int *ids_out);
+
 /**
  *  @brief Removes all tokens from a tokenset.
  *  @details Removes all tokens/strings from a tokenset, but
@@ -113,11 +616,554 @@ void        tokenset_reset(struct tokenset *p);
  *  @brief Lexicographically sort the tokenset.
  *  @details Sort the tokenset lexicographically so that,
  *  for example, the list returned by tokenset_get() is
- *  ordered. Does not change the token-id pairing.
+ *  ordered. Does not change the token-id pairing. Bytes compare as
+ *  unsigned and a proper prefix sorts first, as with strcmp(). Tokens
+ *  are radix sorted on their leading bytes, 8 at a time, so the text
+ *  of most tokens is read only once. That takes 32 bytes per token
+ *  of scratch memory; if it cannot be had, a slower in-place sort is
+ *  used, so sorting never fails.
  *  @param p Pointer to a tokenset object
  */
 void        tokenset_sort(struct tokenset *p);
 
+/**
+ *  @brief Lexicographically sort the tokenset using several threads.
+ *  @details Same result as tokenset_sort(). Sets of 65536 tokens or
+ *  more are split on the first of their leading 8 bytes at which they
+ *  differ and the parts sorted on separate threads; smaller ones are
+ *  sorted on the calling thread. The split gains little when most
+ *  tokens share that byte too.
+ *  @param p Pointer to a tokenset object
+ *  @param nthreads Number of threads to use, or 0 for one per online
+ *  CPU; at most 64 are used.
+ */
+void        tokenset_sort_parallel(struct tokenset *p, unsigned nthreads);
+
+/**
+ *  @brief Hash a token as a tokenset would.
+ *  @details Returns the hash of the len bytes at key under the hash
+ *  function selected by the TOKENSET_HASH_* bits of flags.
+ *  @param flags Flags as given to tokenset_new_with_flags().
+ *  @param key Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The hash value.
+ */
+unsigned    tokenset_hash_with(unsigned flags, const char *key, size_t len);
+
+/**
+ *  @brief Hash a token as a tokenset with the default hash would.
+ *  @details Same as tokenset_hash_with(TOKENSET_HASH_JEN, key, len).
+ *  The value depends only on the bytes, never on the platform or on
+ *  any particular tokenset, so one hash serves lookups in every
+ *  tokenset made without a TOKENSET_HASH_* flag through the *_hashed
+ *  calls.
+ *  @param key Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The hash value.
+ */
+unsigned    tokenset_hash(const char *key, size_t len);
+
+/**
+ *  @brief Adds a token whose hash is already known.
+ *  @details Like tokenset_add_n(), but hashv is used instead of
+ *  hashing the token again. It must be the value tokenset_hash_with()
+ *  gives for the flags the tokenset was made with; any other value
+ *  leaves the token where lookups will not find it.
+ *  @param[in] p Pointer to a tokenset object
+ *  @param[in] n Pointer to the token bytes.
+ *  @param[in] len Number of bytes in the token.
+ *  @param[in] hashv Hash of the token.
+ *  @returns Id of the token, or -1 if memory could not be allocated.
+ */
+int         tokenset_add_hashed(struct tokenset *p, const char *n, size_t len,
+                                unsigned hashv);
+
+/**
+ *  @brief Id of a token whose hash is already known.
+ *  @details Like tokenset_id_n(), with hashv as for
+ *  tokenset_add_hashed().
+ *  @param[in] p Pointer to a tokenset object
+ *  @param[in] n Pointer to the token bytes.
+ *  @param[in] len Number of bytes in the token.
+ *  @param[in] hashv Hash of the token.
+ *  @returns The token's id, or -1 if it is not present.
+ */
+int         tokenset_id_hashed(struct tokenset *p, const char *n, size_t len, unsigned hashv);
+
+/**
+ *  @brief Does a token whose hash is already known exist.
+ *  @details Like tokenset_exists_n(), with hashv as for
+ *  tokenset_add_hashed().
+ *  @param[in] p Pointer to a tokenset object
+ *  @param[in] n Pointer to the token bytes.
+ *  @param[in] len Number of bytes in the token.
+ *  @param[in] hashv Hash of the token.
+ *  @returns 1 if present, 0 otherwise.
+ */
+int         tokenset_exists_hashed(struct tokenset *p, const char *n, size_t len,
+                                   unsigned hashv);
+
+/**
+ *  @brief Number of bins in tokenset_stats.chains.
+ */
+#define TOKENSET_STATS_CHAINS  16
+
+/**
+ *  @brief Table statistics reported by tokenset_stats().
+ *  @details For the uthash engine buckets is the number of buckets,
+ *  chains[i] counts the buckets holding i tokens and max_chain is the
+ *  longest chain. For the flat engine buckets is the number of slots,
+ *  chains[i] counts the tokens found after probing i groups past
+ *  their home group and max_chain is the largest such count. The
+ *  last bin of chains also counts everything beyond it.
+ *
+ *  The ideal_chain_maxlen, nonideal_items, ineff_expands and noexpand
+ *  fields copy uthash's own table counters and are 0 for the flat
+ *  engine; deleted only applies to the flat engine. The byte totals
+ *  count what is allocated, not what is in use, in the spirit of
+ *  uthash's HASH_OVERHEAD.
+ */
+struct tokenset_stats {
+   unsigned    flags;                            /* as given to tokenset_new_with_flags() */
+   const char *engine;                           /* "uthash" or "flat" */
+   const char *hash;                             /* "jen", "xxh32" or "wy" */
+   size_t      count;                            /* tokens */
+   size_t      buckets;
+   size_t      max_chain;
+   size_t      chains[TOKENSET_STATS_CHAINS];
+   double      load_factor;                      /* count / buckets */
+   unsigned    ideal_chain_maxlen;               /* uthash: longest chain it expects */
+   unsigned    nonideal_items;                   /* uthash: tokens in chains beyond that */
+   unsigned    ineff_expands;                    /* uthash: doublings that did not help */
+   unsigned    noexpand;                         /* uthash: 1 once it stopped doubling */
+   size_t      deleted;                          /* flat: slots holding deleted markers */
+   size_t      expansions;                       /* times the table grew so far */
+   size_t      node_bytes;                       /* token nodes */
+   size_t      text_bytes;                       /* token text kept outside the nodes */
+   size_t      table_bytes;                      /* buckets, or slots and control bytes */
+   size_t      index_bytes;                      /* id index, listing order, free ids, tree */
+   size_t      bloom_bytes;                      /* TOKENSET_BLOOM filter */
+   size_t      total_bytes;                      /* all of the above and the tokenset */
+};
+
+/**
+ *  @brief Report how a tokenset is configured and how its table is doing.
+ *  @details Fills out; the strings are static. Walks the whole table,
+ *  so is not meant for hot paths.
+ *  @param p Pointer to a tokenset object.
+ *  @param out Receives the statistics.
+ */
+void        tokenset_stats(struct tokenset *p, struct tokenset_stats *out);
+
+/**
+ *  @brief Concurrent tokenset.
+ *  @details A tokenset that many threads may add to and look up in
+ *  at the same time. Tokens are spread over shards, each a tokenset
+ *  behind its own read-write lock; ids are still dense and unique
+ *  across the whole set, 0, 1, 2, ... in the order tokens were first
+ *  added. Tokens cannot be removed. Creating and freeing are not
+ *  thread-safe.
+ */
+struct tokenset_concurrent;
+
+/**
+ *  @brief Constructor for concurrent tokensets.
+ *  @details Each shard is a tokenset created with flags, so the
+ *  TOKENSET_ARENA, TOKENSET_FLAT and TOKENSET_HASH_* flags apply.
+ *  nshards is rounded up to a power of two; a few times the number
+ *  of threads keeps lock contention low.
+ *  @param nshards Number of shards, or 0 for a default of 64.
+ *  @param flags Flags as for tokenset_new_with_flags().
+ *  @returns On success a pointer to the new object, the NULL pointer
+ *  otherwise.
+ */
+struct tokenset_concurrent *tokenset_concurrent_new(unsigned nshards, unsigned flags);
+
+/**
+ *  @brief Destructor for concurrent tokensets.
+ *  @param cp Pointer to the pointer returned by tokenset_concurrent_new().
+ */
+void        tokenset_concurrent_free(struct tokenset_concurrent **cp);
+
+/**
+ *  @brief Add a token of known length, thread-safe.
+ *  @details As tokenset_add_n(). Lookups of tokens already present
+ *  share the shard's lock, so a stream of mostly repeated tokens
+ *  scales with the number of threads.
+ *  @param c Pointer to a concurrent tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The token's id, or -1 if memory runs out or all 2^31 ids
+ *  are taken.
+ */
+int         tokenset_concurrent_add_n(struct tokenset_concurrent *c, const char *n,
+                                      size_t len);
+
+/**
+ *  @brief Id of a token of known length, thread-safe.
+ *  @param c Pointer to a concurrent tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The token's id, or -1 if it is not present.
+ */
+int         tokenset_concurrent_id_n(struct tokenset_concurrent *c, const char *n,
+                                     size_t len);
+
+/**
+ *  @brief Does a token of known length exist, thread-safe.
+ *  @param c Pointer to a concurrent tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns 1 if present, 0 otherwise.
+ */
+int         tokenset_concurrent_exists_n(struct tokenset_concurrent *c, const char *n,
+                                         size_t len);
+
+/**
+ *  @brief Token by id, thread-safe and lock-free.
+ *  @details The returned bytes are NUL-terminated and stay valid
+ *  until tokenset_concurrent_free(). Built without GCC atomics it
+ *  takes a mutex instead.
+ *  @param c Pointer to a concurrent tokenset.
+ *  @param id Id returned by tokenset_concurrent_add_n().
+ *  @param len If not NULL, receives the token's length.
+ *  @returns Pointer to the token, or NULL if no token has that id.
+ */
+const char *tokenset_concurrent_get_by_id_n(struct tokenset_concurrent *c, unsigned id,
+                                            size_t *len);
+
+/**
+ *  @brief Number of tokens in a concurrent tokenset.
+ *  @details Also the id the next new token will get, though with
+ *  other threads adding that may change at once.
+ *  @param c Pointer to a concurrent tokenset.
+ *  @returns The number of ids handed out.
+ */
+size_t      tokenset_concurrent_count(struct tokenset_concurrent *c);
+
+/**
+ *  @brief Frozen tokenset.
+ *  @details An immutable snapshot of a tokenset's token-id pairs,
+ *  built by tokenset_freeze(). Lookups use a minimal perfect hash
+ *  with a one-byte fingerprint per token and the tokens sit in one
+ *  contiguous block, so a frozen set takes a fraction of the memory
+ *  of the live one. Nothing is written after construction, so any
+ *  number of threads may look up in it at once without locking.
+ */
+struct tokenset_frozen;
+
+/**
+ *  @brief Build a frozen copy of a tokenset.
+ *  @details Ids are kept, including the gaps left by removed tokens.
+ *  Construction is linear in the number of tokens. The tokenset is
+ *  not changed and may be freed afterwards.
+ *  @param p Pointer to a tokenset object.
+ *  @returns A new frozen tokenset, or NULL if memory runs out or the
+ *  tokens do not fit the 32-bit offsets of the format.
+ */
+struct tokenset_frozen *tokenset_freeze(struct tokenset *p);
+
+/**
+ *  @brief Destructor for frozen tokensets.
+ *  @param fp Pointer to the pointer returned by tokenset_freeze().
+ */
+void        tokenset_frozen_free(struct tokenset_frozen **fp);
+
+/**
+ *  @brief Id of a token in a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @param n Token, a C string.
+ *  @returns The token's id, or -1 if it is not present.
+ */
+int         tokenset_frozen_id(const struct tokenset_frozen *f, const char *n);
+
+/**
+ *  @brief Id of a token of known length in a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The token's id, or -1 if it is not present.
+ */
+int         tokenset_frozen_id_n(const struct tokenset_frozen *f, const char *n, size_t len);
+
+/**
+ *  @brief Does a token of known length exist in a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns 1 if present, 0 otherwise.
+ */
+int         tokenset_frozen_exists_n(const struct tokenset_frozen *f, const char *n,
+                                     size_t len);
+
+/**
+ *  @brief Token by id in a frozen tokenset.
+ *  @details The returned bytes are NUL-terminated and live as long
+ *  as the frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @param id Identifier.
+ *  @param len If not NULL, receives the token's length, or 0 if
+ *  there is no token with this id.
+ *  @returns Pointer to the token, or NULL if there is none.
+ */
+const char *tokenset_frozen_get_by_id_n(const struct tokenset_frozen *f, unsigned id,
+                                        size_t *len);
+
+/**
+ *  @brief Number of tokens in a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @returns The number of tokens.
+ */
+size_t      tokenset_frozen_count(const struct tokenset_frozen *f);
+
+/**
+ *  @brief One more than the largest id in a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @returns The id limit of the tokenset it was frozen from.
+ */
+unsigned    tokenset_frozen_id_limit(const struct tokenset_frozen *f);
+
+/**
+ *  @brief Size of a frozen tokenset.
+ *  @param f Pointer to a frozen tokenset.
+ *  @returns Bytes taken by its tables and tokens.
+ */
+size_t      tokenset_frozen_bytes(const struct tokenset_frozen *f);
+
+/**
+ *  @brief Write a frozen tokenset to a file.
+ *  @details The file holds the token bytes, the id table and the
+ *  prebuilt hash index exactly as they sit in memory, in host byte
+ *  order. It is written to a uniquely named file next to path and
+ *  renamed into place, so processes that have the old file mapped
+ *  keep a consistent view and concurrent saves to one path do not
+ *  mix; the last to finish wins. The file is created mode 0644.
+ *  @param f Pointer to a frozen tokenset.
+ *  @param path File to create or replace.
+ *  @returns 0 on success, nonzero otherwise.
+ */
+int         tokenset_frozen_save(const struct tokenset_frozen *f, const char *path);
+
+/**
+ *  @brief Freeze a tokenset and write it to a file.
+ *  @details Same as tokenset_freeze() followed by tokenset_frozen_save().
+ *  @param p Pointer to a tokenset object.
+ *  @param path File to create or replace.
+ *  @returns 0 on success, nonzero otherwise.
+ */
+int         tokenset_save(struct tokenset *p, const char *path);
+
+/**
+ *  @brief Map a file written by tokenset_save() as a frozen tokenset.
+ *  @details Nothing is read or copied beyond the header, which is
+ *  checked against the file's size; lookups then run directly on the
+ *  mapped pages, shared through the page cache by every process that
+ *  maps the file. Release it with tokenset_frozen_free().
+ *  @param path File to map.
+ *  @returns A frozen tokenset, or NULL if the file cannot be mapped
+ *  or was not written by tokenset_save() on a machine of the same
+ *  byte order.
+ */
+struct tokenset_frozen *tokenset_open_mmap(const char *path);
+
+/**
+ *  @brief Dictionary matcher.
+ *  @details An automaton built by tokenset_build_matcher() that finds
+ *  every occurrence of every token of a tokenset inside a text in a
+ *  single pass, one table lookup per byte however many tokens there
+ *  are. Like a frozen tokenset it is never written after it is
+ *  built, so any number of threads may scan with it at once.
+ */
+struct tokenset_matcher;
+
+/**
+ *  @brief One occurrence of a token found by a matcher.
+ */
+struct tokenset_match {
+   size_t      offset;                           /* of the first byte, from the start of the text */
+   size_t      len;
+   unsigned    id;
+};
+
+/**
+ *  @brief Build a matcher for the tokens of a tokenset.
+ *  @details Compiles the tokens into an Aho-Corasick automaton whose
+ *  failure links are resolved ahead of time, so it is a plain DFA
+ *  over the byte values the tokens use. Empty tokens are left out.
+ *  The tokenset is not changed and may be freed afterwards; tokens
+ *  added later are not seen by the matcher.
+ *  @param p Pointer to a tokenset object.
+ *  @returns A new matcher, or NULL if memory runs out or the tokens
+ *  need more than 2^32 table entries.
+ */
+struct tokenset_matcher *tokenset_build_matcher(struct tokenset *p);
+
+/**
+ *  @brief Destructor for matchers.
+ *  @param mp Pointer to the pointer returned by tokenset_build_matcher().
+ */
+void        tokenset_matcher_free(struct tokenset_matcher **mp);
+
+/**
+ *  @brief Size of a matcher.
+ *  @param m Pointer to a matcher.
+ *  @returns Bytes taken by its tables.
+ */
+size_t      tokenset_matcher_bytes(const struct tokenset_matcher *m);
+
+/**
+ *  @brief Find every token occurring in a buffer.
+ *  @details Occurrences may overlap. They are reported in order of
+ *  their last byte and, among those ending at the same byte, longest
+ *  first.
+ *  @param[in] m Pointer to a matcher.
+ *  @param[in] buf Text to scan; need not be NUL-terminated.
+ *  @param[in] len Number of bytes in buf.
+ *  @param[in] cb If not NULL, called with the matches a few at a
+ *  time; the array is only valid during the call.
+ *  @param[in] arg Passed through to cb.
+ *  @returns Number of matches found.
+ */
+size_t      tokenset_match_buffer(const struct tokenset_matcher *m, const char *buf,
+                                  size_t len,
+                                  void (*cb) (void *arg, const struct tokenset_match *ms,
+                                              size_t n), void *arg);
+
+/**
+ *  @brief Find every token occurring in everything read from a file
+ *  descriptor.
+ *  @details Reads fd to end of file through a buffer of about 1 MB.
+ *  The automaton carries over from one read to the next, so tokens
+ *  cut by the end of a read are found, and offsets count from the
+ *  first byte read. Matches are reported as by tokenset_match_buffer().
+ *  @param[in] m Pointer to a matcher.
+ *  @param[in] fd File descriptor open for reading.
+ *  @param[in] cb If not NULL, called with the matches a few at a
+ *  time; the array is only valid during the call.
+ *  @param[in] arg Passed through to cb.
+ *  @param[out] nmatches If not NULL, receives the number of matches
+ *  found.
+ *  @returns 0 on success, -1 on a read error or if memory runs out.
+ */
+int         tokenset_match_fd(const struct tokenset_matcher *m, int fd,
+                              void (*cb) (void *arg, const struct tokenset_match *ms, size_t n),
+                              void *arg, size_t *nmatches);
+
+/**
+ *  @brief Packed tokenset.
+ *  @details A tokenset for very large vocabularies that keeps as
+ *  little as it can per token: the token bytes back to back in one
+ *  heap, a 32-bit offset into it per id and a flat table of 32-bit
+ *  ids. Ids are 0, 1, 2, ... in the order tokens were first added.
+ *  This is a separate type, not a mode of struct tokenset, and it only
+ *  adds and looks up: tokens cannot be removed, and there is no
+ *  iteration other than by id, no sorting and no saving or freezing.
+ *  The token bytes may total at most 4 GB.
+ *
+ *  The offsets and the heap grow by an eighth at a time. Once the set
+ *  holds a few hundred tokens and tokenset_packed_shrink() has given
+ *  that room back, or tokenset_packed_reserve() sized it up front, it
+ *  takes under 16 bytes per token besides the token bytes, against
+ *  about 80 for a tokenset, as tokenset_packed_bytes() reports. While
+ *  growing it may take up to an eighth of the token bytes more.
+ */
+struct tokenset_packed;
+
+/**
+ *  @brief Constructor for packed tokensets.
+ *  @param flags A TOKENSET_HASH_* flag or 0; other flags are ignored.
+ *  @returns On success a pointer to the new object, the NULL pointer
+ *  otherwise.
+ */
+struct tokenset_packed *tokenset_packed_new(unsigned flags);
+
+/**
+ *  @brief Destructor for packed tokensets.
+ *  @param kp Pointer to the pointer returned by tokenset_packed_new().
+ */
+void        tokenset_packed_free(struct tokenset_packed **kp);
+
+/**
+ *  @brief Make room for a known number of tokens.
+ *  @details Sizes the table, the offsets and the heap so that n tokens
+ *  of text_bytes bytes in all fit with no rehashing or reallocation.
+ *  @param k Pointer to a packed tokenset.
+ *  @param n Number of tokens to make room for.
+ *  @param text_bytes Total length of those tokens.
+ *  @returns 0 on success, nonzero if memory could not be allocated.
+ */
+int         tokenset_packed_reserve(struct tokenset_packed *k, size_t n, size_t text_bytes);
+
+/**
+ *  @brief Add a token of known length to a packed tokenset.
+ *  @details As tokenset_add_n(). Adding a new token may move the
+ *  heap, so pointers from tokenset_packed_get_by_id_n() only hold
+ *  until the next add.
+ *  @param k Pointer to a packed tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The token's id, or -1 if memory runs out or the set is full.
+ */
+int         tokenset_packed_add_n(struct tokenset_packed *k, const char *n, size_t len);
+
+/**
+ *  @brief Id of a token of known length in a packed tokenset.
+ *  @param k Pointer to a packed tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns The token's id, or -1 if it is not present.
+ */
+int         tokenset_packed_id_n(const struct tokenset_packed *k, const char *n, size_t len);
+
+/**
+ *  @brief Does a token of known length exist in a packed tokenset.
+ *  @param k Pointer to a packed tokenset.
+ *  @param n Pointer to the token bytes.
+ *  @param len Number of bytes in the token.
+ *  @returns 1 if present, 0 otherwise.
+ */
+int         tokenset_packed_exists_n(const struct tokenset_packed *k, const char *n,
+                                     size_t len);
+
+/**
+ *  @brief Token by id in a packed tokenset.
+ *  @details The returned bytes are NUL-terminated and valid until the
+ *  next tokenset_packed_add_n(), tokenset_packed_reserve() or
+ *  tokenset_packed_shrink().
+ *  @param k Pointer to a packed tokenset.
+ *  @param id Identifier.
+ *  @param len If not NULL, receives the token's length, or 0 if
+ *  there is no token with this id.
+ *  @returns Pointer to the token, or NULL if there is none.
+ */
+const char *tokenset_packed_get_by_id_n(const struct tokenset_packed *k, unsigned id,
+                                        size_t *len);
+
+/**
+ *  @brief Number of tokens in a packed tokenset.
+ *  @details Also one more than the largest id.
+ *  @param k Pointer to a packed tokenset.
+ *  @returns The number of tokens.
+ */
+size_t      tokenset_packed_count(const struct tokenset_packed *k);
+
+/**
+ *  @brief Size of a packed tokenset.
+ *  @param k Pointer to a packed tokenset.
+ *  @returns Bytes allocated for its table, offsets and heap.
+ */
+size_t      tokenset_packed_bytes(const struct tokenset_packed *k);
+
+/**
+ *  @brief Give back a packed tokenset's growth room.
+ *  @details Trims the offsets and the heap to what the tokens use, as
+ *  after a bulk load. Later adds grow them again. Pointers from
+ *  tokenset_packed_get_by_id_n() do not survive it. If memory cannot
+ *  be moved the set is left as it was.
+ *  @param k Pointer to a packed tokenset.
+ */
+void        tokenset_packed_shrink(struct tokenset_packed *k);
+
 /**
  *  @brief Return the version of this package
  *  @details TODO